@@ -0,0 +1,10 @@
+package java.lang;
+
+public class System{
+
+	public static void arraycopy(Object src, int srcPos, Object dst, int dstPos, int len){
+
+
+	}
+}
+
@@ -0,0 +1,55 @@
+package java.util;
+
+public class ArrayList<E>{
+
+	public ArrayList(){
+
+
+	}
+
+	public ArrayList(int cap){
+
+
+	}
+
+	public boolean add(E e){
+
+		return false;
+	}
+
+	public void add(int idx, E e){
+
+
+	}
+
+	public E get(int idx){
+
+		return null;
+	}
+
+	public E set(int idx, E e){
+
+		return null;
+	}
+
+	public E remove(int idx){
+
+		return null;
+	}
+
+	public int size(){
+
+		return 0;
+	}
+
+	public boolean isEmpty(){
+
+		return false;
+	}
+
+	public void clear(){
+
+
+	}
+}
+
@@ -0,0 +1,125 @@
+package java.util;
+
+public class Arrays{
+
+	public static void fill(byte[] a, byte v){
+
+
+	}
+
+	public static void fill(byte[] a, int from, int to, byte v){
+
+
+	}
+
+	public static void fill(boolean[] a, boolean v){
+
+
+	}
+
+	public static void fill(boolean[] a, int from, int to, boolean v){
+
+
+	}
+
+	public static void fill(char[] a, char v){
+
+
+	}
+
+	public static void fill(char[] a, int from, int to, char v){
+
+
+	}
+
+	public static void fill(short[] a, short v){
+
+
+	}
+
+	public static void fill(short[] a, int from, int to, short v){
+
+
+	}
+
+	public static void fill(int[] a, int v){
+
+
+	}
+
+	public static void fill(int[] a, int from, int to, int v){
+
+
+	}
+
+	public static void fill(float[] a, float v){
+
+
+	}
+
+	public static void fill(float[] a, int from, int to, float v){
+
+
+	}
+
+	public static void fill(long[] a, long v){
+
+
+	}
+
+	public static void fill(long[] a, int from, int to, long v){
+
+
+	}
+
+	public static void fill(double[] a, double v){
+
+
+	}
+
+	public static void fill(double[] a, int from, int to, double v){
+
+
+	}
+
+	public static void fill(Object[] a, Object v){
+
+
+	}
+
+	public static void fill(Object[] a, int from, int to, Object v){
+
+
+	}
+
+	public static boolean equals(byte[] a, byte[] b){
+
+		return false;
+	}
+
+	public static boolean equals(boolean[] a, boolean[] b){
+
+		return false;
+	}
+
+	public static boolean equals(char[] a, char[] b){
+
+		return false;
+	}
+
+	public static boolean equals(short[] a, short[] b){
+
+		return false;
+	}
+
+	public static boolean equals(int[] a, int[] b){
+
+		return false;
+	}
+
+	public static boolean equals(long[] a, long[] b){
+
+		return false;
+	}
+}
+
@@ -0,0 +1,50 @@
+package uj.lang;
+
+public class MiniStringBuilder{
+
+	public MiniStringBuilder(){
+
+
+	}
+
+	public MiniStringBuilder(int cap){
+
+
+	}
+
+	public StringBuilder append(String s){
+
+		return null;
+	}
+
+	public StringBuilder append(char c){
+
+		return null;
+	}
+
+	public StringBuilder append(int v){
+
+		return null;
+	}
+
+	public StringBuilder append(byte[] bytes){
+
+		return null;
+	}
+
+	public int length(){
+
+		return 0;
+	}
+
+	public void setLength(int len){
+
+
+	}
+
+	public String toString(){
+
+		return null;
+	}
+}
+
@@ -10,5 +10,15 @@ public class RT{
 	public static void threadCreate(Runnable what){
 	
 			
+	}
+	
+	public static void threadCreate(Runnable what, int priority){
+	
+			
+	}
+	
+	public static void threadSetPriority(int priority){
+	
+			
 	}
 }
\ No newline at end of file
@@ -0,0 +1,51 @@
+package uj.util;
+
+// growable byte FIFO, get() and peek() return -1 when empty
+public class ByteQueue{
+
+	public ByteQueue(){
+
+
+	}
+
+	public ByteQueue(int cap){
+
+
+	}
+
+	public void put(byte b){
+
+
+	}
+
+	public void write(byte[] b, int ofst, int len){
+
+
+	}
+
+	public int get(){
+
+		return 0;
+	}
+
+	public int peek(){
+
+		return 0;
+	}
+
+	public int read(byte[] b, int ofst, int len){
+
+		return 0;
+	}
+
+	public int size(){
+
+		return 0;
+	}
+
+	public void clear(){
+
+
+	}
+}
+
@@ -0,0 +1,51 @@
+package uj.util;
+
+// int keyed map, null values are not stored: put(k, null) removes k
+public class IntHashMap{
+
+	public IntHashMap(){
+
+
+	}
+
+	public IntHashMap(int cap){
+
+
+	}
+
+	public Object put(int key, Object val){
+
+		return null;
+	}
+
+	public Object get(int key){
+
+		return null;
+	}
+
+	public boolean containsKey(int key){
+
+		return false;
+	}
+
+	public Object remove(int key){
+
+		return null;
+	}
+
+	public int size(){
+
+		return 0;
+	}
+
+	public void clear(){
+
+
+	}
+
+	public int[] keys(){
+
+		return null;
+	}
+}
+
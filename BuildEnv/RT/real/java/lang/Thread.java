@@ -3,11 +3,25 @@ import uj.lang.*;
 
 public class Thread implements Runnable{
 
+	public static final int MIN_PRIORITY = 1;		//UJ_THREAD_PRIO_* in the VM
+	public static final int NORM_PRIORITY = 5;
+	public static final int MAX_PRIORITY = 10;
+
 	public Thread(Runnable what){
 	
 		uj.lang.RT.threadCreate(what);	
 	}
 	
+	public Thread(Runnable what, int priority){	//threads start right away, so this is how to pick theirs
+	
+		uj.lang.RT.threadCreate(what, priority);
+	}
+	
+	public static void setPriority(int priority){	//of the calling thread, clamped to MIN..MAX
+	
+		uj.lang.RT.threadSetPriority(priority);
+	}
+	
 	public void run(){
 	
 			
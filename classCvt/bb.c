@@ -96,6 +96,9 @@ static void bbVerifyNewType(const char *str, uint16_t len)
 {
 	if(!strncmp("java/lang/String", str, len)) return;
 	if(!strncmp("java/lang/StringBuilder", str, len)) return;
+	if(!strncmp("java/util/ArrayList", str, len)) return;
+	if(!strncmp("uj/util/IntHashMap", str, len)) return;
+	if(!strncmp("uj/util/ByteQueue", str, len)) return;
 
 	fprintf(stderr, "ERROR: Attempting to create instance of illegal class %.*s\n", len, str);
 	exit(-77);
@@ -495,6 +498,8 @@ static uint32_t bbPrvInstrExport(const Instr* i, uint8_t* buf, uint32_t pc){	//r
 
 	if(DBG) fprintf(stderr, "exporting %s %02X (nb=%" PRIu32 ")->", i->wide ? "wide" : "", i->type, i->numBytes);
 
+	if(i->type == INSTR_TYPE_NONE) return 0;
+
 	if(i->wide){
 		if(buf) *buf++ = INSTR_TYPE_WIDE;
 		len++;
@@ -10,6 +10,7 @@ struct BB;
 #define INSTR_TYPE_TABLESWITCH	0xAA
 #define INSTR_TYPE_LOOKUPSWITCH	0xAB
 #define INSTR_TYPE_PUSH_RAW	0xFE
+#define INSTR_TYPE_NONE		0xFD	//deleted by a pass, exports nothing
 
 typedef struct{
 
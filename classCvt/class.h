@@ -93,6 +93,8 @@ typedef struct{
 	uint16_t offset;
 	char type;
 
+	uint16_t stackDepth;		//exported with UJC_METHOD_FLAG_STACK_DEPTH (see UJC.h)
+
 }JavaMethodOrField;
 
 typedef struct{
@@ -143,6 +145,9 @@ typedef struct{
 	uint16_t numAttributes;
 	JavaAttribute** attributes;	//numAttributes items
 
+	uint16_t staticImageLen;
+	uint8_t* staticImage;		//staticImageLen bytes, exported with <clinit> (see UJC.h)
+
 }JavaClass;
 
 
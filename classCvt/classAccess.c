@@ -284,6 +284,7 @@ static JavaMethodOrField* classImportPrvReadMethodOrField(classImporterReadF rea
 	if(!classImportPrvReadU16(readF, readD, &ret->descrIdx)) ERR("Failed to read mathod descrIdx");
 
 	READ_X(numAttr, attributes, JavaAttribute, classImportPrvReadAttribute);
+	ret->stackDepth = 0;
 
 	return ret;
 fail:
@@ -829,6 +830,8 @@ void classFree(JavaClass* c){
 	}
 	natFree(c->attributes);
 
+	natFree(c->staticImage);
+
 	natFree(c);
 }
 
@@ -985,6 +988,8 @@ void classExport(JavaClass* c){
 				if(ja->type != J_ATTR_TYPE_CODE) continue;
 
 				code += ja->data.code.codeLen + 4 /*locals, stask sizes*/ + 2 /*num exceptions */ + (uint32_t)ja->data.code.numExceptions * 8;
+				if(c->methods[i]->accessFlags & UJC_METHOD_FLAG_STATIC_IMAGE) code += 2 + c->staticImageLen;
+				if(c->methods[i]->accessFlags & UJC_METHOD_FLAG_STACK_DEPTH) code += 2;
 			}
 		}
 
@@ -1265,6 +1270,8 @@ void classExport(JavaClass* c){
 
 			if(j != c->methods[i]->numAttr){	//have code
 
+				if(c->methods[i]->accessFlags & UJC_METHOD_FLAG_STATIC_IMAGE) addr += 2 + c->staticImageLen;
+				if(c->methods[i]->accessFlags & UJC_METHOD_FLAG_STACK_DEPTH) addr += 2;
 				codeAddr = addr + 4 + 2 + 8 * (uint32_t)ja->data.code.numExceptions;
 				addr += ja->data.code.codeLen + 4 + 2 + 8 * (uint32_t)ja->data.code.numExceptions;
 			}
@@ -1327,6 +1334,14 @@ void classExport(JavaClass* c){
 			}
 			if(j == c->methods[i]->numAttr) continue;	//no code -> nothing to do
 
+			//stack depth before all else, then the static image and its length
+			if(c->methods[i]->accessFlags & UJC_METHOD_FLAG_STACK_DEPTH) putU16(c->methods[i]->stackDepth);
+			if(c->methods[i]->accessFlags & UJC_METHOD_FLAG_STATIC_IMAGE){
+
+				for(addr = 0; addr < c->staticImageLen; addr++) putU8(c->staticImage[addr]);
+				putU16(c->staticImageLen);
+			}
+
 			//exception table first
 			for(addr = 0; addr < ja->data.code.numExceptions; addr++){
 
@@ -16,6 +16,7 @@ void classFree(JavaClass* c);
 
 //lower-level but still used externally
 void classFreeConstant(JavaConstant* f);
+void classFreeAttribute(JavaAttribute* f);
 
 #endif
 
@@ -6,6 +6,7 @@
 #include "classOptimizer.h"
 #include "classAccess.h"
 #include "bb.h"
+#include "../uJ/UJC.h"
 
 
 
@@ -346,59 +347,1007 @@ static void classOptPrvRemapAttrs(JavaAttribute** attributes,uint16_t numAttr, c
 	}
 }
 
-void classOptimize(JavaClass* c){
+static uint8_t classOptPrvTypeSize(char type){
+
+	switch(type){
+
+		case JAVA_TYPE_BYTE:
+		case JAVA_TYPE_BOOL:
+
+			return 1;
+
+		case JAVA_TYPE_CHAR:
+		case JAVA_TYPE_SHORT:
+
+			return 2;
+
+		case JAVA_TYPE_DOUBLE:
+		case JAVA_TYPE_LONG:
+
+			return 8;
+
+		default:
+
+			return 4;
+	}
+}
+
+static void classOptPrvCalcFieldOffsets(JavaClass* c){
+
+	uint16_t i, clsOfst = 0, instOfst = 0;
+	uint16_t* ofstP;
+	JavaString* s;
+
+	for(i = 0; i < c->numFields; i++){
+
+		ofstP = (c->fields[i]->accessFlags & ACCESS_FLAG_STATIC) ? &clsOfst : &instOfst;
+
+		s = (JavaString*)(c->constantPool[c->fields[i]->descrIdx - 1] + 1);
+
+		c->fields[i]->offset = *ofstP;
+		c->fields[i]->type = s->data[0];
+
+		(*ofstP) += classOptPrvTypeSize(s->data[0]);
+	}
+}
+
+static int32_t classOptPrvFindMethod(JavaClass* c, const char* name){	//index or -1
+
+	JavaString* s;
+	uint16_t i;
+
+	for(i = 0; i < c->numMethods; i++){
+
+		s = (JavaString*)(c->constantPool[c->methods[i]->nameIdx - 1] + 1);
+		if(s->len == strlen(name) && !memcmp(s->data, name, s->len)) return i;
+	}
+
+	return -1;
+}
+
+static int32_t classOptPrvFindCode(JavaMethodOrField* m){	//attribute index or -1
+
+	uint16_t i;
+
+	for(i = 0; i < m->numAttr; i++){
+
+		if(m->attributes[i]->type == J_ATTR_TYPE_CODE) return i;
+	}
+
+	return -1;
+}
+
+static void classOptPrvLoadCode(JavaClass* c, JavaAttribute* attrib){
+
+	uint16_t k;
+
+	bbInit(c, attrib->data.code.code, attrib->data.code.codeLen);
+	for(k = 0; k < attrib->data.code.numExceptions; k++){
+
+		bbAddExc(c, attrib->data.code.exceptions[k].start_pc,
+				attrib->data.code.exceptions[k].end_pc,
+				attrib->data.code.exceptions[k].handler_pc);
+	}
+	bbFinishLoading();
+}
+
+static void bbStaticImagePurityPassF(Instr* instrs, uint32_t numInstr, void *userData){
+
+	uint32_t i;
+	uint16_t idx;
+	Instr* instr = instrs;
+	JavaClass* c = ((void**)userData)[0];
+	bool* pureP = ((void**)userData)[1];
+
+	for(i = 0; i < numInstr; i++, instr++){
+
+		switch(instr->type){
+
+			case 0x12:			//ldc
+
+				idx = instr->bytes[0];
+				goto check_ldc;
+
+			case 0x13:			//ldc_w
+
+				idx = instr->bytes[0];
+				idx <<= 8;
+				idx += instr->bytes[1];
+		check_ldc:
+				if(c->constantPool[idx - 1]->type == JAVA_CONST_TYPE_CLASS) *pureP = false;
+				break;
+
+			case 0xB2:			//getstatic
+			case 0xB3:			//putstatic
+
+				//only our own statics: others may not be initialized yet on the host, or may not be pure
+				idx = instr->bytes[0];
+				idx <<= 8;
+				idx += instr->bytes[1];
+				if(((uint16_t*)(c->constantPool[idx - 1] + 1))[0] != c->thisClass) *pureP = false;
+				break;
+
+			case 0xB4:			//getfield
+			case 0xB5:			//putfield
+			case 0xB6:			//invokevirtual
+			case 0xB7:			//invokespecial
+			case 0xB8:			//invokestatic
+			case 0xB9:			//invokeinterface
+			case 0xBA:			//invokedynamic
+			case 0xBB:			//new
+			case 0xBD:			//anewarray
+			case 0xBF:			//athrow
+			case 0xC2:			//monitorenter
+			case 0xC3:			//monitorexit
+			case 0xC5:			//multianewarray
+
+				*pureP = false;
+				break;
+		}
+	}
+}
+
+bool classUseStaticImage(JavaClass* c, const uint8_t* image, uint16_t len){
 
 	JavaMethodOrField* m;
 	JavaAttribute* attrib;
-	uint16_t i, j, k, clsOfst = 0, instOfst = 0, newNumConsts, newDirectConsts = 1;
-	uint16_t* constantFMap = NULL;
-	uint16_t* constantRMap = NULL;
-	bool codeFound;
-	uint8_t sz;
+	JavaAttribute* newCode;
+	void* passData[2];
+	bool pure = true;
+	int32_t i, j;
 
-	//calculate fields' offsets
-	{
-		for(i = 0; i < c->numFields; i++){
 
-			JavaString* s;
-			uint16_t* ofstP;
+	i = classOptPrvFindMethod(c, "<clinit>");
+	if(i < 0) return false;	//nothing to replace
+	m = c->methods[i];
+
+	j = classOptPrvFindCode(m);
+	if(j < 0) return false;
+	attrib = m->attributes[j];
+
+	//the image only holds our statics, so <clinit> may not have done anything else
+	classOptPrvLoadCode(c, attrib);
+	passData[0] = c;
+	passData[1] = &pure;
+	bbPass(bbStaticImagePurityPassF, passData);
+	bbDestroy();
+
+	if(!pure){
+
+		fprintf(stderr, "<clinit> has side effects, not using static image\n");
+		return false;
+	}
+
+	newCode = natAlloc(sizeof(JavaAttribute) + 1);
+	if(!newCode){
+
+		fprintf(stderr, "fail to alloc new code\n");
+		exit(-50);
+	}
+	memcpy(newCode, attrib, sizeof(JavaAttribute));
+	newCode->data.code.maxStack = 0;
+	newCode->data.code.maxLocals = 0;
+	newCode->data.code.numExceptions = 0;
+	newCode->data.code.exceptions = NULL;
+	newCode->data.code.numAttributes = 0;
+	newCode->data.code.attributes = NULL;
+	newCode->data.code.codeLen = 1;
+	newCode->data.code.code[0] = 0xB1;	//return
+	m->attributes[j] = newCode;
+	classFreeAttribute(attrib);
+
+	c->staticImage = natAlloc(len);
+	if(!c->staticImage){
+
+		fprintf(stderr, "fail to alloc static image\n");
+		exit(-50);
+	}
+	memcpy(c->staticImage, image, len);
+	c->staticImageLen = len;
+	m->accessFlags |= UJC_METHOD_FLAG_STATIC_IMAGE;
+
+	return true;
+}
+
+/*
+	flash-resident arrays: a "private static final" array of primitives whose reference never
+	goes anywhere but straight into an xaload or arraylength can be left in the class file. We
+	hand it to the VM as a read-only static image entry (see UJC_IMAGE_TYPE_ROM_ARRAY in UJC.h)
+*/
 
-			ofstP = (c->fields[i]->accessFlags & ACCESS_FLAG_STATIC) ? &clsOfst : &instOfst;
+#define ROM_ARR_NO		0	//not a candidate, or the reference escapes
+#define ROM_ARR_UNSET		1	//candidate, never stored
+#define ROM_ARR_SET		2	//candidate, stored exactly once, in <clinit>
 
-			s = (JavaString*)(c->constantPool[c->fields[i]->descrIdx - 1] + 1);
+typedef struct{
 
-			switch(s->data[0]){
+	JavaClass* c;
+	uint8_t* state;		//ROM_ARR_* for each field
+	bool inClinit;
 
-				case JAVA_TYPE_BYTE:
-				case JAVA_TYPE_BOOL:
+	uint8_t* image;		//entries we made (65535 bytes)
+	uint32_t imageLen;
 
-					sz = 1;
-					break;
+}RomArrScan;
 
-				case JAVA_TYPE_CHAR:
-				case JAVA_TYPE_SHORT:
+static int32_t classOptPrvLocalField(JavaClass* c, const Instr* instr){	//field index of a field instr's target in this class or -1
 
-					sz = 2;
-					break;
+	uint16_t idx;
+	uint16_t* t;
+	uint16_t i;
+
+	idx = instr->bytes[0];
+	idx <<= 8;
+	idx += instr->bytes[1];
+
+	t = (uint16_t*)(c->constantPool[idx - 1] + 1);
+	if(t[0] != c->thisClass) return -1;
+	t = (uint16_t*)(c->constantPool[t[1] - 1] + 1);
 
-				case JAVA_TYPE_DOUBLE:
-				case JAVA_TYPE_LONG:
+	for(i = 0; i < c->numFields; i++){
 
-					sz = 8;
-					break;
+		if(c->fields[i]->nameIdx == t[0] && c->fields[i]->descrIdx == t[1]) return i;
+	}
+
+	return -1;
+}
+
+static bool classOptPrvStackEffect(JavaClass* c, const Instr* instr, uint8_t* popsP, uint8_t* pushesP){	//in slots. false for control flow and whatever else we do not model
+
+	static const uint8_t effects[] = {	//(pops << 4) | pushes
+		0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,	//00
+		0x01, 0x02, 0x02, 0x01, 0x01, 0x01, 0x02, 0x02,	//08
+		0x01, 0x01, 0x01, 0x01, 0x02, 0x01, 0x02, 0x01,	//10
+		0x02, 0x01, 0x01, 0x01, 0x01, 0x01, 0x02, 0x02,	//18
+		0x02, 0x02, 0x01, 0x01, 0x01, 0x01, 0x02, 0x02,	//20
+		0x02, 0x02, 0x01, 0x01, 0x01, 0x01, 0x21, 0x22,	//28
+		0x21, 0x22, 0x21, 0x21, 0x21, 0x21, 0x10, 0x20,	//30
+		0x10, 0x20, 0x10, 0x10, 0x10, 0x10, 0x10, 0x20,	//38
+		0x20, 0x20, 0x20, 0x10, 0x10, 0x10, 0x10, 0x20,	//40
+		0x20, 0x20, 0x20, 0x10, 0x10, 0x10, 0x10, 0x30,	//48
+		0x40, 0x30, 0x40, 0x30, 0x30, 0x30, 0x30, 0x10,	//50
+		0x20, 0x12, 0x23, 0x34, 0x24, 0x35, 0x46, 0x22,	//58
+		0x21, 0x42, 0x21, 0x42, 0x21, 0x42, 0x21, 0x42,	//60
+		0x21, 0x42, 0x21, 0x42, 0x21, 0x42, 0x21, 0x42,	//68
+		0x21, 0x42, 0x21, 0x42, 0x11, 0x22, 0x11, 0x22,	//70
+		0x21, 0x32, 0x21, 0x32, 0x21, 0x32, 0x21, 0x42,	//78
+		0x21, 0x42, 0x21, 0x42, 0x00, 0x12, 0x11, 0x12,	//80
+		0x21, 0x21, 0x22, 0x11, 0x12, 0x12, 0x21, 0x22,	//88
+		0x21, 0x11, 0x11, 0x11, 0x41, 0x21, 0x21, 0x41,	//90
+		0x41,						//98
+	};
+	uint16_t idx;
+	uint16_t* t;
+	JavaString* s;
+	const char* cp;
+	uint8_t n;
 
-				default:
+	if(instr->type < sizeof(effects)){
 
-					sz = 4;
-					break;
+		*popsP = effects[instr->type] >> 4;
+		*pushesP = effects[instr->type] & 0x0F;
+		return true;
+	}
+
+	idx = instr->bytes[0];
+	idx <<= 8;
+	idx += instr->bytes[1];
+
+	switch(instr->type){
+
+		case 0xB2:			//getstatic
+		case 0xB3:			//putstatic
+		case 0xB4:			//getfield
+		case 0xB5:			//putfield
+
+			t = (uint16_t*)(c->constantPool[idx - 1] + 1);
+			t = (uint16_t*)(c->constantPool[t[1] - 1] + 1);
+			s = (JavaString*)(c->constantPool[t[1] - 1] + 1);
+			n = (s->data[0] == JAVA_TYPE_LONG || s->data[0] == JAVA_TYPE_DOUBLE) ? 2 : 1;
+
+			*popsP = (instr->type == 0xB3 || instr->type == 0xB5) ? n : 0;
+			if(instr->type == 0xB4 || instr->type == 0xB5) (*popsP)++;
+			*pushesP = (instr->type == 0xB2 || instr->type == 0xB4) ? n : 0;
+			return true;
+
+		case 0xB6:			//invokevirtual
+		case 0xB7:			//invokespecial
+		case 0xB8:			//invokestatic
+		case 0xB9:			//invokeinterface
+
+			t = (uint16_t*)(c->constantPool[idx - 1] + 1);
+			t = (uint16_t*)(c->constantPool[t[1] - 1] + 1);
+			s = (JavaString*)(c->constantPool[t[1] - 1] + 1);
+
+			n = (instr->type == 0xB8) ? 0 : 1;
+			for(cp = s->data + 1; *cp != ')'; cp++){
+
+				if(*cp == JAVA_TYPE_ARRAY) continue;
+				if(*cp == JAVA_TYPE_OBJ) while(*cp != JAVA_TYPE_OBJ_END) cp++;
+				else if((*cp == JAVA_TYPE_LONG || *cp == JAVA_TYPE_DOUBLE) && cp[-1] != JAVA_TYPE_ARRAY) n++;
+				n++;
 			}
+			*popsP = n;
+			cp++;
+			*pushesP = (*cp == 'V') ? 0 : ((*cp == JAVA_TYPE_LONG || *cp == JAVA_TYPE_DOUBLE) ? 2 : 1);
+			return true;
+
+		case 0xBB:			//new
+
+			*popsP = 0;
+			*pushesP = 1;
+			return true;
+
+		case 0xBC:			//newarray
+		case 0xBD:			//anewarray
+		case 0xBE:			//arraylength
+		case 0xC0:			//checkcast
+		case 0xC1:			//instanceof
+
+			*popsP = 1;
+			*pushesP = 1;
+			return true;
+
+		case 0xC5:			//multianewarray
+
+			*popsP = instr->bytes[2];
+			*pushesP = 1;
+			return true;
+	}
+
+	return false;
+}
+
+static bool classOptPrvOnlyIndexed(JavaClass* c, const Instr* instrs, uint32_t numInstr){	//instrs[0] pushed an array ref: is it consumed by xaload/arraylength in this block?
+
+	uint8_t pops, pushes;
+	uint32_t i, depth = 0;	//slots on top of the ref
+
+	for(i = 1; i < numInstr; i++){
+
+		if(instrs[i].type >= 0x2E && instrs[i].type <= 0x35 && depth == 1) return true;	//xaload
+		if(instrs[i].type == 0xBE && !depth) return true;				//arraylength
+		if(!classOptPrvStackEffect(c, instrs + i, &pops, &pushes) || pops > depth) return false;
+		depth = depth - pops + pushes;
+	}
+
+	return false;
+}
+
+static bool classOptPrvConst(JavaClass* c, const Instr* instr, uint32_t* hiP, uint32_t* loP){	//value of a constant push (hi is for longs/doubles)
+
+	static const uint32_t fconsts[] = {0x00000000, 0x3F800000, 0x40000000};
+	JavaConstant* jc;
+	uint16_t idx;
+
+	*hiP = 0;
+
+	switch(instr->type){
+
+		case 0x02 ... 0x08:		//iconst_m1 .. iconst_5
+
+			*loP = (int32_t)instr->type - 0x03;
+			return true;
+
+		case 0x09 ... 0x0A:		//lconst_0 .. lconst_1
 
-			c->fields[i]->offset = *ofstP;
-			c->fields[i]->type = s->data[0];
+			*loP = instr->type - 0x09;
+			return true;
 
-			(*ofstP) += sz;
+		case 0x0B ... 0x0D:		//fconst_0 .. fconst_2
+
+			*loP = fconsts[instr->type - 0x0B];
+			return true;
+
+		case 0x0E ... 0x0F:		//dconst_0 .. dconst_1
+
+			*hiP = (instr->type == 0x0F) ? 0x3FF00000 : 0;
+			*loP = 0;
+			return true;
+
+		case 0x10:			//bipush
+
+			*loP = (int8_t)instr->bytes[0];
+			return true;
+
+		case 0x11:			//sipush
+
+			*loP = (int16_t)((instr->bytes[0] << 8) | instr->bytes[1]);
+			return true;
+
+		case 0x12:			//ldc
+
+			idx = instr->bytes[0];
+			break;
+
+		case 0x13:			//ldc_w
+		case 0x14:			//ldc2_w
+
+			idx = instr->bytes[0];
+			idx <<= 8;
+			idx += instr->bytes[1];
+			break;
+
+		default:
+
+			return false;
+	}
+
+	jc = c->constantPool[idx - 1];
+	switch(jc->type){
+
+		case JAVA_CONST_TYPE_INT:
+		case JAVA_CONST_TYPE_FLOAT:
+
+			*loP = *(uint32_t*)(jc + 1);
+			return true;
+
+		case JAVA_CONST_TYPE_LONG:
+		case JAVA_CONST_TYPE_DOUBLE:
+
+			*hiP = ((uint32_t*)(jc + 1))[1];
+			*loP = ((uint32_t*)(jc + 1))[0];
+			return true;
+	}
+
+	return false;
+}
+
+static void classOptPrvPutBE(uint8_t* dst, uint32_t val, uint8_t sz){
+
+	while(sz--) *dst++ = val >> (sz * 8);
+}
+
+static void bbRomArrScanPassF(Instr* instrs, uint32_t numInstr, void *userData){
+
+	RomArrScan* rs = (RomArrScan*)userData;
+	uint32_t i;
+	int32_t f;
+
+	for(i = 0; i < numInstr; i++){
+
+		if(instrs[i].type != 0xB2 && instrs[i].type != 0xB3) continue;
+
+		f = classOptPrvLocalField(rs->c, instrs + i);
+		if(f < 0 || rs->state[f] == ROM_ARR_NO) continue;
+
+		if(instrs[i].type == 0xB2){			//getstatic
+
+			if(!classOptPrvOnlyIndexed(rs->c, instrs + i, numInstr - i)) rs->state[f] = ROM_ARR_NO;
 		}
+		else if(rs->inClinit && rs->state[f] == ROM_ARR_UNSET) rs->state[f] = ROM_ARR_SET;
+		else rs->state[f] = ROM_ARR_NO;			//stored again or outside of <clinit>
 	}
+}
+
+static void bbRomArrInitPassF(Instr* instrs, uint32_t numInstr, void *userData){	//find what javac makes of "T[] X = {...}" and turn it into image entries
+
+	static const char elemTypes[] = "ZCFDBSIJ";	//by newarray type, starting at 4
+	static const uint8_t storeInstrs[] = {0x54, 0x55, 0x51, 0x52, 0x54, 0x56, 0x4F, 0x50};
+	RomArrScan* rs = (RomArrScan*)userData;
+	JavaClass* c = rs->c;
+	uint32_t i, j, k, len, idx, hi, lo, entrySz;
+	uint8_t type, sz;
+	uint8_t* entry;
+	JavaString* s;
+	int32_t f;
+
+	for(i = 1; i < numInstr; i++){
+
+		// <len>; newarray; { dup; <idx>; <val>; xastore; }* putstatic
+		if(instrs[i].type != 0xBC || !classOptPrvConst(c, instrs + i - 1, &hi, &len)) continue;
+		if(instrs[i].bytes[0] < 4 || instrs[i].bytes[0] > 11 || len > 0xFFFFFF) continue;
+		type = instrs[i].bytes[0] - 4;
+		sz = classOptPrvTypeSize(elemTypes[type]);
+
+		for(j = i + 1; j + 3 < numInstr; j += 4){
+
+			if(instrs[j].type != 0x59 || instrs[j + 3].type != storeInstrs[type]) break;
+			if(!classOptPrvConst(c, instrs + j + 1, &hi, &idx) || idx >= len) break;
+			if(!classOptPrvConst(c, instrs + j + 2, &hi, &lo)) break;
+		}
+		if(j == numInstr || instrs[j].type != 0xB3) continue;
+
+		f = classOptPrvLocalField(c, instrs + j);
+		if(f < 0 || rs->state[f] != ROM_ARR_SET) continue;
+		s = (JavaString*)(c->constantPool[c->fields[f]->descrIdx - 1] + 1);
+		if(s->data[1] != elemTypes[type]) continue;
+
+		entrySz = 7 + len * sz;
+		if(rs->imageLen + entrySz > 0xFFFF) continue;
+
+		entry = rs->image + rs->imageLen;
+		rs->imageLen += entrySz;
+		classOptPrvPutBE(entry + 0, c->fields[f]->offset, 2);
+		entry[2] = UJC_IMAGE_TYPE_ROM_ARRAY;
+		entry[3] = elemTypes[type];
+		classOptPrvPutBE(entry + 4, len, 3);
+		memset(entry + 7, 0, len * sz);
+
+		for(k = i + 1; k < j; k += 4){
+
+			classOptPrvConst(c, instrs + k + 1, &hi, &idx);
+			classOptPrvConst(c, instrs + k + 2, &hi, &lo);
+			if(sz == 8){
+
+				classOptPrvPutBE(entry + 7 + idx * 8, hi, 4);
+				classOptPrvPutBE(entry + 11 + idx * 8, lo, 4);
+			}
+			else classOptPrvPutBE(entry + 7 + idx * sz, lo, sz);
+		}
+
+		for(k = i - 1; k <= j; k++){
+
+			instrs[k].type = INSTR_TYPE_NONE;
+			instrs[k].wide = 0;
+			instrs[k].numBytes = 0;
+		}
+
+		if(DEBUG) fprintf(stderr, "field %d left in flash (%" PRIu32 " elements)\n", f, len);
+		i = j;
+	}
+}
+
+static void classOptPrvRomArrRetypeImage(JavaClass* c, const uint8_t* state){	//host already ran <clinit>: keep eligible arrays where the image has them
+
+	uint8_t* img = c->staticImage;
+	uint32_t pos = 0, len;
+	uint16_t ofst, i;
+	uint8_t type;
+
+	while(pos + 3 <= c->staticImageLen){
+
+		ofst = (img[pos] << 8) | img[pos + 1];
+		type = img[pos + 2];
+		pos += 3;
+
+		switch(type){
+
+			case JAVA_TYPE_OBJ:
+
+				pos += 2 + ((img[pos] << 8) | img[pos + 1]);
+				break;
+
+			case JAVA_TYPE_ARRAY:
+
+				for(i = 0; i < c->numFields; i++){
+
+					if(state[i] == ROM_ARR_UNSET && c->fields[i]->offset == ofst) img[pos - 1] = UJC_IMAGE_TYPE_ROM_ARRAY;
+				}
+				len = (((uint32_t)img[pos + 1]) << 16) | (img[pos + 2] << 8) | img[pos + 3];
+				pos += 4 + len * classOptPrvTypeSize(img[pos]);
+				break;
+
+			default:
+
+				pos += classOptPrvTypeSize(type);
+				break;
+		}
+	}
+}
+
+void classUseRomArrays(JavaClass* c){
+
+	static uint8_t image[0xFFFF];
+	JavaMethodOrField* m;
+	JavaAttribute* attrib;
+	JavaAttribute* newCode;
+	JavaString* s;
+	RomArrScan rs;
+	int32_t clinit, j;
+	uint32_t len;
+	bool any = false;
+	uint16_t i;
+
+
+	//nestmates may touch our private fields in code we never get to see
+	for(i = 0; i < c->numAttributes; i++){
+
+		s = (JavaString*)(c->constantPool[c->attributes[i]->nameIdx - 1] + 1);
+		if((s->len == 11 && !memcmp(s->data, "NestMembers", 11)) || (s->len == 8 && !memcmp(s->data, "NestHost", 8))) return;
+	}
+
+	rs.c = c;
+	rs.image = image;
+	rs.imageLen = 0;
+	rs.state = natAlloc(c->numFields);
+	if(!rs.state){
+
+		fprintf(stderr, "fail to alloc field states\n");
+		exit(-50);
+	}
+
+	for(i = 0; i < c->numFields; i++){
+
+		s = (JavaString*)(c->constantPool[c->fields[i]->descrIdx - 1] + 1);
+		rs.state[i] = ROM_ARR_NO;
+
+		if((c->fields[i]->accessFlags & (ACCESS_FLAG_PRIVATE | ACCESS_FLAG_STATIC | ACCESS_FLAG_FINAL)) !=
+				(ACCESS_FLAG_PRIVATE | ACCESS_FLAG_STATIC | ACCESS_FLAG_FINAL)) continue;
+		if(s->len != 2 || s->data[0] != JAVA_TYPE_ARRAY || s->data[1] == JAVA_TYPE_ARRAY || s->data[1] == JAVA_TYPE_OBJ) continue;
+
+		rs.state[i] = ROM_ARR_UNSET;
+		any = true;
+	}
+	if(!any){
+
+		natFree(rs.state);
+		return;
+	}
+
+	classOptPrvCalcFieldOffsets(c);
+	clinit = classOptPrvFindMethod(c, "<clinit>");
+
+	for(i = 0; i < c->numMethods; i++){
+
+		j = classOptPrvFindCode(c->methods[i]);
+		if(j < 0) continue;
+
+		rs.inClinit = (i == clinit);
+		classOptPrvLoadCode(c, c->methods[i]->attributes[j]);
+		bbPass(bbRomArrScanPassF, &rs);
+		bbDestroy();
+	}
+
+	if(c->staticImage) classOptPrvRomArrRetypeImage(c, rs.state);
+	else if(clinit >= 0 && (j = classOptPrvFindCode(c->methods[clinit])) >= 0){
+
+		m = c->methods[clinit];
+		attrib = m->attributes[j];
+
+		if(!attrib->data.code.numExceptions){	//removed code could leave an empty try range
+
+			classOptPrvLoadCode(c, attrib);
+			bbPass(bbRomArrInitPassF, &rs);
+
+			if(rs.imageLen){
+
+				bbFinalizeChanges();
+				len = bbExport(NULL);
+				newCode = natAlloc(sizeof(JavaAttribute) + len);
+				c->staticImage = natAlloc(rs.imageLen);
+				if(!newCode || !c->staticImage){
+
+					fprintf(stderr, "fail to alloc new code (sz=%" PRIu32 ")\n", len);
+					exit(-50);
+				}
+				memcpy(newCode, attrib, sizeof(JavaAttribute));
+				natFree(attrib);
+				m->attributes[j] = newCode;
+				newCode->data.code.codeLen = len;
+				bbExport(newCode->data.code.code);
+
+				memcpy(c->staticImage, image, rs.imageLen);
+				c->staticImageLen = rs.imageLen;
+				m->accessFlags |= UJC_METHOD_FLAG_STATIC_IMAGE;
+			}
+			bbDestroy();
+		}
+	}
+
+	natFree(rs.state);
+}
+
+/*
+	stack analysis: a thread started in main(), run() or a <clinit> never needs more stack than its
+	deepest call chain. A frame costs what the VM takes for it: return info, locals and operands.
+	Virtual and interface calls may land in any override among the classes we were given. Natives
+	run on the caller's operands, and so does all of java/lang/Object and the classes the VM itself
+	implements (the ones given after "firstNative", whose java bodies never run). A call into a class
+	we were not given, or recursion, leaves the depth unknown
+*/
+
+#define STK_RET_INFO_SZ		3		//THREAD_RET_INFO_SZ in the VM
+#define STK_UNBOUNDED		0xFFFFFFFFUL	//recursion
+#define STK_UNKNOWN		0xFFFFFFFEUL	//calls code we do not have
+
+#define STK_NEW			0
+#define STK_BUSY		1
+#define STK_DONE		2
+
+typedef struct{
+
+	JavaClass** classes;
+	uint16_t numClasses;
+	uint16_t firstNative;	//classes from here on are native in the VM
+	uint8_t** state;		//STK_*, per method of each class
+	uint32_t** depth;		//in slots, per method of each class
+
+}StkState;
+
+typedef struct{
+
+	uint16_t* consts;		//method constant of each invoke
+	uint8_t* instrs;		//and the invoke itself
+	uint32_t num;
+
+}StkCalls;
+
+static JavaString* classOptPrvUtf8(JavaClass* c, uint16_t idx){
+
+	return (JavaString*)(c->constantPool[idx - 1] + 1);
+}
+
+static JavaString* classOptPrvClassName(JavaClass* c, uint16_t idx){	//name of a class constant
+
+	return classOptPrvUtf8(c, *(uint16_t*)(c->constantPool[idx - 1] + 1));
+}
+
+static bool classOptPrvStrEq(const JavaString* a, const JavaString* b){
+
+	return a->len == b->len && !memcmp(a->data, b->data, a->len);
+}
+
+static bool classOptPrvStrIs(const JavaString* s, const char* str){
+
+	return s->len == strlen(str) && !memcmp(s->data, str, s->len);
+}
+
+static int32_t classStkPrvFindClass(StkState* st, const JavaString* name){	//index or -1
+
+	uint16_t i;
+
+	for(i = 0; i < st->numClasses; i++){
+
+		if(classOptPrvStrEq(classOptPrvClassName(st->classes[i], st->classes[i]->thisClass), name)) return i;
+	}
+
+	return -1;
+}
+
+static int32_t classStkPrvFindMethod(JavaClass* c, const JavaString* name, const JavaString* type){	//index or -1
+
+	uint16_t i;
+
+	for(i = 0; i < c->numMethods; i++){
+
+		if(classOptPrvStrEq(classOptPrvUtf8(c, c->methods[i]->nameIdx), name) &&
+				classOptPrvStrEq(classOptPrvUtf8(c, c->methods[i]->descrIdx), type)) return i;
+	}
+
+	return -1;
+}
+
+static bool classStkPrvIsA(StkState* st, int32_t ci, const JavaString* name){	//is class "ci" or anything above it called "name"?
+
+	JavaClass* c;
+	JavaString* s;
+	uint16_t i;
+	int32_t j;
+
+	if(classOptPrvStrEq(classOptPrvClassName(st->classes[ci], st->classes[ci]->thisClass), name)) return true;
+
+	while(ci >= 0){
+
+		c = st->classes[ci];
+		for(i = 0; i < c->numInterfaces; i++){
+
+			s = classOptPrvClassName(c, c->interfaces[i]);
+			if(classOptPrvStrEq(s, name)) return true;
+			j = classStkPrvFindClass(st, s);
+			if(j >= 0 && classStkPrvIsA(st, j, name)) return true;
+		}
+		if(!c->superClass) break;
+
+		s = classOptPrvClassName(c, c->superClass);
+		if(classOptPrvStrEq(s, name)) return true;
+		ci = classStkPrvFindClass(st, s);
+	}
+
+	return false;
+}
+
+static void bbStackCallsPassF(Instr* instrs, uint32_t numInstr, void *userData){
+
+	StkCalls* calls = userData;
+	uint32_t i;
+
+	for(i = 0; i < numInstr; i++){
+
+		if(instrs[i].type < 0xB6 || instrs[i].type > 0xB9) continue;	//invokevirtual..invokeinterface
+
+		calls->consts = realloc(calls->consts, sizeof(uint16_t[calls->num + 1]));
+		calls->instrs = realloc(calls->instrs, sizeof(uint8_t[calls->num + 1]));
+		if(!calls->consts || !calls->instrs){
+
+			fprintf(stderr, "fail to alloc call list\n");
+			exit(-50);
+		}
+		calls->consts[calls->num] = (((uint16_t)instrs[i].bytes[0]) << 8) + instrs[i].bytes[1];
+		calls->instrs[calls->num++] = instrs[i].type;
+	}
+}
+
+static uint32_t classStkPrvDepth(StkState* st, uint16_t ci, uint16_t mi);
+
+static uint32_t classStkPrvResolve(StkState* st, const JavaString* clsName, const JavaString* name, const JavaString* type){	//depth of what a call on class "clsName" runs
+
+	JavaClass* c;
+	int32_t ci, mi;
+
+	while(1){
+
+		if(classOptPrvStrIs(clsName, "java/lang/Object")) return 0;	//all native in the VM
+		ci = classStkPrvFindClass(st, clsName);
+		if(ci < 0){
+
+			fprintf(stderr, "call into %.*s, which was not given, stack use is unknown\n", clsName->len, clsName->data);
+			return STK_UNKNOWN;
+		}
+
+		if(ci >= st->firstNative) return 0;
+
+		c = st->classes[ci];
+		mi = classStkPrvFindMethod(c, name, type);
+		if(mi >= 0) return classStkPrvDepth(st, ci, mi);
+		if(!c->superClass) return 0;
+		clsName = classOptPrvClassName(c, c->superClass);
+	}
+}
+
+static uint32_t classStkPrvCallDepth(StkState* st, JavaClass* c, uint8_t instr, uint16_t idx){	//worst of all the places an invoke may land in
+
+	const uint16_t* t = (uint16_t*)(c->constantPool[idx - 1] + 1);
+	const uint16_t* nt = (uint16_t*)(c->constantPool[t[1] - 1] + 1);
+	const JavaString* clsName = classOptPrvClassName(c, t[0]);
+	const JavaString* name = classOptPrvUtf8(c, nt[0]);
+	const JavaString* type = classOptPrvUtf8(c, nt[1]);
+	uint32_t ret, d;
+	uint16_t i;
+
+	ret = classStkPrvResolve(st, clsName, name, type);
+
+	if(instr == 0xB6 || instr == 0xB9){	//invokevirtual/invokeinterface: any override may run
+
+		for(i = 0; i < st->numClasses && ret < STK_UNKNOWN; i++){
+
+			if(!classStkPrvIsA(st, i, clsName)) continue;
+			d = classStkPrvResolve(st, classOptPrvClassName(st->classes[i], st->classes[i]->thisClass), name, type);
+			if(d > ret) ret = d;
+		}
+	}
+
+	return ret;
+}
+
+static uint32_t classStkPrvDepth(StkState* st, uint16_t ci, uint16_t mi){
+
+	JavaClass* c = st->classes[ci];
+	JavaMethodOrField* m = c->methods[mi];
+	StkCalls calls = {NULL, NULL, 0};
+	JavaAttribute* attrib;
+	uint32_t i, d, callees = 0, ret = 0;	//natives and abstract methods take no frame
+	int32_t j;
+
+	if(st->state[ci][mi] == STK_DONE) return st->depth[ci][mi];
+	if(st->state[ci][mi] == STK_BUSY){
+
+		JavaString* cn = classOptPrvClassName(c, c->thisClass);
+		JavaString* n = classOptPrvUtf8(c, m->nameIdx);
+		JavaString* t = classOptPrvUtf8(c, m->descrIdx);
+
+		fprintf(stderr, "recursion through %.*s.%.*s%.*s, stack use is unbounded\n", cn->len, cn->data, n->len, n->data, t->len, t->data);
+		return STK_UNBOUNDED;
+	}
+	st->state[ci][mi] = STK_BUSY;
+
+	j = classOptPrvFindCode(m);
+	if(j >= 0){
+
+		attrib = m->attributes[j];
+		classOptPrvLoadCode(c, attrib);
+		bbPass(bbStackCallsPassF, &calls);
+		bbDestroy();
+
+		ret = STK_RET_INFO_SZ + (uint32_t)attrib->data.code.maxLocals + attrib->data.code.maxStack;
+		for(i = 0; i < calls.num; i++){
+
+			d = classStkPrvCallDepth(st, c, calls.instrs[i], calls.consts[i]);
+			if(d >= STK_UNKNOWN){
+
+				ret = d;
+				break;
+			}
+			if(d > callees) callees = d;
+		}
+		if(ret < STK_UNKNOWN) ret += callees;
+
+		free(calls.consts);
+		free(calls.instrs);
+	}
+
+	st->state[ci][mi] = STK_DONE;
+	st->depth[ci][mi] = ret;
+
+	return ret;
+}
+
+void classStackDepths(JavaClass** classes, uint16_t num, uint16_t firstNative, FILE* f){
+
+	JavaString *cn, *n, *t;
+	StkState st;
+	uint32_t d;
+	uint16_t i, j;
+
+	st.classes = classes;
+	st.numClasses = num;
+	st.firstNative = firstNative;
+	st.state = malloc(sizeof(uint8_t*[num]));
+	st.depth = malloc(sizeof(uint32_t*[num]));
+	if(!st.state || !st.depth){
+
+		fprintf(stderr, "fail to alloc stack analysis state\n");
+		exit(-50);
+	}
+	for(i = 0; i < num; i++){
+
+		st.state[i] = calloc(classes[i]->numMethods + 1, sizeof(uint8_t));
+		st.depth[i] = calloc(classes[i]->numMethods + 1, sizeof(uint32_t));
+		if(!st.state[i] || !st.depth[i]){
+
+			fprintf(stderr, "fail to alloc stack analysis state\n");
+			exit(-50);
+		}
+	}
+
+	for(i = 0; i < firstNative; i++){
+
+		cn = classOptPrvClassName(classes[i], classes[i]->thisClass);
+		for(j = 0; j < classes[i]->numMethods; j++){
+
+			n = classOptPrvUtf8(classes[i], classes[i]->methods[j]->nameIdx);
+			t = classOptPrvUtf8(classes[i], classes[i]->methods[j]->descrIdx);
+			if(!classOptPrvStrIs(n, "main") && !classOptPrvStrIs(n, "<clinit>") &&
+					!(classOptPrvStrIs(n, "run") && classOptPrvStrIs(t, "()V"))) continue;
+
+			d = classStkPrvDepth(&st, i, j);
+			fprintf(f, "%.*s %.*s %.*s %" PRIu32 "\n", cn->len, cn->data, n->len, n->data, t->len, t->data,
+					d >= STK_UNKNOWN ? 0 : d);
+		}
+	}
+
+	for(i = 0; i < num; i++){
+
+		free(st.state[i]);
+		free(st.depth[i]);
+	}
+	free(st.state);
+	free(st.depth);
+}
+
+void classUseStackDepths(JavaClass* c, FILE* f){
+
+	char cls[256], name[256], type[256];
+	unsigned long depth;
+	uint16_t i;
+
+	rewind(f);
+	while(fscanf(f, "%255s %255s %255s %lu", cls, name, type, &depth) == 4){
+
+		if(!depth || depth > 0xFFFF) continue;	//recursive or just too deep: the VM uses its default
+		if(!classOptPrvStrIs(classOptPrvClassName(c, c->thisClass), cls)) continue;
+
+		for(i = 0; i < c->numMethods; i++){
+
+			if(!classOptPrvStrIs(classOptPrvUtf8(c, c->methods[i]->nameIdx), name)) continue;
+			if(!classOptPrvStrIs(classOptPrvUtf8(c, c->methods[i]->descrIdx), type)) continue;
+
+			c->methods[i]->stackDepth = depth;
+			c->methods[i]->accessFlags |= UJC_METHOD_FLAG_STACK_DEPTH;
+		}
+	}
+}
+
+void classOptimize(JavaClass* c){
+
+	JavaMethodOrField* m;
+	JavaAttribute* attrib;
+	uint16_t i, j, k, newNumConsts, newDirectConsts = 1;
+	uint16_t* constantFMap = NULL;
+	uint16_t* constantRMap = NULL;
+	bool codeFound;
+
+	classOptPrvCalcFieldOffsets(c);
 
 	//perform code optimization pass(es) and mark all used constants
 	{
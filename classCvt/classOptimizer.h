@@ -1,11 +1,26 @@
 #ifndef _CLASS_OPTIMIZER_H_
 #define _CLASS_OPTIMIZER_H_
 
+#include <stdio.h>
+
 #include "common.h"
 #include "class.h"
 
 void classOptimize(JavaClass* c);
 
+//replace <clinit> with a static image made by the VM on the build host (call before classOptimize)
+bool classUseStaticImage(JavaClass* c, const uint8_t* image, uint16_t len);
+
+//leave never-written private static final primitive arrays in flash (call after classUseStaticImage)
+void classUseRomArrays(JavaClass* c);
+
+//whole program: worst case stack slots of threads starting in main(), run() or <clinit> of these classes, as text lines to "f" (0 if recursive)
+//classes from "firstNative" on are implemented by the VM and cost their callers nothing
+void classStackDepths(JavaClass** classes, uint16_t num, uint16_t firstNative, FILE* f);
+
+//take the depths of this class's entry points from such a file
+void classUseStackDepths(JavaClass* c, FILE* f);
+
 
 
 
@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 
@@ -44,9 +45,96 @@ uint16_t classReadF(_UNUSED_ void* ptr){
 	return (c == EOF) ? CLASS_IMPORT_READ_F_FAIL : (uint16_t)(uint8_t)c;
 }
 
-int main(_UNUSED_ int argc, _UNUSED_ char** argv){
+static uint16_t classReadFileF(void* ptr){
+
+	int c = getc((FILE*)ptr);
+
+	return (c == EOF) ? CLASS_IMPORT_READ_F_FAIL : (uint16_t)(uint8_t)c;
+}
+
+static uint8_t gStaticImage[65535];
+
+static int32_t loadStaticImage(const char* path){
+
+	FILE* f = fopen(path, "rb");
+	size_t len;
+
+	if(!f){
+
+		fprintf(stderr, "Failed to open static image '%s'\n", path);
+		return -1;
+	}
+	len = fread(gStaticImage, 1, sizeof(gStaticImage), f);
+	if(!feof(f)){
+
+		fprintf(stderr, "Static image '%s' is too big\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	return len;
+}
+
+static int stackDepths(const char* outPath, int num, char** paths){	//classCvt -a
+
+	JavaClass** classes;
+	int i, firstNative = num;
+	FILE* f;
+
+	for(i = 0; i < num; i++){	//classes after "-n" are native in the VM
+
+		if(strcmp(paths[i], "-n")) continue;
+		memmove(paths + i, paths + i + 1, (num - i - 1) * sizeof(char*));
+		firstNative = i;
+		num--;
+		break;
+	}
+
+	classes = malloc(sizeof(JavaClass*[num]));
+	if(!classes){
+
+		fprintf(stderr, "Failed to alloc class list\n");
+		return -1;
+	}
+	for(i = 0; i < num; i++){
+
+		f = fopen(paths[i], "rb");
+		if(!f){
+
+			fprintf(stderr, "Failed to open class '%s'\n", paths[i]);
+			return -1;
+		}
+		classes[i] = classImport(&classReadFileF, f);
+		fclose(f);
+		if(!classes[i]){
+
+			fprintf(stderr, "Failed to load class '%s'\n", paths[i]);
+			return -1;
+		}
+	}
+
+	f = fopen(outPath, "w");
+	if(!f){
+
+		fprintf(stderr, "Failed to create '%s'\n", outPath);
+		return -1;
+	}
+	classStackDepths(classes, num, firstNative, f);
+	fclose(f);
+
+	for(i = 0; i < num; i++) classFree(classes[i]);
+	free(classes);
+
+	return 0;
+}
+
+int main(int argc, char** argv){
 
 	JavaClass* cls;
+	int32_t imageLen = -1;
+	FILE* depths = NULL;
+	int i;
 
 
 	if(sizeof(uint64_t) != 8 || sizeof(uint32_t) != 4 || sizeof(uint16_t) != 2 || sizeof(uint8_t) != 1){
@@ -55,9 +143,41 @@ int main(_UNUSED_ int argc, _UNUSED_ char** argv){
 		return -1;
 	}
 
+	if(argc >= 4 && !strcmp(argv[1], "-a")){	//-a <stack depths out> <every class of the program> [-n <classes the VM implements>]
+
+		return stackDepths(argv[2], argc - 3, argv + 3);
+	}
+
+	for(i = 1; i + 1 < argc; i += 2){
+
+		if(!strcmp(argv[i], "-i")){	//-i <static image from uJ -s>
+
+			imageLen = loadStaticImage(argv[i + 1]);
+		}
+		else if(!strcmp(argv[i], "-d")){	//-d <stack depths from classCvt -a>
+
+			depths = fopen(argv[i + 1], "r");
+			if(!depths) fprintf(stderr, "Failed to open stack depths '%s'\n", argv[i + 1]);
+		}
+		else break;
+	}
+	if(i != argc){
+
+		fprintf(stderr, "usage: %s [-i static_image] [-d stack_depths] < in.class > out.ujc\n"
+				"       %s -a stack_depths in.class... [-n native.class...]\n", argv[0], argv[0]);
+		return -1;
+	}
+
 	cls = classImport(&classReadF, NULL);
 	if(cls){
 
+		if(imageLen >= 0) classUseStaticImage(cls, gStaticImage, imageLen);
+		if(depths){
+
+			classUseStackDepths(cls, depths);
+			fclose(depths);
+		}
+		classUseRomArrays(cls);
 		classDump(cls);
 		classOptimize(cls);
 		classDump(cls);
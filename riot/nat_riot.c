@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <xtimer.h>
+#include <msg.h>
 
 #ifdef MODULE_PERIPH_HWRNG
 #include <periph/hwrng.h>
@@ -37,6 +38,19 @@ static uint8_t natRIOT_printString(UjThread* t, UjClass* cls)
 
 static event_t *cur_event = NULL;
 
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+// payload of cur_event handed to java without a copy. the array owns it now, we keep it alive
+// so the event can still read it until the next one comes in
+static HANDLE cur_lent = 0;
+
+static void natRIOT_freePayload(void *ptr, void *userData)
+{
+    (void)userData;
+
+    free(ptr);
+}
+#endif
+
 static uint8_t natRIOT_waitEvent(UjThread* t, UjClass* cls)
 {
     (void)cls;
@@ -44,7 +58,18 @@ static uint8_t natRIOT_waitEvent(UjThread* t, UjClass* cls)
     int timeout_us = ujThreadPop(t);
     int res;
 
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+    cur_lent = 0;
+#endif
     free_event(&cur_event);
+
+#ifdef UJ_OPT_INCREMENTAL_GC
+    // nothing to do until the next event, good time for GC work
+    if (timeout_us != 0)
+        while (!msg_avail() && ujGcStep(UJ_GC_STEP))
+            ;
+#endif
+
     cur_event = wait_event(timeout_us);
 
     if (cur_event)
@@ -108,6 +133,22 @@ static uint8_t natRIOT_getEventParamBytes(UjThread* t, UjClass* cls)
         if (!len)
             len = strlen(data);
 
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+        if (!cur_lent && cur_event->params[idx].val.str_val.needs_free) {
+            ret = ujArrayNewExternal('B', (void*)data, len, natRIOT_freePayload, NULL, &res);
+            if (ret != UJ_ERR_NONE)
+                return ret;
+
+            cur_event->params[idx].val.str_val.needs_free = false;
+            cur_lent = res;
+
+            if (!ujThreadPush(t, res, true))
+                return UJ_ERR_STACK_SPACE;
+
+            return UJ_ERR_NONE;
+        }
+#endif
+
         ret = ujArrayNew('B', len, &res);
         if (ret != UJ_ERR_NONE)
             return ret;
@@ -311,6 +352,16 @@ static uint8_t natRIOT_randomRange(UjThread* t, UjClass* cls)
     return UJ_ERR_NONE;
 }
 
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+static void natRIOT_gcCls(UjClass* cls)
+{
+    (void)cls;
+
+    if (cur_lent)
+        ujHeapMark(cur_lent, 1);
+}
+#endif
+
 static const UjNativeMethod nativeCls_RIOT_methods[] = {
     {
         .name = "printString",
@@ -404,7 +455,11 @@ static const UjNativeClass nativeCls_RIOT =
 
     .clsDatSz = 0,
     .instDatSz = 0,
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+    .gcClsF = natRIOT_gcCls,
+#else
     .gcClsF = NULL,
+#endif
     .gcInstF = NULL,
 
     .numMethods = sizeof(nativeCls_RIOT_methods) / sizeof(nativeCls_RIOT_methods[0]),
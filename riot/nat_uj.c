@@ -7,6 +7,7 @@
 #include <unistd.h>
 
 #include <vfs.h>
+#include <xtimer.h>
 #include <uJ/uj.h>
 #include <assert.h>
 
@@ -34,6 +35,83 @@ uint8_t ujReadClassByte(void *userData, uint32_t offset)
     return rdByte(fd);
 }
 
+#ifdef UJ_FTR_SYNCHRONIZATION
+uint32_t ujHostTimeMs(void)
+{
+    return xtimer_now_usec64() / 1000;
+}
+
+void ujHostSleepMs(uint32_t ms)
+{
+    xtimer_usleep(ms * 1000);
+}
+#endif
+
+#ifdef UJ_FTR_SNAPSHOT
+#define SNAPSHOT_PATH "/main/default.ujcsnap"
+
+static bool snapshotWrite(void *userData, const void *buf, uint32_t len)
+{
+    return vfs_write((intptr_t)userData, buf, len) == (ssize_t)len;
+}
+
+static bool snapshotRead(void *userData, void *buf, uint32_t len)
+{
+    return vfs_read((intptr_t)userData, buf, len) == (ssize_t)len;
+}
+
+static uint32_t hashPak(int fd)
+{
+    uint32_t hash = 0x811C9DC5UL; // FNV-1a
+    uint8_t buf[64];
+    ssize_t i, len;
+
+    vfs_lseek(fd, 0, SEEK_SET);
+    while ((len = vfs_read(fd, buf, sizeof(buf))) > 0)
+    {
+        for (i = 0; i < len; i++)
+            hash = (hash ^ buf[i]) * 0x01000193UL;
+    }
+
+    return hash;
+}
+
+static int initFromSnapshot(uint32_t pakHash)
+{
+    int res, fd;
+
+    fd = vfs_open(SNAPSHOT_PATH, O_RDONLY, 0);
+    if (fd < 0)
+        return UJ_ERR_FALSE;
+
+    res = ujSnapshotRestore(pakHash, snapshotRead, (void*)(intptr_t)fd);
+    vfs_close(fd);
+
+    if (res == UJ_ERR_INTERNAL)
+    {
+        printf("Snapshot corrupt, removing it.\n");
+        vfs_unlink(SNAPSHOT_PATH);
+    }
+
+    return res;
+}
+
+static void saveSnapshot(uint32_t pakHash)
+{
+    int res, fd;
+
+    fd = vfs_open(SNAPSHOT_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0);
+    if (fd < 0)
+        return;
+
+    res = ujSnapshotSave(pakHash, snapshotWrite, (void*)(intptr_t)fd);
+    vfs_close(fd);
+
+    if (res != UJ_ERR_NONE)
+        vfs_unlink(SNAPSHOT_PATH);
+}
+#endif
+
 static int loadPackedUjcClasses(UjClass **mainClass, int *fdP)
 {
     int fd = -1;
@@ -45,6 +123,9 @@ static int loadPackedUjcClasses(UjClass **mainClass, int *fdP)
         vfs_close(fd);
         printf("Code Update detected, applying.\n");
         vfs_unlink("/main/default.ujcpak");
+#ifdef UJ_FTR_SNAPSHOT
+        vfs_unlink(SNAPSHOT_PATH);
+#endif
         if (vfs_rename("/main/update.ujcpak", "/main/default.ujcpak") < 0)
             printf("Update failed.\n");
     }
@@ -160,16 +241,43 @@ int run_uj(void)
         return -1;
     }
 
-    res = ujInitAllClasses();
-    if (res != UJ_ERR_NONE)
+    res = UJ_ERR_FALSE;
+#ifdef UJ_FTR_SNAPSHOT
+    uint32_t pakHash = hashPak(fd);
+
+    res = initFromSnapshot(pakHash);
+    if (res == UJ_ERR_INTERNAL)
     {
+        // heap is garbage by now, next boot will start clean
         vfs_close(fd);
-        printf("ujInitAllClasses failed: %d\n", res);
         return -1;
     }
+#endif
+
+    if (res != UJ_ERR_NONE)
+    {
+        res = ujInitAllClasses();
+        if (res != UJ_ERR_NONE)
+        {
+            vfs_close(fd);
+            printf("ujInitAllClasses failed: %d\n", res);
+            return -1;
+        }
+
+#ifdef UJ_FTR_SNAPSHOT
+        saveSnapshot(pakHash);
+#endif
+    }
 
+    // exact when classCvt -a analysed the program, otherwise zero
+    uint16_t stackSz = ujThreadStackSize(mainClass, "main", "()V");
+#ifdef UJ_OPT_STACK_SEGMENTS
+    // start small, deeper calls move older frames out to the heap
+    HANDLE threadH = ujThreadCreate(stackSz);
+#else
     // Half of the heap will be used as stack
-    HANDLE threadH = ujThreadCreate(UJ_HEAP_SZ / 2);
+    HANDLE threadH = ujThreadCreate(stackSz ? stackSz : UJ_HEAP_SZ / 2);
+#endif
     if (!threadH)
     {
         vfs_close(fd);
@@ -83,6 +83,9 @@ typedef struct{
 
 /* method storage in data area:
 
+	uint16_t stackDepth;	(only if UJC_METHOD_FLAG_STACK_DEPTH)
+	uint8_t image[imageLen]	(only if UJC_METHOD_FLAG_STATIC_IMAGE)
+	uint16_t imageLen;	(only if UJC_METHOD_FLAG_STATIC_IMAGE)
 	excStruct excs [numExcs]
 	uint16_t numExcs;
 	uint16_t locals;
@@ -92,6 +95,33 @@ typedef struct{
 
 */
 
+//set on <clinit> when classCvt replaced its work by a static image
+#define UJC_METHOD_FLAG_STATIC_IMAGE	0x4000
+
+//set on thread entry points (main, run, <clinit>) when classCvt -a worked out their worst case stack use, in slots
+#define UJC_METHOD_FLAG_STACK_DEPTH	0x2000
+
+/* static image: values the <clinit> produced at build time, applied by the VM before running any <clinit>.
+
+	Sequence of entries, all values big-endian:
+
+	uint16_t ofst;		offset of the static in the class's static data
+	uint8_t type;		java type char of the static, followed by:
+
+		'B', 'Z'		u8 value
+		'C', 'S'		u16 value
+		'I', 'F'		u32 value
+		'J', 'D'		u32, u32 (in the order the VM keeps them)
+		'L'		java.lang.String: u16 len, bytes[len]
+		'['		primitive array: u8 elem type char, u24 len, elements as above
+		'R'		same as '[', but the VM leaves the elements in the class file and
+				backs the static with a read-only array (writes throw)
+
+	Statics that are zero/null are not stored.
+*/
+
+#define UJC_IMAGE_TYPE_ROM_ARRAY	'R'
+
 
 
 
@@ -8,39 +8,121 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef UJ_OPT_VM_CONTEXT
+#include <pthread.h>
+#endif
+
+typedef struct {
+    const uint8_t *data;
+    uint32_t len;
+} ClassImage; // a class file mapped read-only, every VM in the process reads the same pages
 
 uint8_t ujReadClassByte(void *userData, uint32_t offset) {
-    int i;
-    uint8_t v;
-    FILE *f = (FILE *)userData;
-    //char path[1024];
-    //char result[1024];
-
-    if ((uint32_t)ftell(f) != offset) {
-        i = fseek(f, offset, SEEK_SET);
-        if (i == -1) {
-            fprintf(stderr, "Failed to seek to offset %" PRIu32 ", errno=%d\n", offset,
-                    errno);
-            exit(-2);
-        }
+    const ClassImage *img = (const ClassImage *)userData;
+
+    return offset < img->len ? img->data[offset] : 0;
+}
+
+#ifdef UJ_FTR_SYNCHRONIZATION
+uint32_t ujHostTimeMs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+}
+
+void ujHostSleepMs(uint32_t ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    nanosleep(&ts, NULL);
+}
+#endif
+
+static bool mapClassFile(const char *path, ClassImage *img) {
+    struct stat st;
+    void *p = NULL;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return false;
     }
 
-    i = fread(&v, 1, 1, f);
-    if (i == -1) {
-        fprintf(stderr, "Failed to read\n");
-        exit(-2);
+    img->len = st.st_size;
+    if (img->len)
+        p = mmap(NULL, img->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s, errno=%d\n", path, errno);
+        return false;
     }
+    img->data = p;
 
-    /* int fd = fileno(f);
+    return true;
+}
 
-    sprintf(path, "/proc/self/fd/%d", fd);
-    memset(result, 0, sizeof(result));
-    if (readlink(path, result, sizeof(result) - 1) > 0)
-        fprintf(stderr, "Read byte 0x%.2x at offset %d from %s\n", (int)v, (int)offset, result); */
+#ifdef UJ_FTR_SNAPSHOT
+static bool snapshotWrite(void *userData, const void *buf, uint32_t len) {
+    return fwrite(buf, 1, len, (FILE *)userData) == len;
+}
 
-    return v;
+static bool snapshotRead(void *userData, void *buf, uint32_t len) {
+    return fread(buf, 1, len, (FILE *)userData) == len;
 }
 
+static uint32_t hashClassFiles(const ClassImage *imgs, int num) { // FNV-1a over all the files, in order
+    uint32_t hash = 0x811C9DC5UL, j;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        for (j = 0; j < imgs[i].len; j++)
+            hash = (hash ^ imgs[i].data[j]) * 0x01000193UL;
+    }
+
+    return hash;
+}
+#endif
+
+#ifdef UJ_FTR_STATIC_IMAGE_EXPORT
+static bool imageWrite(void *userData, const void *buf, uint32_t len) {
+    return fwrite(buf, 1, len, (FILE *)userData) == len;
+}
+
+static void exportStaticImages(char **names, UjClass **classes, int num) { // Foo.class -> Foo.img
+    char path[1024];
+    char *dot;
+    FILE *f;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        snprintf(path, sizeof(path) - 4, "%s", names[i]);
+        dot = strrchr(path, '.');
+        if (!dot || strchr(dot, '/'))
+            dot = path + strlen(path);
+        strcpy(dot, ".img");
+
+        f = fopen(path, "wb");
+        if (!f) {
+            fprintf(stderr, "Failed to create %s\n", path);
+            continue;
+        }
+        if (ujStaticImageExport(classes[i], imageWrite, f) == UJ_ERR_NONE) {
+            fclose(f);
+            continue;
+        }
+        fclose(f);
+        remove(path);
+    }
+}
+#endif
+
 #ifdef UJ_LOG
 void ujLog(const char *fmtStr, ...) {
     va_list va;
@@ -52,43 +134,32 @@ void ujLog(const char *fmtStr, ...) {
 }
 #endif
 
-int main(int argc, char **argv) {
-    uint32_t threadH;
-    bool done;
+// loads all classes, in whatever order their dependencies allow. returns the first one
+static UjClass *loadClasses(ClassImage *imgs, UjClass **classes, int num) {
+    UjClass *mainClass = NULL, *cls;
+    bool *loaded, done;
     uint8_t ret;
-    UjClass *mainClass = NULL;
     int i;
 
-    if (argc == 1) {
-        fprintf(stderr, "%s: No classes given\n", argv[0]);
-        return -1;
-    }
-
-    ret = ujInit(NULL);
-    if (ret != UJ_ERR_NONE) {
-        fprintf(stderr, "ujInit() fail\n");
-        return -1;
+    loaded = calloc(num, sizeof(bool));
+    if (!loaded) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
     }
 
-    // load provided classes now
-
-    argc--;
-    argv++;
     do {
         done = false;
-        for (i = 0; i < argc; i++) {
-            if (argv[i]) {
-                FILE *f = fopen(argv[i], "rb");
-                if (!f) {
-                    fprintf(stderr, " Failed to open file\n");
-                    return -1;
-                }
-
-                ret = ujLoadClass(f, (i == 0) ? &mainClass : NULL);
+        for (i = 0; i < num; i++) {
+            if (!loaded[i]) {
+                ret = ujLoadClass(&imgs[i], &cls);
                 if (ret == UJ_ERR_NONE) { // success
 
+                    if (i == 0)
+                        mainClass = cls;
+                    if (classes)
+                        classes[i] = cls;
                     done = true;
-                    argv[i] = NULL;
+                    loaded[i] = true;
                 } else if (ret ==
                            UJ_ERR_DEPENDENCY_MISSING) { // fail: we'll try again
                                                         // later
@@ -96,28 +167,32 @@ int main(int argc, char **argv) {
                     // nothing to do here
                 } else {
                     fprintf(stderr, "Failed to load class %d: %d\n", i, ret);
-                    exit(-4);
+                    mainClass = NULL;
+                    goto out;
                 }
             }
         }
     } while (done);
 
-    for (i = 0; i < argc; i++)
-        if (argv[i]) {
-            fprintf(stderr, "Completely failed to load class %d (%s)\n", i,
-                    argv[i]);
-            exit(-8);
+    for (i = 0; i < num; i++)
+        if (!loaded[i]) {
+            fprintf(stderr, "Completely failed to load class %d\n", i);
+            mainClass = NULL;
+            goto out;
         }
 
-    ret = ujInitAllClasses();
-    if (ret != UJ_ERR_NONE) {
-        fprintf(stderr, "ujInitAllClasses() fail\n");
-        return -1;
-    }
+out:
+    free(loaded);
+    return mainClass;
+}
 
-    // now classes are loaded, time to call the entry point
+static int runMain(UjClass *mainClass) {
+    uint32_t threadH;
+    uint16_t stackSz;
+    int i;
 
-    threadH = ujThreadCreate(1024);
+    stackSz = ujThreadStackSize(mainClass, "main", "()V"); // known if classCvt -a saw the whole program
+    threadH = ujThreadCreate(stackSz ? stackSz : 1024);
     if (!threadH) {
         fprintf(stderr, "ujThreadCreate() fail\n");
         return -1;
@@ -126,16 +201,225 @@ int main(int argc, char **argv) {
     i = ujThreadGoto(threadH, mainClass, "main", "()V");
     if (i == UJ_ERR_METHOD_NONEXISTENT) {
         fprintf(stderr, "Main method not found!\n");
-        exit(-9);
+        return -9;
     }
     while (ujCanRun()) {
         i = ujInstr();
         if (i != UJ_ERR_NONE) {
             fprintf(stderr, "Ret %d @ instr right before 0x%08" PRIX32 "\n", i,
                     ujThreadDbgGetPc(threadH));
-            exit(-10);
+            return -10;
         }
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+#ifdef UJ_OPT_VM_CONTEXT
+typedef struct {
+    pthread_t thread;
+    ClassImage *imgs;
+    int num;
+    int ret;
+} Isolate;
+
+static void *isolateMain(void *arg) { // a VM of its own on a thread of its own, sharing only the class files
+    Isolate *iso = (Isolate *)arg;
+    UjClass *mainClass;
+    UjVm *vm;
+
+    iso->ret = -1;
+    vm = ujVmNew();
+    if (!vm) {
+        fprintf(stderr, "ujVmNew() fail\n");
+        return NULL;
+    }
+    ujVmSelect(vm);
+
+    if (ujInit(NULL) != UJ_ERR_NONE) {
+        fprintf(stderr, "ujInit() fail\n");
+    } else if (!(mainClass = loadClasses(iso->imgs, NULL, iso->num))) {
+        iso->ret = -4;
+    } else if (ujInitAllClasses() != UJ_ERR_NONE) {
+        fprintf(stderr, "ujInitAllClasses() fail\n");
+    } else {
+        iso->ret = runMain(mainClass);
+    }
+
+    ujVmFree(vm);
+    return NULL;
+}
+
+static int runIsolates(ClassImage *imgs, int num, int numIsolates) {
+    Isolate *isos = calloc(numIsolates, sizeof(Isolate));
+    int i, ret = 0;
+
+    if (!isos) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+
+    for (i = 0; i < numIsolates; i++) {
+        isos[i].imgs = imgs;
+        isos[i].num = num;
+        if (pthread_create(&isos[i].thread, NULL, isolateMain, &isos[i])) {
+            fprintf(stderr, "Failed to start isolate %d\n", i);
+            numIsolates = i;
+            ret = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i < numIsolates; i++) {
+        pthread_join(isos[i].thread, NULL);
+        if (isos[i].ret && !ret)
+            ret = isos[i].ret;
+    }
+
+    free(isos);
+    return ret;
+}
+#endif
+
+int main(int argc, char **argv) {
+    uint8_t ret;
+    UjClass *mainClass;
+    ClassImage *imgs;
+    int i;
+#ifdef UJ_FTR_SNAPSHOT
+    const char *snapPath = NULL;
+    uint32_t pakHash = 0;
+    FILE *snap;
+#endif
+#ifdef UJ_OPT_VM_CONTEXT
+    int numIsolates = 0;
+
+    if (argc > 2 && !strcmp(argv[1], "-j")) { // run that many separate VMs in parallel
+        numIsolates = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+#endif
+
+#ifdef UJ_FTR_SNAPSHOT
+    if (argc > 2 && !strcmp(argv[1], "-S")) { // restore post-init state from that file, or save it there
+        snapPath = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+#endif
+
+#ifdef UJ_FTR_STATIC_IMAGE_EXPORT
+    UjClass **classes = NULL;
+    bool exportImages = argc > 1 && !strcmp(argv[1], "-s");
+
+    if (exportImages) { // run the initializers, dump statics, do not run main
+        argc--;
+        argv++;
+    }
+#endif
+
+    if (argc == 1) {
+        fprintf(stderr, "%s: No classes given\n", argv[0]);
+        return -1;
+    }
+
+    argc--;
+    argv++;
+
+    imgs = calloc(argc, sizeof(ClassImage));
+    if (!imgs) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    for (i = 0; i < argc; i++) {
+        if (!mapClassFile(argv[i], &imgs[i])) {
+            fprintf(stderr, " Failed to open file\n");
+            return -1;
+        }
+    }
+
+#ifdef UJ_OPT_VM_CONTEXT
+    if (numIsolates > 0)
+        return runIsolates(imgs, argc, numIsolates);
+#endif
+
+    ret = ujInit(NULL);
+    if (ret != UJ_ERR_NONE) {
+        fprintf(stderr, "ujInit() fail\n");
+        return -1;
+    }
+
+    // load provided classes now
+
+#ifdef UJ_FTR_STATIC_IMAGE_EXPORT
+    if (exportImages) {
+        classes = calloc(argc, sizeof(UjClass *));
+        if (!classes) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+    }
+#endif
+
+#ifdef UJ_FTR_SNAPSHOT
+    if (snapPath)
+        pakHash = hashClassFiles(imgs, argc);
+#endif
+
+#ifdef UJ_FTR_STATIC_IMAGE_EXPORT
+    mainClass = loadClasses(imgs, classes, argc);
+#else
+    mainClass = loadClasses(imgs, NULL, argc);
+#endif
+    if (!mainClass)
+        return -4;
+
+#ifdef UJ_FTR_STATIC_IMAGE_EXPORT
+    if (exportImages) {
+        ret = ujInitAllClasses();
+        if (ret != UJ_ERR_NONE) {
+            fprintf(stderr, "ujInitAllClasses() fail\n");
+            return -1;
+        }
+        exportStaticImages(argv, classes, argc);
+        return 0;
+    }
+#endif
+
+    ret = UJ_ERR_FALSE;
+#ifdef UJ_FTR_SNAPSHOT
+    snap = snapPath ? fopen(snapPath, "rb") : NULL;
+    if (snap) {
+        ret = ujSnapshotRestore(pakHash, snapshotRead, snap);
+        fclose(snap);
+        if (ret == UJ_ERR_INTERNAL) {
+            fprintf(stderr, "Snapshot %s is corrupt, removing it\n", snapPath);
+            remove(snapPath);
+            return -1;
+        }
+    }
+#endif
+
+    if (ret != UJ_ERR_NONE) {
+        ret = ujInitAllClasses();
+        if (ret != UJ_ERR_NONE) {
+            fprintf(stderr, "ujInitAllClasses() fail\n");
+            return -1;
+        }
+
+#ifdef UJ_FTR_SNAPSHOT
+        snap = snapPath ? fopen(snapPath, "wb") : NULL;
+        if (snap) {
+            ret = ujSnapshotSave(pakHash, snapshotWrite, snap);
+            fclose(snap);
+            if (ret != UJ_ERR_NONE)
+                remove(snapPath);
+        }
+#endif
+    }
+
+    // now classes are loaded, time to call the entry point
+
+    return runMain(mainClass);
+}
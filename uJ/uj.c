@@ -1,11 +1,16 @@
 #include "uj.h"
 #include "UJC.h"
 #include "ujHeap.h"
+#include <string.h>
 
 #ifdef UJ_DBG_HELPERS
 #include <stdio.h>
 #endif
 
+#ifdef UJ_OPT_VM_CONTEXT
+#include <stdlib.h>
+#endif
+
 #if defined(UJ_FTR_SUPPORT_LONG) || defined(UJ_FTR_SUPPORT_DOUBLE)
 #include "long64.h"
 #endif
@@ -30,7 +35,6 @@ __attribute__((__const__)) static char isNaN(const float *f) {
         TODO:
                 * throw real exceptions for VM things like OOM & out of stack
                 * Heap compaction (1/2 done?)
-                * Heap handle table growth (is this needed?)
                 * constant initializer support (is this needed with latest JDK [6+] ?)
                 * in class file store a uint8_t hash of name, to speed up findClass (mash searched name, only do string compare if hashes match)
                 * keep array types so as to support appropriate throwing of "ArrayStoreException"
@@ -80,6 +84,9 @@ __attribute__((__const__)) static char isNaN(const float *f) {
 
 // our stuff
 #define THREAD_RET_INFO_SZ 3 // in units of stack slots
+#ifdef UJ_OPT_STACK_SEGMENTS
+#define THREAD_FRAME_SLACK 4 // slots a frame gets beyond its max_stack, for natives' temporaries
+#endif
 
 // flags for {get,put}{statis,field}
 #define UJ_ACCESS_PUT   1 // these are not random and canot be changed (see instr decoding)
@@ -105,6 +112,8 @@ typedef struct
 {
     HANDLE holder;
     uint16_t numHolds;
+    uint16_t waitId;   // threads parked on us carry this id, 0 if there are none
+    uint16_t notifyId; // same for threads in wait() on us
 } UjMonitor;
 
 struct UjClass
@@ -123,6 +132,9 @@ struct UjClass
 #ifdef UJ_OPT_CLASS_SEARCH
     uint8_t clsNameHash;
 #endif
+#ifdef UJ_OPT_COMPACT_HEADERS
+    uint16_t idx; // into gClasses, what objects of this class hold instead of a pointer to it
+#endif
 
     union {
         struct {
@@ -139,6 +151,10 @@ struct UjClass
 
     struct UjClass *supr;
 
+#ifdef UJ_OPT_INTERN_STRINGS
+    HANDLE strings; // object array of ldc'd strings by constant index, created on first use
+#endif
+
     uint16_t instDataOfst; // offset in instance data to class's instance data
                          // (before it comes data from superclasses)
     uint16_t instDataSize; // size of class's instance data (before it comes data
@@ -149,9 +165,56 @@ struct UjClass
     uint16_t clsDataSize; // size in class data of class's data (before it comes
                         // data from superclasses)
 
+    uint16_t numInstRefs; // reference instance fields, superclasses' included (java classes only)
+    uint16_t numClsRefs;  // reference static fields of this class (java classes only)
+
     uint8_t data[];
 };
 
+// offsets of reference fields live right after the class data: instance ones
+// (into UjInstance.data) followed by static ones (into UjClass.data)
+#define CLASS_REF_MAP(cls)                                                     \
+    ((uint16_t *)(((uintptr_t)((cls)->data + (cls)->clsDataOfst + (cls)->clsDataSize) + 1) & ~(uintptr_t)1))
+
+#ifdef UJ_OPT_CLASS_SEARCH
+// native classes keep their methods there instead, sorted by name and type hash
+typedef struct
+{
+    uint8_t nameHash;
+    uint8_t typeHash;
+    uint16_t idx; // into UjNativeClass.methods
+} UjNativeMethodHash;
+
+#define NATIVE_METHOD_MAP(cls) ((UjNativeMethodHash *)CLASS_REF_MAP(cls))
+#define NATIVE_METHOD_KEY(e)   (((uint16_t)(e).nameHash << 8) | (e).typeHash)
+#endif
+
+#ifdef UJ_OPT_COMPACT_HEADERS
+// objects carry a class index and, with synchronization, a lock word: 0 while free, the holding
+// thread while it holds it once and nobody waits, else (with INST_INFLATED) a UjMonitor record
+#define INST_CLS_IDX_MASK 0x7FFF
+#define INST_INFLATED     0x8000 // in clsIdx
+#if UJ_MAX_CLASSES > INST_CLS_IDX_MASK
+#error "UJ_MAX_CLASSES does not fit the class index of compact headers"
+#endif
+
+#define OBJ_CLS(obj)        (gClasses[(obj)->clsIdx & INST_CLS_IDX_MASK])
+#define OBJ_SET_CLS(obj, c) ((obj)->clsIdx = (c) ? ((UjClass *)(c))->idx : 0)
+
+struct UjInstance // must begin like UjArray
+{
+    uint16_t clsIdx;
+
+#ifdef UJ_FTR_SYNCHRONIZATION
+    HANDLE lock;
+#endif
+
+    uint8_t data[]; // instance data ( array of elements such as: {u8 type, u8 data[]} )
+};
+#else
+#define OBJ_CLS(obj)        ((obj)->cls)
+#define OBJ_SET_CLS(obj, c) ((obj)->cls = (c))
+
 struct UjInstance // must begin with UjClass*
 {
     UjClass *cls;
@@ -162,17 +225,25 @@ struct UjInstance // must begin with UjClass*
 
     uint8_t data[]; // instance data ( array of elements such as: {u8 type, u8 data[]} )
 };
+#endif
 
-// if a chunk in heap is not an object, its "cls" field is NULL, and the next 8
+// if a chunk in heap is not an object, its "cls" field is NULL (index 0), and the next 8
 // bits explain what it is
 #define OBJ_TYPE_ARRAY     0 // array  of something other then objects
 #define OBJ_TYPE_OBJ_ARRAY 1 // array of objects/arrays
+#define OBJ_TYPE_ROM_ARRAY 2 // read-only array of primitives left in the class file (UJC only)
+#define OBJ_TYPE_EXT_ARRAY 3 // array of primitives in native memory, holds {elems*, releaseF, userData}
 
 typedef struct UjArray // must begin with UjClass*
 {
+#ifdef UJ_OPT_COMPACT_HEADERS
+    uint16_t clsIdx; // 0 for arrays
+#else
     UjClass *cls; // NULL for arrays. all objects in the heap must have this as
                   // the first field!
+#endif
     uint8_t objType;
+    char elemType; // JAVA_TYPE_* of the elements
     UInt24 length;
     uint8_t data[];
 } UjArray;
@@ -181,6 +252,14 @@ struct UjThread
 {
     HANDLE nextThread;
 
+    uint8_t priority; // higher runs first, equal ones take turns
+#ifdef UJ_FTR_SYNCHRONIZATION
+    uint16_t waitId;      // waitId of the monitor we are parked on, or notifyId of the one we wait() on. 0 if runnable
+    uint16_t relockHolds; // holds wait() gave up on relockObj, taken back before we go on
+    HANDLE relockObj;
+    uint32_t wakeAt;      // ujHostTimeMs() a timed wait() ends at, 0 if none
+#endif
+
     union {
         struct {
             uint8_t hasInst : 1; // same as !!instH
@@ -201,9 +280,22 @@ struct UjThread
     uint16_t spBase;  // we use an empty ascending stack
     uint16_t spLimit; // also used for "isPtr"
     uint16_t localsBase;
+#ifdef UJ_OPT_STACK_SEGMENTS
+    HANDLE spill; // UjStackSeg holding the bottom of the stack, moved out to make room for new frames
+#endif
     uintptr_t stack[];
 };
 
+#ifdef UJ_OPT_STACK_SEGMENTS
+// older frames of a thread, in the same layout they had at the bottom of its stack
+typedef struct
+{
+    HANDLE prev; // even older ones
+    uint16_t numSlots;
+    uintptr_t stack[]; // followed by the "isRef" bits
+} UjStackSeg;
+#endif
+
 #define STR_EQ_PAR_TYPE_PTR  0 // len, const char*
 #define STR_EQ_PAR_TYPE_REF2 1 //@ (t->cls).const(@((t->cls).const(idx) + offset))
 #define STR_EQ_PAR_TYPE_REF  2 //@ cls.const(@(cls.const(idx) + offset))
@@ -250,12 +342,76 @@ typedef struct
     } data;
 } UjPrvStrEqualParam;
 
+#ifdef UJ_OPT_INVOKE_CACHE
+typedef struct
+{
+    UjClass *site;    // class the invoke is in, NULL for an unused entry
+    UjClass *recv;    // class of "this" it was resolved for, NULL for static and special calls
+    UjClass *cls;     // where the method was found
+    UInt24 pc;        // of the invoke's operand
+    UInt24 addr;      // method address as ujThreadPrvGetMethodAddr() gave it
+    uint16_t flags;
+    uint8_t numSlots; // stack slots the params take
+} UjInvokeCacheEntry;
+
+#define INVOKE_CACHE_IDX(cls, pc) ((((uintptr_t)(cls) >> 4) ^ (pc)) & (UJ_INVOKE_CACHE_SZ - 1))
+#endif
+
 /************************ START GLOBALS *******************************/
 
+#ifdef UJ_OPT_VM_CONTEXT
+
+struct UjVm {
+    UjClass *firstClass;
+    HANDLE curThread;
+    HANDLE firstThread;
+    uint32_t numInstrs;
+    UjClass *stringCls;
+#ifdef UJ_OPT_COMPACT_HEADERS
+    UjClass *classes[UJ_MAX_CLASSES + 1];
+    uint16_t numClasses;
+#endif
+#ifdef UJ_FTR_SYNCHRONIZATION
+    uint16_t lastWaitId;
+#endif
+#ifdef UJ_OPT_INVOKE_CACHE
+    UjInvokeCacheEntry invokeCache[UJ_INVOKE_CACHE_SZ];
+#endif
+    UjHeap *heap; // NULL for the default heap
+};
+
+static UjVm gDefaultVm;
+static _Thread_local UjVm *gVm = &gDefaultVm;
+
+#define gFirstClass  (gVm->firstClass)
+#define gCurThread   (gVm->curThread)
+#define gFirstThread (gVm->firstThread)
+#define gNumInstrs   (gVm->numInstrs)
+#define gStringCls   (gVm->stringCls)
+#define gLastWaitId  (gVm->lastWaitId)
+#define gClasses     (gVm->classes)
+#define gNumClasses  (gVm->numClasses)
+#define gInvokeCache (gVm->invokeCache)
+
+#else
+
 static UjClass *gFirstClass = NULL;
 static HANDLE gCurThread = 0;
 static HANDLE gFirstThread = 0;
 static uint32_t gNumInstrs = 0;
+static UjClass *gStringCls = NULL; // java/lang/String, once we looked it up
+#ifdef UJ_OPT_COMPACT_HEADERS
+static UjClass *gClasses[UJ_MAX_CLASSES + 1]; // by UjClass.idx, the NULL at 0 is what arrays have
+static uint16_t gNumClasses = 0;
+#endif
+#ifdef UJ_FTR_SYNCHRONIZATION
+static uint16_t gLastWaitId = 0; // last monitor wait list id handed out
+#endif
+#ifdef UJ_OPT_INVOKE_CACHE
+static UjInvokeCacheEntry gInvokeCache[UJ_INVOKE_CACHE_SZ]; // direct mapped by call site
+#endif
+
+#endif
 
 /************************ END  GLOBALS *******************************/
 
@@ -342,14 +498,181 @@ static bool ujThreadPrvMonEnter(HANDLE h, UjMonitor *mon)
     return true;
 }
 
-static bool ujThreadPrvMonExit(HANDLE h, UjMonitor *mon)
+static uint16_t ujThreadPrvNewWaitId(void)
+{
+    if (!++gLastWaitId) // ids may repeat after a wrap, that only costs a spurious wakeup
+        gLastWaitId++;
+    return gLastWaitId;
+}
+
+static void ujThreadPrvMonPark(UjThread *t, UjMonitor *mon) // t sleeps until mon is released
+{
+    if (!mon->waitId)
+        mon->waitId = ujThreadPrvNewWaitId();
+    t->waitId = mon->waitId;
+}
+
+static bool ujThreadPrvWake(uint16_t waitId, bool all) // make threads parked with this id runnable. true if there were any
+{
+    HANDLE h, next;
+    UjThread *t;
+    bool needsRelease, found = false;
+
+    for (h = gFirstThread; h; h = next) {
+        t = ujHeapHandleIsLocked(h); // the running thread is
+        needsRelease = !t;
+        if (needsRelease)
+            t = ujHeapHandleLock(h);
+        if (t->waitId == waitId) {
+            t->waitId = 0;
+            t->wakeAt = 0;
+            found = true;
+        }
+        next = t->nextThread;
+        if (needsRelease)
+            ujHeapHandleRelease(h);
+        if (found && !all)
+            break;
+    }
+
+    return found;
+}
+
+static bool ujThreadPrvWaiting(uint16_t waitId) // is any thread still parked with this id?
+{
+    HANDLE h, next;
+    UjThread *t;
+    bool needsRelease, found = false;
+
+    for (h = gFirstThread; h && !found; h = next) {
+        t = ujHeapHandleIsLocked(h); // the running thread is
+        needsRelease = !t;
+        if (needsRelease)
+            t = ujHeapHandleLock(h);
+        found = (t->waitId == waitId);
+        next = t->nextThread;
+        if (needsRelease)
+            ujHeapHandleRelease(h);
+    }
+
+    return found;
+}
+
+static uint8_t ujThreadPrvMonExit(HANDLE h, UjMonitor *mon)
 {
     if (mon->numHolds && (mon->holder == h)) {
-        mon->numHolds--;
+        if (!--mon->numHolds && mon->waitId) { // everyone parked on us retries
+            ujThreadPrvWake(mon->waitId, true);
+            mon->waitId = 0;
+        }
         return UJ_ERR_NONE;
     }
     return UJ_ERR_MON_STATE_ERR;
 }
+
+#ifdef UJ_OPT_COMPACT_HEADERS
+static UjMonitor *ujThreadPrvInstMon(UjInstance *inst) // its monitor record, made from the lock word if need be. NULL if out of memory
+{
+    UjMonitor *mon;
+    HANDLE h;
+
+    if (inst->clsIdx & INST_INFLATED)
+        return ujHeapHandlePeek(inst->lock);
+
+    // tenured: a minor GC would not walk an old object to find it
+    h = ujHeapHandleNewEx(sizeof(UjMonitor), UJ_HEAP_TENURED | UJ_HEAP_LEAF);
+    if (!h)
+        return NULL;
+
+    mon = ujHeapHandlePeek(h);
+    mon->holder = inst->lock;
+    mon->numHolds = inst->lock ? 1 : 0;
+    mon->waitId = 0;
+    mon->notifyId = 0;
+    inst->lock = h;
+    inst->clsIdx |= INST_INFLATED;
+
+    return mon;
+}
+
+static void ujThreadPrvInstMonIdle(UjInstance *inst) // back to a plain lock word once nobody holds or waits on it
+{
+    UjMonitor *mon = ujHeapHandlePeek(inst->lock);
+
+    if (!mon->numHolds && !mon->waitId && !mon->notifyId) {
+        ujHeapHandleFree(inst->lock);
+        inst->lock = 0;
+        inst->clsIdx &= ~INST_INFLATED;
+    }
+}
+#else
+#define ujThreadPrvInstMon(inst) (&(inst)->mon)
+#endif
+
+static uint8_t ujThreadPrvInstMonEnter(HANDLE h, UjThread *t, UjInstance *inst) // UJ_ERR_RETRY_LATER once t is parked on it
+{
+    UjMonitor *mon;
+
+#ifdef UJ_OPT_COMPACT_HEADERS
+    if (!(inst->clsIdx & INST_INFLATED) && !inst->lock) { // the common case: nobody has it
+        inst->lock = h;
+        return UJ_ERR_NONE;
+    }
+#endif
+    mon = ujThreadPrvInstMon(inst);
+    if (!mon)
+        return UJ_ERR_OUT_OF_MEMORY;
+    if (ujThreadPrvMonEnter(h, mon))
+        return UJ_ERR_NONE;
+    ujThreadPrvMonPark(t, mon);
+
+    return UJ_ERR_RETRY_LATER;
+}
+
+static uint8_t ujThreadPrvInstMonExit(HANDLE h, UjInstance *inst)
+{
+#ifdef UJ_OPT_COMPACT_HEADERS
+    uint8_t ret;
+
+    if (!(inst->clsIdx & INST_INFLATED)) {
+        if (inst->lock != h)
+            return UJ_ERR_MON_STATE_ERR;
+        inst->lock = 0;
+        return UJ_ERR_NONE;
+    }
+
+    ret = ujThreadPrvMonExit(h, ujHeapHandlePeek(inst->lock));
+    ujThreadPrvInstMonIdle(inst);
+
+    return ret;
+#else
+    return ujThreadPrvMonExit(h, &inst->mon);
+#endif
+}
+
+static bool ujThreadPrvRelock(HANDLE threadH, UjThread *t) // back from wait(), take the monitor again or park on it
+{
+    HANDLE objH = t->relockObj;
+    UjMonitor *mon = ujThreadPrvInstMon((UjInstance *)ujHeapHandleLock(objH));
+    bool ret;
+
+    if (!mon) { // no memory for the record, try again next time
+        ujHeapHandleRelease(objH);
+        return false;
+    }
+    if (mon->notifyId && !ujThreadPrvWaiting(mon->notifyId)) // our timed wait() ran out, or we were the last one notified
+        mon->notifyId = 0;
+
+    ret = ujThreadPrvMonEnter(threadH, mon);
+    if (ret) {
+        mon->numHolds = t->relockHolds;
+        t->relockObj = 0;
+    } else
+        ujThreadPrvMonPark(t, mon);
+    ujHeapHandleRelease(objH);
+
+    return ret;
+}
 #endif
 
 #ifdef UJ_FTR_SUPPORT_CLASS_FORMAT
@@ -589,14 +912,35 @@ static UjClass *ujThreadPrvFindClass(UjPrvStrEqualParam *name)
     return NULL;
 }
 
+static void ujPrvClassLink(UjClass *cls) // a new class is ready for use
+{
+    cls->nextClass = gFirstClass;
+    gFirstClass = cls;
+#ifdef UJ_OPT_COMPACT_HEADERS
+    cls->idx = ++gNumClasses;
+    gClasses[cls->idx] = cls;
+#endif
+}
+
 uint8_t ujRegisterNativeClass(const UjNativeClass *nCls, struct UjClass *super, struct UjClass **clsP)
 {
 #ifdef UJ_OPT_CLASS_SEARCH
+    UjNativeMethodHash *map, e;
     UjPrvStrEqualParam p;
+    uint16_t i, j;
 #endif
     UjClass *cls;
 
-    cls = ujHeapAllocNonmovable(sizeof(UjClass) + (super ? super->clsDataOfst : 0) + nCls->clsDatSz);
+#ifdef UJ_OPT_COMPACT_HEADERS
+    if (gNumClasses == UJ_MAX_CLASSES)
+        return UJ_ERR_OUT_OF_MEMORY;
+#endif
+
+    cls = ujHeapAllocNonmovable(sizeof(UjClass) + (super ? super->clsDataOfst + super->clsDataSize : 0) + nCls->clsDatSz
+#ifdef UJ_OPT_CLASS_SEARCH
+                                + 1 + sizeof(UjNativeMethodHash) * nCls->numMethods
+#endif
+                                );
     if (!cls)
         return UJ_ERR_OUT_OF_MEMORY;
 
@@ -619,11 +963,29 @@ uint8_t ujRegisterNativeClass(const UjNativeClass *nCls, struct UjClass *super,
 
     cls->info.native = nCls;
 
+#ifdef UJ_OPT_CLASS_SEARCH
+    // hash every method once now, lookups then only compare strings of the ones whose hashes match
+    map = NATIVE_METHOD_MAP(cls);
+    for (i = 0; i < nCls->numMethods; i++) {
+        p.type = STR_EQ_PAR_TYPE_PTR;
+        p.data.ptr.len = ujCstrlen(p.data.ptr.str = nCls->methods[i].name);
+        e.nameHash = ujPrvHashString(&p);
+        p.type = STR_EQ_PAR_TYPE_PTR;
+        p.data.ptr.len = ujCstrlen(p.data.ptr.str = nCls->methods[i].type);
+        e.typeHash = ujPrvHashString(&p);
+        e.idx = i;
+
+        // insertion sort: equal hashes keep table order, so the first match still wins
+        for (j = i; j && NATIVE_METHOD_KEY(map[j - 1]) > NATIVE_METHOD_KEY(e); j--)
+            map[j] = map[j - 1];
+        map[j] = e;
+    }
+#endif
+
     if (clsP)
         *clsP = cls;
 
-    cls->nextClass = gFirstClass;
-    gFirstClass = cls;
+    ujPrvClassLink(cls);
 
     return UJ_ERR_NONE;
 }
@@ -652,12 +1014,63 @@ static uint8_t ujPrvJavaTypeToSize(char type)
     }
 }
 
+static void ujPrvClassBuildRefMap(UjClass *cls) // so GC can trace objects without reading the class
+{
+    uint16_t *instMap = CLASS_REF_MAP(cls), *clsMap = instMap + cls->numInstRefs;
+    uint16_t numFields, instOfst = cls->instDataOfst, clsOfst = cls->clsDataOfst;
+    UInt24 addr = cls->info.java.fields;
+    bool isClassVar;
+    char type = 0;
+
+    if (cls->supr && !cls->supr->native) {
+        memcpy(instMap, CLASS_REF_MAP(cls->supr), sizeof(uint16_t) * cls->supr->numInstRefs);
+        instMap += cls->supr->numInstRefs;
+    }
+
+    numFields = ujThreadReadBE16_ex(cls->info.java.readD, addr - 2);
+
+    while (numFields--) {
+        isClassVar = !!(ujThreadReadBE16_ex(cls->info.java.readD, addr) & JAVA_ACC_STATIC);
+
+        if (cls->ujc) {
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+            type = ujReadClassByte(cls->info.java.readD,
+                                   ujThreadReadBE24_ex(cls->info.java.readD, addr + 7) + 3);
+            addr += 10;
+#endif
+        } else {
+#ifdef UJ_FTR_SUPPORT_CLASS_FORMAT
+            uint16_t n;
+
+            type = ujReadClassByte(cls->info.java.readD,
+                                   ujThreadPrvFindConst_ex_class(
+                                       cls->info.java.readD,
+                                       ujThreadReadBE16_ex(cls->info.java.readD, addr + 4)) + 3);
+            n = ujThreadReadBE16_ex(cls->info.java.readD, addr + 6);
+            addr += 8;
+            while (n--)
+                addr = ujPrvSkipAttribute(cls->info.java.readD, addr);
+#endif
+        }
+
+        if (isClassVar) {
+            if (type == JAVA_TYPE_ARRAY || type == JAVA_TYPE_OBJ)
+                *clsMap++ = clsOfst;
+            clsOfst += ujPrvJavaTypeToSize(type);
+        } else {
+            if (type == JAVA_TYPE_ARRAY || type == JAVA_TYPE_OBJ)
+                *instMap++ = instOfst;
+            instOfst += ujPrvJavaTypeToSize(type);
+        }
+    }
+}
+
 uint8_t ujLoadClass(void *readD, UjClass **clsP)
 {
     UjClass *cls;
     UjClass *supr = NULL;
     UjPrvStrEqualParam p;
-    uint16_t n, clsDatSz = 0, instDatSz = 0;
+    uint16_t n, clsDatSz = 0, instDatSz = 0, clsRefs = 0, instRefs = 0;
     UInt24 addr, fields, interfaces;
     bool isUjc = false;
     bool isClassVar;
@@ -703,6 +1116,13 @@ uint8_t ujLoadClass(void *readD, UjClass **clsP)
                 readD, ujThreadReadBE24_ex(readD, addr + 7) +
                            3); // get type descriptor first character
 
+            if (type == JAVA_TYPE_ARRAY || type == JAVA_TYPE_OBJ) {
+                if (isClassVar)
+                    clsRefs++;
+                else
+                    instRefs++;
+            }
+
             type = ujPrvJavaTypeToSize(type);
 
             if (isClassVar)
@@ -776,6 +1196,13 @@ uint8_t ujLoadClass(void *readD, UjClass **clsP)
             n = ujThreadReadBE16_ex(readD, addr + 4); // read type destriptor index
             type = ujReadClassByte(readD, ujThreadPrvFindConst_ex_class(readD, n) + 3); // get type descriptor first character
 
+            if (type == JAVA_TYPE_ARRAY || type == JAVA_TYPE_OBJ) {
+                if (isClassVar)
+                    clsRefs++;
+                else
+                    instRefs++;
+            }
+
             type = ujPrvJavaTypeToSize(type);
 
             if (isClassVar)
@@ -830,10 +1257,18 @@ uint8_t ujLoadClass(void *readD, UjClass **clsP)
             return UJ_ERR_DEPENDENCY_MISSING;
     }
 
+    if (supr && !supr->native)
+        instRefs += supr->numInstRefs;
+
     // now we have enough data to know this class's size -> alloc it
+#ifdef UJ_OPT_COMPACT_HEADERS
+    if (gNumClasses == UJ_MAX_CLASSES)
+        return UJ_ERR_OUT_OF_MEMORY;
+#endif
 
     cls = ujHeapAllocNonmovable(sizeof(UjClass) + clsDatSz +
-                                (supr ? supr->clsDataOfst + supr->clsDataSize : 0));
+                                (supr ? supr->clsDataOfst + supr->clsDataSize : 0) +
+                                1 + sizeof(uint16_t) * (instRefs + clsRefs));
     if (!cls)
         return UJ_ERR_OUT_OF_MEMORY;
 
@@ -855,6 +1290,9 @@ uint8_t ujLoadClass(void *readD, UjClass **clsP)
     cls->info.java.methods = addr;
     cls->clsDataSize = clsDatSz;
     cls->instDataSize = instDatSz;
+    cls->numInstRefs = instRefs;
+    cls->numClsRefs = clsRefs;
+    ujPrvClassBuildRefMap(cls);
 
 #ifdef UJ_OPT_CLASS_SEARCH
     cls->clsNameHash = clsNameHash;
@@ -864,8 +1302,7 @@ uint8_t ujLoadClass(void *readD, UjClass **clsP)
     // attribute:
     // http://java.sun.com/docs/books/jvms/second_edition/html/ClassFile.doc.html#1405
 
-    cls->nextClass = gFirstClass;
-    gFirstClass = cls;
+    ujPrvClassLink(cls);
     if (clsP)
         *clsP = cls;
 
@@ -879,7 +1316,8 @@ HANDLE ujThreadCreate(uint16_t stackSz)
 
     if (!stackSz)
         stackSz = UJ_DEFAULT_STACK_SIZE;
-    handle = ujHeapHandleNew(sizeof(UjThread) + stackSz + ((stackSz / sizeof(uintptr_t)) + 7) / 8);
+    handle = ujHeapHandleNewEx(sizeof(UjThread) + stackSz + ((stackSz / sizeof(uintptr_t)) + 7) / 8,
+                               UJ_HEAP_TENURED | UJ_HEAP_LEAF);
     if (!handle)
         return 0;
 
@@ -889,6 +1327,15 @@ HANDLE ujThreadCreate(uint16_t stackSz)
     t->localsBase = 0;
     t->spLimit = stackSz / sizeof(uintptr_t);
     t->pc = UJ_PC_BAD;
+    t->priority = UJ_THREAD_PRIO_NORM;
+#ifdef UJ_OPT_STACK_SEGMENTS
+    t->spill = 0;
+#endif
+#ifdef UJ_FTR_SYNCHRONIZATION
+    t->waitId = 0;
+    t->relockObj = 0;
+    t->wakeAt = 0;
+#endif
 
     if (!gFirstThread)
         gCurThread = handle;
@@ -900,6 +1347,21 @@ HANDLE ujThreadCreate(uint16_t stackSz)
     return handle;
 }
 
+static void ujThreadPrvSetPriority(UjThread *t, int32_t prio) // java passes an int
+{
+    if (prio < UJ_THREAD_PRIO_MIN)
+        prio = UJ_THREAD_PRIO_MIN;
+    else if (prio > UJ_THREAD_PRIO_MAX)
+        prio = UJ_THREAD_PRIO_MAX;
+    t->priority = prio;
+}
+
+void ujThreadSetPriority(HANDLE threadH, uint8_t prio)
+{
+    ujThreadPrvSetPriority(ujHeapHandleLock(threadH), prio);
+    ujHeapHandleRelease(threadH);
+}
+
 _UNUSED_ static void ujPrivPrintStrEqualParam(UjPrvStrEqualParam *param)
 {
     uint16_t L = ujThreadPrvStrEqualGetLen(param);
@@ -917,11 +1379,33 @@ static UInt24 ujThreadPrvGetMethodAddr(UjClass **clsP, UjPrvStrEqualParam *name,
     UjClass *cls = *clsP;
     UjPrvStrEqualParam p;
     uint16_t n, flags, flagsEq = flagsEqEx & ~FLAG_DONT_SEARCH_SUBCLASSES;
+#ifdef UJ_OPT_CLASS_SEARCH
+    uint8_t nHash = ujPrvHashString(name);
+    uint8_t tHash = ujPrvHashString(type);
+    uint16_t key = ((uint16_t)nHash << 8) | tHash, lo, hi, mid;
+    const UjNativeMethodHash *map;
+#endif
 
     while (cls) {
         if (cls->native) { // native class
 
+#ifdef UJ_OPT_CLASS_SEARCH
+            map = NATIVE_METHOD_MAP(cls);
+            lo = 0;
+            hi = cls->info.native->numMethods;
+            while (lo < hi) { // first one with our hashes
+                mid = (lo + hi) / 2;
+                if (NATIVE_METHOD_KEY(map[mid]) < key)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            for (; lo < cls->info.native->numMethods && NATIVE_METHOD_KEY(map[lo]) == key; lo++) {
+                n = map[lo].idx;
+#else
             for (n = 0; n < cls->info.native->numMethods; n++) {
+#endif
                 p.type = STR_EQ_PAR_TYPE_PTR;
                 p.data.ptr.len = ujCstrlen(p.data.ptr.str = cls->info.native->methods[n].name);
                 if (!ujThreadPrvStrEqualEx(&p, name))
@@ -942,11 +1426,6 @@ static UInt24 ujThreadPrvGetMethodAddr(UjClass **clsP, UjPrvStrEqualParam *name,
             }
         } else if (cls->ujc) { // UJC
 #ifdef UJ_FTR_SUPPORT_UJC_FORMAT
-#ifdef UJ_OPT_CLASS_SEARCH
-            uint8_t nHash = ujPrvHashString(name);
-            uint8_t tHash = ujPrvHashString(type);
-#endif
-
             addr = cls->info.java.methods;
             n = ujThreadReadBE16_ex(cls->info.java.readD, addr);
             addr += 2;
@@ -1088,6 +1567,31 @@ static uint8_t ujThreadPrvGoto(UjThread *t, UjClass *cls, HANDLE objHandle, UInt
     }
 }
 
+static uint16_t ujThreadPrvStackSize(_UNUSED_ UjClass *cls, _UNUSED_ UInt24 addr, _UNUSED_ uint16_t flags) // bytes, zero if classCvt did not work it out
+{
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+    void *readD;
+    uint32_t sz;
+
+    if (addr == UJ_PC_BAD || cls->native || !cls->ujc || !(flags & UJC_METHOD_FLAG_STACK_DEPTH))
+        return 0;
+
+    readD = cls->info.java.readD;
+
+    addr -= 6;
+    addr -= (UInt24)(uint16_t)ujThreadReadBE16_ex(readD, addr) * 8; // skip exception table
+    if (flags & UJC_METHOD_FLAG_STATIC_IMAGE) {
+        addr -= 2;
+        addr -= (uint16_t)ujThreadReadBE16_ex(readD, addr);
+    }
+    sz = (uint32_t)(uint16_t)ujThreadReadBE16_ex(readD, addr - 2) * sizeof(uintptr_t);
+
+    return sz > 0xFFFF ? 0xFFFF : sz;
+#else
+    return 0;
+#endif
+}
+
 uint8_t ujThreadGoto(HANDLE threadH, UjClass *cls, const char *methodNamePtr, const char *methodTypePtr)
 {
     UjPrvStrEqualParam name, type;
@@ -1123,6 +1627,23 @@ out:
     return ret;
 }
 
+uint16_t ujThreadStackSize(UjClass *cls, const char *methodNamePtr, const char *methodTypePtr)
+{
+    UjPrvStrEqualParam name, type;
+    UInt24 addr;
+    uint16_t flags;
+
+    name.type = STR_EQ_PAR_TYPE_PTR;
+    name.data.ptr.len = ujCstrlen(name.data.ptr.str = methodNamePtr);
+
+    type.type = STR_EQ_PAR_TYPE_PTR;
+    type.data.ptr.len = ujCstrlen(type.data.ptr.str = methodTypePtr);
+
+    addr = ujThreadPrvGetMethodAddr(&cls, &name, &type, JAVA_ACC_STATIC, JAVA_ACC_STATIC, &flags);
+
+    return ujThreadPrvStackSize(cls, addr, flags);
+}
+
 bool ujCanRun(void)
 {
     return !!gFirstThread;
@@ -1349,31 +1870,112 @@ static bool ujThreadPrvDup(UjThread *t, int8_t howManyEx, int8_t howFarBelow) //
     return true;
 }
 
-static uintptr_t ujThreadPrvPeek(UjThread *t, uint8_t slots /* 0 is top of stack*/) // peek at stack items without popping
+#ifdef UJ_OPT_STACK_SEGMENTS
+static uint16_t ujThreadPrvFrameSlots(UjClass *cls, UInt24 addr) // most slots a java method's frame takes, ret info aside
 {
-    TL(" stack peek %u %s -> 0x%08" PRIXPTR "\n", slots,
-       ujThreadPrvBitGet(t, t->spBase - (slots + 1)) ? "ref" : "int",
-       t->stack[t->spBase - (slots + 1)]);
+    uint16_t ret = THREAD_FRAME_SLACK;
 
-    return t->stack[t->spBase - (slots + 1)];
-}
+    if (cls->ujc) {
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+        ret += ujThreadReadBE16_ex(cls->info.java.readD, addr - 4) + ujThreadReadBE16_ex(cls->info.java.readD, addr - 2);
+#endif
+    } else {
+#ifdef UJ_FTR_SUPPORT_CLASS_FORMAT
+        ret += ujThreadReadBE16_ex(cls->info.java.readD, addr + 6) + ujThreadReadBE16_ex(cls->info.java.readD, addr + 8);
+#endif
+    }
 
-uintptr_t ujThreadPeek(UjThread *t, uint8_t slot /* 0 is top of stack*/)
-{
-    return ujThreadPrvPeek(t, slot);
+    return ret;
 }
 
-static uintptr_t ujThreadPrvLocalLoad(UjThread *t, uint16_t idx)
+static uint8_t ujThreadPrvSpill(UjThread *t, uint16_t keep) // move all but the top "keep" slots to a new segment
 {
-    TL(" local load %u %s -> 0x%08" PRIXPTR "\n", idx,
-       ujThreadPrvBitGet(t, t->localsBase + idx) ? "ref" : "int",
-       t->stack[t->localsBase + idx]);
+    uint16_t i, n = t->spBase - keep;
+    UjStackSeg *seg;
+    uint8_t *bits;
+    HANDLE segH;
+    bool isRef;
 
-    return t->stack[t->localsBase + idx];
-}
+    segH = ujHeapHandleNewEx(sizeof(UjStackSeg) + n * sizeof(uintptr_t) + (n + 7) / 8, UJ_HEAP_LEAF);
+    if (!segH)
+        return UJ_ERR_OUT_OF_MEMORY;
 
-static void ujThreadPrvLocalStore(UjThread *t, uint16_t idx, uintptr_t v, bool isRef)
-{
+    seg = ujHeapHandleLock(segH);
+    seg->prev = t->spill;
+    seg->numSlots = n;
+    bits = (uint8_t *)(seg->stack + n);
+    for (i = 0; i < (n + 7) / 8; i++)
+        bits[i] = 0;
+    for (i = 0; i < n; i++) {
+        seg->stack[i] = t->stack[i];
+        if (ujThreadPrvBitGet(t, i))
+            bits[i >> 3] |= gShifts[i & 7];
+    }
+    ujHeapHandleRelease(segH);
+
+    for (i = 0; i < keep; i++) { // what stays goes to the bottom
+        isRef = ujThreadPrvBitGet(t, n + i);
+        ujThreadPrvBitClear(t, n + i);
+        if (isRef)
+            ujThreadPrvBitSet(t, i);
+        else
+            ujThreadPrvBitClear(t, i);
+        t->stack[i] = t->stack[n + i];
+    }
+    for (; i < n; i++)
+        ujThreadPrvBitClear(t, i);
+
+    t->spBase = keep;
+    t->spill = segH;
+
+    return UJ_ERR_NONE;
+}
+
+static void ujThreadPrvUnspill(UjThread *t) // the stack is empty, bring the newest segment back
+{
+    HANDLE segH = t->spill;
+    UjStackSeg *seg = ujHeapHandleLock(segH);
+    uint8_t *bits = (uint8_t *)(seg->stack + seg->numSlots);
+    uint16_t i;
+
+    for (i = 0; i < seg->numSlots; i++) {
+        t->stack[i] = seg->stack[i];
+        if (bits[i >> 3] & gShifts[i & 7])
+            ujThreadPrvBitSet(t, i);
+    }
+    t->spBase = seg->numSlots;
+    t->spill = seg->prev;
+
+    ujHeapHandleRelease(segH);
+    ujHeapHandleFree(segH);
+}
+#endif
+
+static uintptr_t ujThreadPrvPeek(UjThread *t, uint8_t slots /* 0 is top of stack*/) // peek at stack items without popping
+{
+    TL(" stack peek %u %s -> 0x%08" PRIXPTR "\n", slots,
+       ujThreadPrvBitGet(t, t->spBase - (slots + 1)) ? "ref" : "int",
+       t->stack[t->spBase - (slots + 1)]);
+
+    return t->stack[t->spBase - (slots + 1)];
+}
+
+uintptr_t ujThreadPeek(UjThread *t, uint8_t slot /* 0 is top of stack*/)
+{
+    return ujThreadPrvPeek(t, slot);
+}
+
+static uintptr_t ujThreadPrvLocalLoad(UjThread *t, uint16_t idx)
+{
+    TL(" local load %u %s -> 0x%08" PRIXPTR "\n", idx,
+       ujThreadPrvBitGet(t, t->localsBase + idx) ? "ref" : "int",
+       t->stack[t->localsBase + idx]);
+
+    return t->stack[t->localsBase + idx];
+}
+
+static void ujThreadPrvLocalStore(UjThread *t, uint16_t idx, uintptr_t v, bool isRef)
+{
     TL(" local store %u %s 0x%08" PRIXPTR "\n", idx, isRef ? "ref" : "int", v);
 
     t->stack[t->localsBase + idx] = v;
@@ -1475,6 +2077,15 @@ static void ujThreadPrvLocalStoreLong(UjThread *t, uint16_t idx, Int64 L)
 
 #endif
 
+static uint8_t *ujThreadPrvArrayElems(const UjArray *arr) // where the elements are, not for ROM arrays
+{
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+    if (arr->objType == OBJ_TYPE_EXT_ARRAY)
+        return (uint8_t *)ujThreadPrvGetPtr(arr->data);
+#endif
+    return (uint8_t *)arr->data;
+}
+
 static int32_t ujThreadPrvArrayGetLength(HANDLE arrHandle)
 {
     int32_t ret;
@@ -1485,12 +2096,58 @@ static int32_t ujThreadPrvArrayGetLength(HANDLE arrHandle)
     return ret;
 }
 
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+// ROM arrays hold {UjClass*, u32 addr} and their elements stay big-endian in the class file
+static uint32_t ujThreadPrvRomArrayRead(const UjArray *arr, uint32_t ofst, uint8_t sz)
+{
+    UjClass *cls = (UjClass *)ujThreadPrvGetPtr(arr->data);
+    UInt24 addr = ujThreadPrvGet32(arr->data + sizeof(uintptr_t)) + ofst;
+    uint32_t ret = 0;
+
+    while (sz--)
+        ret = (ret << 8) | ujReadClassByte(cls->info.java.readD, addr++);
+
+    return ret;
+}
+#endif
+
+// sz bytes of elements at ofst, sz is 1, 2 or 4 (longs go as two halves, high one first)
+static uint32_t ujThreadPrvArrayRead(const UjArray *arr, uint32_t ofst, uint8_t sz)
+{
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+    if (arr->objType == OBJ_TYPE_ROM_ARRAY)
+        return ujThreadPrvRomArrayRead(arr, ofst, sz);
+#endif
+
+    switch (sz) {
+    case 1:
+        return ujThreadPrvArrayElems(arr)[ofst];
+    case 2:
+        return ujThreadPrvGet16(ujThreadPrvArrayElems(arr) + ofst);
+    default:
+        return ujThreadPrvGet32(ujThreadPrvArrayElems(arr) + ofst);
+    }
+}
+
+static void ujThreadPrvArrayWrite(UjArray *arr, uint32_t ofst, uint8_t sz, uint32_t v) // not for ROM arrays
+{
+    switch (sz) {
+    case 1:
+        ujThreadPrvArrayElems(arr)[ofst] = v;
+        break;
+    case 2:
+        ujThreadPrvPut16(ujThreadPrvArrayElems(arr) + ofst, v);
+        break;
+    default:
+        ujThreadPrvPut32(ujThreadPrvArrayElems(arr) + ofst, v);
+        break;
+    }
+}
+
 static int32_t ujThreadPrvArrayGet4B(HANDLE arrHandle, int32_t idx)
 {
-    int32_t ret;
+    int32_t ret = ujThreadPrvArrayRead(ujHeapHandleLock(arrHandle), idx << 2, 4);
 
-    idx <<= 2;
-    ret = ujThreadPrvGet32(((UjArray *)ujHeapHandleLock(arrHandle))->data + idx);
     ujHeapHandleRelease(arrHandle);
 
     return ret;
@@ -1498,10 +2155,8 @@ static int32_t ujThreadPrvArrayGet4B(HANDLE arrHandle, int32_t idx)
 
 static int16_t ujThreadPrvArrayGet2B(HANDLE arrHandle, int32_t idx)
 {
-    int16_t ret;
+    int16_t ret = ujThreadPrvArrayRead(ujHeapHandleLock(arrHandle), idx << 1, 2);
 
-    idx <<= 1;
-    ret = ujThreadPrvGet16(((UjArray *)ujHeapHandleLock(arrHandle))->data + idx);
     ujHeapHandleRelease(arrHandle);
 
     return ret;
@@ -1509,9 +2164,8 @@ static int16_t ujThreadPrvArrayGet2B(HANDLE arrHandle, int32_t idx)
 
 static int8_t ujThreadPrvArrayGet1B(HANDLE arrHandle, int32_t idx)
 {
-    int8_t ret;
+    int8_t ret = ujThreadPrvArrayRead(ujHeapHandleLock(arrHandle), idx, 1);
 
-    ret = ((UjArray *)ujHeapHandleLock(arrHandle))->data[idx];
     ujHeapHandleRelease(arrHandle);
 
     return ret;
@@ -1539,7 +2193,7 @@ uint32_t ujArrayGetInt(uint32_t arr, uint32_t idx) // external use
 
 void *ujArrayRawAccessStart(uint32_t arr)
 {
-    return ((UjArray *)ujHeapHandleLock(arr))->data;
+    return ujThreadPrvArrayElems(ujHeapHandleLock(arr));
 }
 
 void ujArrayRawAccessFinish(uint32_t arr)
@@ -1548,17 +2202,18 @@ void ujArrayRawAccessFinish(uint32_t arr)
 }
 
 #if defined(UJ_FTR_SUPPORT_LONG) || defined(UJ_FTR_SUPPORT_DOUBLE)
-static Int64 ujThreadPrvArrayGetLong(HANDLE arrHandle, int32_t idx)
+static Int64 ujThreadPrvArrayReadLong(const UjArray *arr, int32_t idx)
 {
-    Int64 ret;
-    UjArray *arr = (UjArray *)ujHeapHandleLock(arrHandle);
-
     idx <<= 3;
-    ret = u64_from_halves(ujThreadPrvGet32(arr->data + idx),
-                          ujThreadPrvGet32(arr->data + idx + 4));
-    ujHeapHandleRelease(arrHandle);
 
-    return ret;
+    return u64_from_halves(ujThreadPrvArrayRead(arr, idx, 4), ujThreadPrvArrayRead(arr, idx + 4, 4));
+}
+
+static void ujThreadPrvArrayWriteLong(UjArray *arr, int32_t idx, UInt64 val)
+{
+    idx <<= 3;
+    ujThreadPrvArrayWrite(arr, idx + 0, 4, u64_get_hi(val));
+    ujThreadPrvArrayWrite(arr, idx + 4, 4, u64_64_to_32(val));
 }
 #endif
 
@@ -1570,49 +2225,34 @@ static Int64 ujThreadPrvArrayGetLong(HANDLE arrHandle, int32_t idx)
 
 static void ujThreadPrvArraySet4B(HANDLE arrHandle, int32_t idx, uint32_t v)
 {
-    idx <<= 2;
-    ujThreadPrvPut32(((UjArray *)ujHeapHandleLock(arrHandle))->data + idx, v);
-    ujHeapHandleRelease(arrHandle);
-}
-
-static void ujThreadPrvArraySet2B(HANDLE arrHandle, int32_t idx, uint16_t v)
-{
-    idx <<= 1;
-    ujThreadPrvPut16(((UjArray *)ujHeapHandleLock(arrHandle))->data + idx, v);
-    ujHeapHandleRelease(arrHandle);
-}
-
-static void ujThreadPrvArraySet1B(HANDLE arrHandle, int32_t idx, uint8_t v)
-{
-    ((UjArray *)ujHeapHandleLock(arrHandle))->data[idx] = v;
-    ujHeapHandleRelease(arrHandle);
-}
-
-#if defined(UJ_FTR_SUPPORT_LONG) || defined(UJ_FTR_SUPPORT_DOUBLE)
-static void ujThreadPrvArraySetLong(HANDLE arrHandle, int32_t idx, UInt64 val)
-{
-    UjArray *arr = (UjArray *)ujHeapHandleLock(arrHandle);
-
-    idx <<= 3;
-    ujThreadPrvPut32(arr->data + idx + 0, u64_get_hi(val));
-    ujThreadPrvPut32(arr->data + idx + 4, u64_64_to_32(val));
-
+    ujThreadPrvArrayWrite(ujHeapHandleLock(arrHandle), idx << 2, 4, v);
     ujHeapHandleRelease(arrHandle);
 }
-#endif
 
 #define ujThreadPrvArraySetInt(arr, idx, i)    ujThreadPrvArraySet4B(arr, idx, (uint32_t)i)
 #define ujThreadPrvArraySetRef(arr, idx, obj)  ujThreadPrvArraySet4B(arr, idx, (uint32_t)obj)
-#define ujThreadPrvArraySetChar(arr, idx, ch)  ujThreadPrvArraySet2B(arr, idx, ch)
-#define ujThreadPrvArraySetShort(arr, idx, sh) ujThreadPrvArraySet2B(arr, idx, sh)
-#define ujThreadPrvArraySetByte(arr, idx, b)   ujThreadPrvArraySet1B(arr, idx, b)
 
-static uint8_t ujThreadPrvArrayBoundsCheck(HANDLE arrHandle, int32_t idx)
+// null, bounds and (for stores) read-only checks, then the array itself. the array instructions
+// use this instead of a lock: nothing they do before they are done with it can allocate, so it
+// cannot move. a reference store still needs ujThreadPrvArraySetRef() for the heap's write barriers
+static uint8_t ujThreadPrvArrayAt(HANDLE arrHandle, int32_t idx, bool store, UjArray **arrP)
 {
+    UjArray *arr;
+
     if (!arrHandle)
         return UJ_ERR_NULL_POINTER;
-    if (idx < 0 || idx >= ujThreadPrvArrayGetLength(arrHandle))
+
+    arr = ujHeapHandlePeek(arrHandle);
+    if ((uint32_t)idx >= arr->length)
         return UJ_ERR_ARRAY_INDEX_OOB;
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+    if (store && arr->objType == OBJ_TYPE_ROM_ARRAY)
+        return UJ_ERR_ARRAY_READ_ONLY;
+#else
+    (void)store;
+#endif
+
+    *arrP = arr;
 
     return UJ_ERR_NONE;
 }
@@ -1684,7 +2324,7 @@ static uint8_t ujThreadPrvRet(UjThread *t, _UNUSED_ HANDLE threadH) // the oppos
             uint8_t ret;
             if (t->flags.access.hasInst) {
                 inst = ujHeapHandleLock(t->instH);
-                ret = ujThreadPrvMonExit(threadH, &inst->mon);
+                ret = ujThreadPrvInstMonExit(threadH, inst);
                 ujHeapHandleRelease(t->instH);
             } else {
                 ret = ujThreadPrvMonExit(threadH, &t->cls->mon);
@@ -1707,11 +2347,16 @@ static uint8_t ujThreadPrvRet(UjThread *t, _UNUSED_ HANDLE threadH) // the oppos
         if (t->flags.access.hasInst) {
             t->instH = (HANDLE)combined_ptr;
             inst = ujHeapHandleLock(t->instH);
-            t->cls = inst->cls;
+            t->cls = OBJ_CLS(inst);
             ujHeapHandleRelease(t->instH);
         } else {
             t->cls = (UjClass *)combined_ptr;
         }
+
+#ifdef UJ_OPT_STACK_SEGMENTS
+        if (!t->spBase && t->spill) // back in a frame we had moved out
+            ujThreadPrvUnspill(t);
+#endif
     }
     TL(" return completes with locals=%u, sp=%u, pc=0x%06X\n", t->localsBase,
        t->spBase, t->pc);
@@ -1786,16 +2431,20 @@ static uint8_t ujThreadPrvNewArray(char type, int32_t len, HANDLE *arrP)
 
     if (len < 0)
         return UJ_ERR_NEG_ARR_SZ;
+    if ((uint32_t)len > (0xFFFFFFFFUL - sizeof(UjArray)) / ujPrvJavaTypeToSize(type))
+        return UJ_ERR_OUT_OF_MEMORY;
 
-    handle = ujHeapHandleNew(sizeof(UjArray) + len * ujPrvJavaTypeToSize(type));
+    handle = ujHeapHandleNewEx(sizeof(UjArray) + len * ujPrvJavaTypeToSize(type),
+                               (type == JAVA_TYPE_OBJ || type == JAVA_TYPE_ARRAY) ? 0 : UJ_HEAP_LEAF);
     if (!handle)
         return UJ_ERR_OUT_OF_MEMORY;
 
     arr = ujHeapHandleLock(handle);
-    arr->cls = 0;
+    OBJ_SET_CLS(arr, NULL);
     arr->objType = (type == JAVA_TYPE_ARRAY || type == JAVA_TYPE_OBJ)
                        ? OBJ_TYPE_OBJ_ARRAY
                        : OBJ_TYPE_ARRAY;
+    arr->elemType = type;
     arr->length = len;
 
     ujHeapHandleRelease(handle);
@@ -1819,6 +2468,52 @@ uint8_t ujArrayNew(char type, int32_t len, HANDLE *arrP)
     return UJ_ERR_NONE;
 }
 
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+uint8_t ujArrayNewExternal(char type, void *ptr, int32_t len, ujExtArrayReleaseF releaseF, void *userData, HANDLE *arrP)
+{
+    HANDLE handle;
+    UjArray *arr;
+    int ofst;
+
+    if (type == JAVA_TYPE_OBJ || type == JAVA_TYPE_ARRAY) // GC could not follow references out there
+        return UJ_ERR_INVALID_CAST;
+    if (len < 0)
+        return UJ_ERR_NEG_ARR_SZ;
+    if (len > 0xFFFFFFL)
+        return UJ_ERR_OUT_OF_MEMORY;
+
+    // tenured, since the nursery is swept without looking at what it frees
+    handle = ujHeapHandleNewEx(sizeof(UjArray) + 3 * sizeof(uintptr_t),
+                               UJ_HEAP_TENURED | UJ_HEAP_LEAF | UJ_HEAP_FINALIZE);
+    if (!handle)
+        return UJ_ERR_OUT_OF_MEMORY;
+
+    arr = ujHeapHandleLock(handle);
+    OBJ_SET_CLS(arr, NULL);
+    arr->objType = OBJ_TYPE_EXT_ARRAY;
+    arr->elemType = type;
+    arr->length = len;
+    ofst = ujThreadPrvPutPtr(arr->data, (uintptr_t)ptr);
+    ofst += ujThreadPrvPutPtr(arr->data + ofst, (uintptr_t)releaseF);
+    ujThreadPrvPutPtr(arr->data + ofst, (uintptr_t)userData);
+    ujHeapHandleRelease(handle);
+
+    *arrP = handle;
+
+    return UJ_ERR_NONE;
+}
+
+void ujHeapFinalize(void *data) // only external arrays ask for this
+{
+    UjArray *arr = data;
+    ujExtArrayReleaseF releaseF = (ujExtArrayReleaseF)ujThreadPrvGetPtr(arr->data + sizeof(uintptr_t));
+
+    if (releaseF)
+        releaseF((void *)ujThreadPrvGetPtr(arr->data),
+                 (void *)ujThreadPrvGetPtr(arr->data + 2 * sizeof(uintptr_t)));
+}
+#endif
+
 static uint8_t ujThreadPrvMultiNewArrayHelper(UjThread *t, UInt24 type,
                                             uint8_t thisDim, uint8_t totalDim,
                                             HANDLE *arrP)
@@ -1898,9 +2593,15 @@ static HANDLE ujThreadPrvNewInstance(UjClass *cls)
 
     inst = ujHeapHandleLock(handle);
 #ifdef UJ_FTR_SYNCHRONIZATION
+#ifdef UJ_OPT_COMPACT_HEADERS
+    inst->lock = 0;
+#else
     inst->mon.numHolds = 0;
+    inst->mon.waitId = 0;
+    inst->mon.notifyId = 0;
 #endif
-    inst->cls = cls;
+#endif
+    OBJ_SET_CLS(inst, cls);
     ujHeapHandleRelease(handle);
 
     return handle;
@@ -1919,10 +2620,10 @@ uint16_t ujStringGetBytes(HANDLE handle, uint8_t *buf, uint32_t bufsize)
 
 #ifdef UJ_OPT_RAM_STRINGS
     cls = NULL;
-    extra = ujThreadPrvGet32(inst->data + inst->cls->supr->instDataOfst + 0);
+    extra = ujThreadPrvGet32(inst->data + OBJ_CLS(inst)->supr->instDataOfst + 0);
 #else
-    cls = (UjClass *)ujThreadPrvGetPtr(inst->data + inst->cls->supr->instDataOfst + 0);
-    extra = ujThreadPrvGet32(inst->data + inst->cls->supr->instDataOfst + 4);
+    cls = (UjClass *)ujThreadPrvGetPtr(inst->data + OBJ_CLS(inst)->supr->instDataOfst + 0);
+    extra = ujThreadPrvGet32(inst->data + OBJ_CLS(inst)->supr->instDataOfst + sizeof(uintptr_t));
 #endif
 
     ujHeapHandleRelease(handle);
@@ -1972,7 +2673,7 @@ uint8_t ujStringFromBytes(HANDLE *handleP, const uint8_t *str, uint16_t len)
 
     inst = ujHeapHandleLock(*handleP);
 
-    stringData = ujHeapHandleNew(real_len + 2);
+    stringData = ujHeapHandleNewEx(real_len + 2, UJ_HEAP_LEAF);
     if (!stringData) {
         ujHeapHandleRelease(*handleP);
         ujHeapHandleFree(*handleP);
@@ -1982,10 +2683,10 @@ uint8_t ujStringFromBytes(HANDLE *handleP, const uint8_t *str, uint16_t len)
 #ifdef UJ_OPT_RAM_STRINGS
     ofst = 0;
 #else
-    ofst = ujThreadPrvPutPtr(inst->data + inst->cls->supr->instDataOfst, 0);
+    ofst = ujThreadPrvPutPtr(inst->data + OBJ_CLS(inst)->supr->instDataOfst, 0);
 #endif
 
-    ujThreadPrvPut32(inst->data + inst->cls->supr->instDataOfst + ofst, stringData);
+    ujThreadPrvPut32(inst->data + OBJ_CLS(inst)->supr->instDataOfst + ofst, stringData);
 
     dst = ujHeapHandleLock(stringData);
     ujThreadPrvPut16(dst, real_len);
@@ -2012,10 +2713,10 @@ void ujDbgPrintJavaString(HANDLE handle)
 
 #ifdef UJ_OPT_RAM_STRINGS
     cls = NULL;
-    extra = ujThreadPrvGet32(inst->data + inst->cls->supr->instDataOfst + 0);
+    extra = ujThreadPrvGet32(inst->data + OBJ_CLS(inst)->supr->instDataOfst + 0);
 #else
-    cls = (UjClass *)ujThreadPrvGetPtr(inst->data + inst->cls->supr->instDataOfst + 0);
-    extra = ujThreadPrvGet32(inst->data + inst->cls->supr->instDataOfst + 4);
+    cls = (UjClass *)ujThreadPrvGetPtr(inst->data + OBJ_CLS(inst)->supr->instDataOfst + 0);
+    extra = ujThreadPrvGet32(inst->data + OBJ_CLS(inst)->supr->instDataOfst + sizeof(uintptr_t));
 #endif
 
     ujHeapHandleRelease(handle);
@@ -2075,19 +2776,18 @@ void ujDbgPrintClass(UjClass *cls)
 static uint8_t ujPrvNewStringObj(HANDLE *hP)
 {
     UjPrvStrEqualParam p;
-    static UjClass *cls = NULL;
     HANDLE handle;
 
-    if (!cls) {
+    if (!gStringCls) {
         p.type = STR_EQ_PAR_TYPE_PTR;
         p.data.ptr.len = ujCstrlen(p.data.ptr.str = "java/lang/String");
 
-        cls = ujThreadPrvFindClass(&p);
+        gStringCls = ujThreadPrvFindClass(&p);
     }
-    if (!cls)
+    if (!gStringCls)
         return UJ_ERR_DEPENDENCY_MISSING;
 
-    handle = ujThreadPrvNewInstance(cls);
+    handle = ujThreadPrvNewInstance(gStringCls);
     if (!handle)
         return UJ_ERR_OUT_OF_MEMORY;
 
@@ -2095,7 +2795,7 @@ static uint8_t ujPrvNewStringObj(HANDLE *hP)
     return UJ_ERR_NONE;
 }
 
-static uint8_t ujThreadPrvNewConstString(UjThread *t, UInt24 addr, HANDLE *handleP)
+static uint8_t ujPrvNewClassString(UjClass *cls, UInt24 addr, HANDLE *handleP) // addr points to the u16 length
 {
     uint8_t ret;
     UjInstance *inst;
@@ -2105,33 +2805,32 @@ static uint8_t ujThreadPrvNewConstString(UjThread *t, UInt24 addr, HANDLE *handl
         return ret;
     // we have to lock now it to avoid it being GCed
     inst = ujHeapHandleLock(*handleP);
-    addr++;
 
 #ifdef UJ_OPT_RAM_STRINGS
     HANDLE stringData;
     uint8_t *dst;
     uint16_t len;
 
-    len = ujThreadReadBE16(t, addr);
+    len = ujThreadReadBE16_ex(cls->info.java.readD, addr);
     addr += 2;
-    stringData = ujHeapHandleNew(len + 2);
+    stringData = ujHeapHandleNewEx(len + 2, UJ_HEAP_LEAF);
     if (!stringData) {
         ujHeapHandleRelease(*handleP);
         ujHeapHandleFree(*handleP);
         return UJ_ERR_OUT_OF_MEMORY;
     }
 
-    ujThreadPrvPut32(inst->data + inst->cls->supr->instDataOfst + 0, stringData);
+    ujThreadPrvPut32(inst->data + OBJ_CLS(inst)->supr->instDataOfst + 0, stringData);
 
     dst = ujHeapHandleLock(stringData);
     ujThreadPrvPut16(dst, len);
     dst += 2;
     while (len--)
-        *dst++ = ujThreadPrvFetchClassByte(t, addr++);
+        *dst++ = ujReadClassByte(cls->info.java.readD, addr++);
     ujHeapHandleRelease(stringData);
 #else
-    ujThreadPrvPutPtr(inst->data + inst->cls->supr->instDataOfst + 0, (uintptr_t)t->cls);
-    ujThreadPrvPut32(inst->data + inst->cls->supr->instDataOfst + sizeof(uintptr_t), addr);
+    ujThreadPrvPutPtr(inst->data + OBJ_CLS(inst)->supr->instDataOfst + 0, (uintptr_t)cls);
+    ujThreadPrvPut32(inst->data + OBJ_CLS(inst)->supr->instDataOfst + sizeof(uintptr_t), addr);
 #endif
 
     ujHeapHandleRelease(*handleP);
@@ -2139,6 +2838,50 @@ static uint8_t ujThreadPrvNewConstString(UjThread *t, UInt24 addr, HANDLE *handl
     return UJ_ERR_NONE;
 }
 
+#ifdef UJ_OPT_INTERN_STRINGS
+static uint16_t ujPrvNumConsts(UjClass *cls)
+{
+    if (cls->ujc) {
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+        return ujThreadReadBE16_ex(cls->info.java.readD, 18);
+#endif
+    } else {
+#ifdef UJ_FTR_SUPPORT_CLASS_FORMAT
+        return ujThreadReadBE16_ex(cls->info.java.readD, 8);
+#endif
+    }
+    return 0;
+}
+#endif
+
+static uint8_t ujThreadPrvNewConstString(UjThread *t, _UNUSED_ uint16_t idx, UInt24 addr, HANDLE *handleP)
+{
+#ifdef UJ_OPT_INTERN_STRINGS
+    UjClass *cls = t->cls;
+    HANDLE h;
+    uint8_t ret;
+
+    if (!cls->strings) {
+        ret = ujThreadPrvNewArray(JAVA_TYPE_OBJ, ujPrvNumConsts(cls), &h);
+        if (ret != UJ_ERR_NONE)
+            return ret;
+        cls->strings = h;
+    }
+
+    *handleP = ujThreadPrvArrayGetRef(cls->strings, idx);
+    if (*handleP)
+        return UJ_ERR_NONE;
+
+    ret = ujPrvNewClassString(cls, addr + 1, handleP); // skip const type
+    if (ret == UJ_ERR_NONE)
+        ujThreadPrvArraySetRef(cls->strings, idx, *handleP);
+
+    return ret;
+#else
+    return ujPrvNewClassString(t->cls, addr + 1, handleP); // skip const type
+#endif
+}
+
 static void ujThreadProcessTrippleRef(UjThread *t, uint16_t idx,
                                       UjPrvStrEqualParam *clsI,
                                       UjPrvStrEqualParam *nameI,
@@ -2203,10 +2946,25 @@ static uint8_t ujThreadPrvInvoke(UjThread *t, _UNUSED_ HANDLE threadH, uint8_t n
     uint16_t len, nameIdx;
     uint8_t ret;
     bool isSyncNow = false;
+#ifdef UJ_OPT_INVOKE_CACHE
+    UjInvokeCacheEntry *ce = NULL;
+    UInt24 sitePc = t->pc;
+    bool siteHit = false;
+    UjClass *recv;
+#endif
 
     if (numParams) {
         nameIdx = numParams - 1;
-    } else {
+    }
+#ifdef UJ_OPT_INVOKE_CACHE
+    else if ((ce = &gInvokeCache[INVOKE_CACHE_IDX(t->cls, sitePc)])->site == t->cls && ce->pc == sitePc) {
+        // been here before, no need to parse the signature again
+        t->pc += pcBytes;
+        nameIdx = ce->numSlots;
+        siteHit = true;
+    }
+#endif
+    else {
         ujThreadProcessTrippleRef(t, ujThreadReadBE16(t, t->pc), &p3, &p1, &p2);
         t->pc += pcBytes;
 
@@ -2295,7 +3053,7 @@ static uint8_t ujThreadPrvInvoke(UjThread *t, _UNUSED_ HANDLE threadH, uint8_t n
                 ret = 1;
             }
 
-            cls = inst->cls;
+            cls = OBJ_CLS(inst);
 
             if (ret)
                 ujHeapHandleRelease(objRef);
@@ -2322,6 +3080,19 @@ static uint8_t ujThreadPrvInvoke(UjThread *t, _UNUSED_ HANDLE threadH, uint8_t n
 
     */
 
+#ifdef UJ_OPT_INVOKE_CACHE
+    // same receiver class as last time (always so for static and special calls) -> same method
+    recv = cls;
+    if (siteHit && ce->recv == recv) {
+        cls = ce->cls;
+        addr = ce->addr;
+        len = ce->flags;
+        goto resolved;
+    }
+    if (siteHit)
+        ujThreadProcessTrippleRef(t, ujThreadReadBE16(t, sitePc), &p3, &p1, &p2);
+#endif
+
     if (!cls) {
         cls = numParams ? t->cls : ujThreadPrvFindClass(&p3);
         if (!cls) {
@@ -2341,22 +3112,46 @@ static uint8_t ujThreadPrvInvoke(UjThread *t, _UNUSED_ HANDLE threadH, uint8_t n
         if (addr == UJ_PC_BAD) {
             return UJ_ERR_METHOD_NONEXISTENT;
         }
+#ifdef UJ_OPT_INVOKE_CACHE
+        ce->site = t->cls;
+        ce->recv = recv;
+        ce->cls = cls;
+        ce->pc = sitePc;
+        ce->addr = addr;
+        ce->flags = len;
+        ce->numSlots = nameIdx;
+#endif
     }
 
+#ifdef UJ_OPT_INVOKE_CACHE
+resolved:
+#endif
+
     TL("  addr = 0x%06X\n", addr);
 
+#ifdef UJ_OPT_STACK_SEGMENTS
+    // the new frame does not fit, make room by moving everything under the params out
+    if (!cls->native && t->spBase > nameIdx &&
+        t->spBase - nameIdx + THREAD_RET_INFO_SZ + ujThreadPrvFrameSlots(cls, addr) > t->spLimit) {
+        ret = ujThreadPrvSpill(t, nameIdx);
+        if (ret != UJ_ERR_NONE)
+            return ret;
+    }
+#endif
+
 #ifdef UJ_FTR_SYNCHRONIZATION
     if (len & JAVA_ACC_SYNCHRONIZED) {
-        UjMonitor *mon;
-
-        mon = &cls->mon;
-        if (invokeType != UJ_INVOKE_STATIC)
-            mon = &((UjInstance *)ujHeapHandleLock(objRef))->mon;
-        ret = ujThreadPrvMonEnter(threadH, mon);
-        if (invokeType != UJ_INVOKE_STATIC)
+        if (invokeType != UJ_INVOKE_STATIC) {
+            ret = ujThreadPrvInstMonEnter(threadH, t, ujHeapHandleLock(objRef));
             ujHeapHandleRelease(objRef);
-        if (!ret)
-            return UJ_ERR_RETRY_LATER;
+        } else if (ujThreadPrvMonEnter(threadH, &cls->mon)) {
+            ret = UJ_ERR_NONE;
+        } else {
+            ujThreadPrvMonPark(t, &cls->mon);
+            ret = UJ_ERR_RETRY_LATER;
+        }
+        if (ret != UJ_ERR_NONE)
+            return ret;
 
         isSyncNow = true;
     }
@@ -2672,7 +3467,7 @@ static uint8_t ujThreadPrvInstanceof(UjThread *t, uint16_t descrIdx, HANDLE objH
         }
     }
 
-    cls = ((UjInstance *)ujHeapHandleLock(objHandle))->cls;
+    cls = OBJ_CLS((UjInstance *)ujHeapHandleLock(objHandle));
     ujHeapHandleRelease(objHandle);
 
     while (cls) {
@@ -2834,6 +3629,7 @@ static uint8_t ujThreadPrvInstr(HANDLE threadH, UjThread *t) // return success o
     uint16_t t16, v16;
     int32_t i32, v32, t32;
     HANDLE h, h2;
+    UjArray *arr;
 #if defined(UJ_FTR_SYNCHRONIZATION)
     UjInstance *obj;
 #endif
@@ -2922,9 +3718,10 @@ instr_start:
         /* fall-thru */
     case 0x13: // ldc_w
 
-        v32 = ujThreadPrvReadConst32(t, ujThreadPrvGetOffset(t, !wide), &instr);
+        t16 = ujThreadPrvGetOffset(t, !wide);
+        v32 = ujThreadPrvReadConst32(t, t16, &instr);
         if (instr == JAVA_CONST_TYPE_STR_REF || instr == JAVA_CONST_TYPE_STRING) {
-            ret = ujThreadPrvNewConstString(t, v32, &h);
+            ret = ujThreadPrvNewConstString(t, t16, v32, &h);
             if (ret != UJ_ERR_NONE)
                 goto out;
             ujThreadPrvPushRef(t, h);
@@ -3026,10 +3823,10 @@ instr_start:
 
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, false, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
-        ujThreadPrvPushInt(t, ujThreadPrvArrayGetInt(h, i32));
+        ujThreadPrvPushInt(t, (int32_t)ujThreadPrvArrayRead(arr, i32 << 2, 4));
         break;
 
     case 0x2F: // laload
@@ -3038,10 +3835,10 @@ instr_start:
 #if defined(UJ_FTR_SUPPORT_LONG) || defined(UJ_FTR_SUPPORT_DOUBLE)
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, false, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
-        ujThreadPrvPushLong(t, ujThreadPrvArrayGetLong(h, i32));
+        ujThreadPrvPushLong(t, ujThreadPrvArrayReadLong(arr, i32));
 #else
         goto invalid_instr;
 #endif
@@ -3051,40 +3848,40 @@ instr_start:
 
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, false, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
-        ujThreadPrvPushRef(t, ujThreadPrvArrayGetRef(h, i32));
+        ujThreadPrvPushRef(t, (HANDLE)ujThreadPrvArrayRead(arr, i32 << 2, 4));
         break;
 
     case 0x33: // baload
 
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, false, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
-        ujThreadPrvPushInt(t, ujThreadPrvArrayGetByte(h, i32));
+        ujThreadPrvPushInt(t, (int8_t)ujThreadPrvArrayRead(arr, i32, 1));
         break;
 
     case 0x34: // caload
 
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, false, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
-        ujThreadPrvPushInt(t, ujThreadPrvArrayGetChar(h, i32));
+        ujThreadPrvPushInt(t, (uint16_t)ujThreadPrvArrayRead(arr, i32 << 1, 2));
         break;
 
     case 0x35: // saload
 
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, false, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
-        ujThreadPrvPushInt(t, ujThreadPrvArrayGetShort(h, i32));
+        ujThreadPrvPushInt(t, (int16_t)ujThreadPrvArrayRead(arr, i32 << 1, 2));
         break;
 
     case 0x36: // istore
@@ -3168,10 +3965,10 @@ instr_start:
         v32 = ujThreadPrvPopInt(t);
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, true, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
-        ujThreadPrvArraySetInt(h, i32, v32);
+        ujThreadPrvArrayWrite(arr, i32 << 2, 4, v32);
         break;
 
     case 0x50: // lastore
@@ -3181,10 +3978,10 @@ instr_start:
         i64 = ujThreadPrvPopLong(t);
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, true, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
-        ujThreadPrvArraySetLong(h, i32, i64);
+        ujThreadPrvArrayWriteLong(arr, i32, i64);
 #else
         goto invalid_instr;
 #endif
@@ -3195,7 +3992,7 @@ instr_start:
         h2 = ujThreadPrvPopRef(t);
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, true, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
         ujThreadPrvArraySetRef(h, i32, h2);
@@ -3206,10 +4003,10 @@ instr_start:
         instr = ujThreadPrvPopInt(t);
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, true, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
-        ujThreadPrvArraySetByte(h, i32, (int8_t)instr);
+        ujThreadPrvArrayWrite(arr, i32, 1, instr);
         break;
 
     case 0x55: // castore
@@ -3217,10 +4014,10 @@ instr_start:
         t16 = ujThreadPrvPopInt(t);
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, true, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
-        ujThreadPrvArraySetChar(h, i32, t16);
+        ujThreadPrvArrayWrite(arr, i32 << 1, 2, t16);
         break;
 
     case 0x56: // sastore
@@ -3228,10 +4025,10 @@ instr_start:
         t16 = ujThreadPrvPopInt(t);
         i32 = ujThreadPrvPopInt(t);
         h = ujThreadPrvPopArrayref(t);
-        ret = ujThreadPrvArrayBoundsCheck(h, i32);
+        ret = ujThreadPrvArrayAt(h, i32, true, &arr);
         if (ret != UJ_ERR_NONE)
             goto out;
-        ujThreadPrvArraySetShort(h, i32, (int16_t)t16);
+        ujThreadPrvArrayWrite(arr, i32 << 1, 2, t16);
         break;
 
     case 0x57: // pop
@@ -4212,12 +5009,14 @@ instr_start:
         }
 #ifdef UJ_FTR_SYNCHRONIZATION
         obj = (UjInstance *)ujHeapHandleLock(h);
-
-        if (!ujThreadPrvMonEnter(threadH, &obj->mon)) { // fail
+        ret = ujThreadPrvInstMonEnter(threadH, t, obj);
+        ujHeapHandleRelease(h);
+        if (ret == UJ_ERR_RETRY_LATER) { // sleep till the holder lets go
             ujThreadPrvPushRef(t, h); // re-push the object for later
             t->pc--;                  // re-execute this instr later
         }
-        ujHeapHandleRelease(h);
+        if (ret != UJ_ERR_NONE)
+            goto out;
 #endif
         break;
 
@@ -4230,9 +5029,9 @@ instr_start:
         }
 #ifdef UJ_FTR_SYNCHRONIZATION
         obj = (UjInstance *)ujHeapHandleLock(h);
-        ret = ujThreadPrvMonExit(threadH, &obj->mon);
+        ret = ujThreadPrvInstMonExit(threadH, obj);
         ujHeapHandleRelease(h);
-        if (!ret)
+        if (ret != UJ_ERR_NONE)
             goto out;
 #endif
         break;
@@ -4303,15 +5102,96 @@ invalid_instr:
     return UJ_ERR_INVALID_OPCODE;
 }
 
+static bool ujThreadPrvRunnable(UjThread *t) // also ends timed wait()s that ran out
+{
+#ifdef UJ_FTR_SYNCHRONIZATION
+    if (t->waitId) {
+        if (!t->wakeAt || (int32_t)(ujHostTimeMs() - t->wakeAt) < 0) // parked on a monitor, or in wait()
+            return false;
+        t->waitId = 0;
+        t->wakeAt = 0;
+    }
+#endif
+    return t->pc != UJ_PC_DONE;
+}
+
+static HANDLE ujThreadPrvSchedule(void) // the runnable thread to run now, 0 if none is
+{
+    HANDLE h = gCurThread, next, best = 0;
+    uint8_t bestPrio = 0;
+    UjThread *t;
+
+    // one lap around the thread ring from gCurThread, which moves on after each
+    // quantum, so threads of the same priority take turns
+    do {
+        t = ujHeapHandleLock(h);
+        if (ujThreadPrvRunnable(t) && (!best || t->priority > bestPrio)) {
+            best = h;
+            bestPrio = t->priority;
+        }
+        next = t->nextThread ? t->nextThread : gFirstThread;
+        ujHeapHandleRelease(h);
+        h = next;
+    } while (h != gCurThread);
+
+    return best;
+}
+
+static uint8_t ujThreadPrvIdle(void) // all threads are parked, sleep till the first timed wait() ends
+{
+#ifdef UJ_FTR_SYNCHRONIZATION
+    HANDLE h, next;
+    UjThread *t;
+    uint32_t now = ujHostTimeMs();
+    int32_t left, soonest = -1;
+    bool parked = false;
+
+    for (h = gFirstThread; h; h = next) {
+        t = ujHeapHandleLock(h);
+        if (t->waitId) {
+            parked = true;
+            left = t->wakeAt ? (int32_t)(t->wakeAt - now) : -1;
+            if (t->wakeAt && left < 0)
+                left = 0;
+            if (left >= 0 && (soonest < 0 || left < soonest))
+                soonest = left;
+        }
+        next = t->nextThread;
+        ujHeapHandleRelease(h);
+    }
+
+    if (parked && soonest < 0) // only a running thread could unpark one
+        return UJ_ERR_DEADLOCK;
+#endif
+#ifdef UJ_OPT_INCREMENTAL_GC
+    if (ujGcStep(UJ_GC_STEP)) // spend the time collecting first
+        return UJ_ERR_NONE;
+#endif
+#ifdef UJ_FTR_SYNCHRONIZATION
+    if (soonest > 0)
+        ujHostSleepMs(soonest);
+#endif
+
+    return UJ_ERR_NONE;
+}
+
 uint8_t ujInstr(void) // return UJ_ERR_*
 {
 
     HANDLE h;
     UjThread *t;
-    uint8_t ret, i;
+    uint8_t ret = UJ_ERR_NONE, i;
     bool died = false;
 
-    t = ujHeapHandleLock(h = gCurThread);
+    h = ujThreadPrvSchedule();
+    if (!h) // all parked
+        return ujThreadPrvIdle();
+    t = ujHeapHandleLock(gCurThread = h);
+
+#ifdef UJ_FTR_SYNCHRONIZATION
+    if (t->relockObj && !ujThreadPrvRelock(h, t)) // back from wait() but the monitor is taken
+        goto quantum_over;
+#endif
 
     for (i = 0; i < UJ_THREAD_QUANTUM; i++) {
         ret = ujThreadPrvInstr(h, t);
@@ -4327,8 +5207,15 @@ uint8_t ujInstr(void) // return UJ_ERR_*
             break;
         if (ret != UJ_ERR_NONE)
             break;
+#ifdef UJ_FTR_SYNCHRONIZATION
+        if (t->waitId) // went into wait()
+            break;
+#endif
     }
 
+#ifdef UJ_FTR_SYNCHRONIZATION
+quantum_over:
+#endif
     gCurThread = t->nextThread;
     ujHeapHandleRelease(h);
     if (!gCurThread)
@@ -4337,6 +5224,10 @@ uint8_t ujInstr(void) // return UJ_ERR_*
     if (died)
         ujThreadDestroy(h);
 
+#ifdef UJ_OPT_INCREMENTAL_GC
+    ujGcStep(UJ_GC_STEP);
+#endif
+
     return ret;
 }
 
@@ -4345,6 +5236,10 @@ uint8_t ujThreadDestroy(HANDLE threadH)
     HANDLE *handleP = &gFirstThread;
     HANDLE handleToUnlock = 0;
     uint8_t ret = UJ_ERR_INTERNAL;
+#ifdef UJ_OPT_STACK_SEGMENTS
+    HANDLE segH;
+    UjThread *t;
+#endif
 
     while (*handleP && *handleP != threadH) {
         if (handleToUnlock)
@@ -4353,6 +5248,15 @@ uint8_t ujThreadDestroy(HANDLE threadH)
     }
 
     if (*handleP) { // found it
+#ifdef UJ_OPT_STACK_SEGMENTS
+        t = ujHeapHandleLock(threadH);
+        while ((segH = t->spill) != 0) { // it died deep in calls
+            t->spill = ((UjStackSeg *)ujHeapHandleLock(segH))->prev;
+            ujHeapHandleRelease(segH);
+            ujHeapHandleFree(segH);
+        }
+        ujHeapHandleRelease(threadH);
+#endif
         *handleP = ((UjThread *)ujHeapHandleLock(threadH))->nextThread;
         ujHeapHandleRelease(threadH);
         ujHeapHandleFree(threadH);
@@ -4364,26 +5268,243 @@ uint8_t ujThreadDestroy(HANDLE threadH)
     return ret;
 }
 
-uint8_t ujInit(UjClass **objectClsP)
+#ifdef UJ_OPT_VM_CONTEXT
+UjVm *ujVmNew(void)
 {
-    gNumInstrs = 0;
-    gFirstThread = 0;
-    gFirstClass = NULL;
-    ujHeapInit();
-    return ujInitBuiltinClasses(objectClsP);
+    UjVm *vm = calloc(1, sizeof(UjVm));
+
+    if (vm && !(vm->heap = ujHeapNew())) {
+        free(vm);
+        vm = NULL;
+    }
+    return vm;
 }
 
-uint8_t ujInitAllClasses(void)
+void ujVmFree(UjVm *vm)
 {
-    HANDLE threadH = 0;
-    UjClass *cls = gFirstClass;
-    uint8_t ret;
+    if (gVm == vm)
+        ujVmSelect(NULL);
+    ujHeapFree(vm->heap);
+    free(vm);
+}
 
-    while (cls) {
-        if (!threadH)
-            threadH = ujThreadCreate(0);
-        if (!threadH)
-            return UJ_ERR_OUT_OF_MEMORY;
+UjVm *ujVmSelect(UjVm *vm)
+{
+    UjVm *prev = gVm;
+
+    gVm = vm ? vm : &gDefaultVm;
+    ujHeapSelect(gVm->heap);
+    return prev == &gDefaultVm ? NULL : prev;
+}
+#endif
+
+uint8_t ujInit(UjClass **objectClsP)
+{
+#ifdef UJ_OPT_INVOKE_CACHE
+    uint16_t i;
+
+    for (i = 0; i < UJ_INVOKE_CACHE_SZ; i++)
+        gInvokeCache[i].site = NULL;
+#endif
+
+    gNumInstrs = 0;
+    gFirstThread = 0;
+    gFirstClass = NULL;
+    gStringCls = NULL;
+#ifdef UJ_OPT_COMPACT_HEADERS
+    gClasses[0] = NULL;
+    gNumClasses = 0;
+#endif
+    if (!ujHeapInit())
+        return UJ_ERR_OUT_OF_MEMORY;
+    return ujInitBuiltinClasses(objectClsP);
+}
+
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+static UInt24 ujPrvFindClinit(UjClass *cls, uint16_t *flagsP)
+{
+    UjPrvStrEqualParam name, type;
+
+    name.type = STR_EQ_PAR_TYPE_PTR;
+    name.data.ptr.len = ujCstrlen(name.data.ptr.str = "<clinit>");
+
+    type.type = STR_EQ_PAR_TYPE_PTR;
+    type.data.ptr.len = ujCstrlen(type.data.ptr.str = "()V");
+
+    return ujThreadPrvGetMethodAddr(&cls, &name, &type, JAVA_ACC_STATIC,
+                                    JAVA_ACC_STATIC | FLAG_DONT_SEARCH_SUBCLASSES, flagsP);
+}
+
+static UInt24 ujPrvReadImageValue(void *readD, UInt24 addr, uint8_t *ptr, uint8_t sz)
+{
+    switch (sz) {
+    case 1:
+
+        *ptr = ujReadClassByte(readD, addr);
+        break;
+
+    case 2:
+
+        ujThreadPrvPut16(ptr, ujThreadReadBE16_ex(readD, addr));
+        break;
+
+    case 8:
+
+        ujThreadPrvPut32(ptr + 4, ujThreadReadBE32_ex(readD, addr + 4));
+        /* fall-thru */
+    case 4:
+
+        ujThreadPrvPut32(ptr, ujThreadReadBE32_ex(readD, addr));
+        break;
+    }
+
+    return addr + sz;
+}
+
+static uint8_t ujPrvNewRomArray(UjClass *cls, char type, UInt24 addr, UInt24 len, HANDLE *arrP)
+{
+    HANDLE handle;
+    UjArray *arr;
+
+    handle = ujHeapHandleNewEx(sizeof(UjArray) + sizeof(uintptr_t) + sizeof(uint32_t), UJ_HEAP_LEAF);
+    if (!handle)
+        return UJ_ERR_OUT_OF_MEMORY;
+
+    arr = ujHeapHandleLock(handle);
+    OBJ_SET_CLS(arr, NULL);
+    arr->objType = OBJ_TYPE_ROM_ARRAY;
+    arr->elemType = type;
+    arr->length = len;
+    ujThreadPrvPutPtr(arr->data, (uintptr_t)cls);
+    ujThreadPrvPut32(arr->data + sizeof(uintptr_t), addr);
+    ujHeapHandleRelease(handle);
+
+    *arrP = handle;
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujPrvApplyStaticImage(UjClass *cls, UInt24 addr) // addr points to <clinit> code, see UJC.h
+{
+    void *readD = cls->info.java.readD;
+    UInt24 end, len;
+    uint8_t *ptr;
+    uint8_t type, sz, ret;
+    HANDLE h;
+
+    addr -= 6;
+    addr -= (UInt24)(uint16_t)ujThreadReadBE16_ex(readD, addr) * 8; // skip exception table
+    addr -= 2;
+    end = addr;
+    addr -= (uint16_t)ujThreadReadBE16_ex(readD, addr);
+
+    while (addr < end) {
+        ptr = cls->data + cls->clsDataOfst + (uint16_t)ujThreadReadBE16_ex(readD, addr);
+        type = ujReadClassByte(readD, addr + 2);
+        addr += 3;
+
+        switch (type) {
+        case JAVA_TYPE_OBJ: // always a string
+
+            ret = ujPrvNewClassString(cls, addr, &h);
+            if (ret != UJ_ERR_NONE)
+                return ret;
+            ujThreadPrvPut32(ptr, h);
+            addr += 2 + (uint16_t)ujThreadReadBE16_ex(readD, addr);
+            break;
+
+        case JAVA_TYPE_ARRAY: // always of primitives
+
+            type = ujReadClassByte(readD, addr);
+            len = ujThreadReadBE24_ex(readD, addr + 1);
+            addr += 4;
+
+            ret = ujThreadPrvNewArray(type, len, &h);
+            if (ret != UJ_ERR_NONE)
+                return ret;
+            ujThreadPrvPut32(ptr, h);
+
+            sz = ujPrvJavaTypeToSize(type);
+            ptr = ((UjArray *)ujHeapHandleLock(h))->data;
+            while (len--) {
+                addr = ujPrvReadImageValue(readD, addr, ptr, sz);
+                ptr += sz;
+            }
+            ujHeapHandleRelease(h);
+            break;
+
+        case UJC_IMAGE_TYPE_ROM_ARRAY: // elements stay where they are
+
+            type = ujReadClassByte(readD, addr);
+            len = ujThreadReadBE24_ex(readD, addr + 1);
+            addr += 4;
+
+            ret = ujPrvNewRomArray(cls, type, addr, len, &h);
+            if (ret != UJ_ERR_NONE)
+                return ret;
+            ujThreadPrvPut32(ptr, h);
+            addr += len * ujPrvJavaTypeToSize(type);
+            break;
+
+        default:
+
+            addr = ujPrvReadImageValue(readD, addr, ptr, ujPrvJavaTypeToSize(type));
+            break;
+        }
+    }
+
+    return UJ_ERR_NONE;
+}
+#endif
+
+uint8_t ujInitAllClasses(void)
+{
+    HANDLE threadH = 0;
+    UjClass *cls;
+    uint16_t stackSz;
+    uint8_t ret;
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+    uint16_t flags;
+    UInt24 addr;
+
+    // static images go in first so that <clinit>s we still run see them
+    for (cls = gFirstClass; cls; cls = cls->nextClass) {
+        if (!cls->ujc)
+            continue;
+        addr = ujPrvFindClinit(cls, &flags);
+        if (addr == UJ_PC_BAD || !(flags & UJC_METHOD_FLAG_STATIC_IMAGE))
+            continue;
+        ret = ujPrvApplyStaticImage(cls, addr);
+        if (ret != UJ_ERR_NONE)
+            return ret;
+    }
+#endif
+
+    cls = gFirstClass;
+    while (cls) {
+        stackSz = 0;
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+        if (cls->ujc) {
+            addr = ujPrvFindClinit(cls, &flags);
+            if (addr != UJ_PC_BAD && (flags & UJC_METHOD_FLAG_STATIC_IMAGE) &&
+                ujReadClassByte(cls->info.java.readD, addr) == 0xB1) { // nothing but "return" left
+
+                cls = cls->nextClass;
+                continue;
+            }
+
+            // classCvt knows what this <clinit> needs: do not reuse a default-sized thread for it
+            stackSz = ujThreadPrvStackSize(cls, addr, flags);
+            if (stackSz && threadH) {
+                ujThreadDestroy(threadH);
+                threadH = 0;
+            }
+        }
+#endif
+        if (!threadH)
+            threadH = ujThreadCreate(stackSz);
+        if (!threadH)
+            return UJ_ERR_OUT_OF_MEMORY;
         ret = ujThreadGoto(threadH, cls, "<clinit>", "()V");
 
         if (ret == UJ_ERR_METHOD_NONEXISTENT) {
@@ -4392,7 +5513,8 @@ uint8_t ujInitAllClasses(void)
             return ret;
         } else {
             while (ujCanRun())
-                ujInstr();
+                if (ujInstr() == UJ_ERR_DEADLOCK)
+                    return UJ_ERR_DEADLOCK;
             threadH = 0;
         }
 
@@ -4424,14 +5546,40 @@ uint8_t ujInitAllClasses(void)
         objects at either mark level 2 or zero. All objects marked at zero are
    available to be deleted, since we have seen no references to them. Why is
    this slow? The step where we find the "first object marked with a 1" is O(n),
-   and we do that O(n^2) times at best. :)
+   and we do that O(n^2) times at best. :) These days the heap remembers the
+   last few objects it marked as 1 in a small fixed-size stack, so we only pay
+   for that scan when more objects got marked than the stack could hold.
+   With UJ_OPT_INCREMENTAL_GC step 3 can also run a few objects at a time in
+   between thread quanta, see ujGcStep().
 */
 
 static void
 ujGcPrvMarkClass(UjClass *cls, UjInstance *inst) // if inst is NULL, mark static for class.
 {                                                // if inst is false, mark instance
+    if (!cls->native) { // java class, its reference map covers java superclasses too
+        uint16_t *map = CLASS_REF_MAP(cls), n;
+        uint8_t *ptr;
+
+        if (inst) {
+            n = cls->numInstRefs;
+            ptr = inst->data;
+        } else {
+            map += cls->numInstRefs;
+            n = cls->numClsRefs;
+            ptr = cls->data;
+        }
+
+        while (n--) {
+            HANDLE var = (HANDLE)ujThreadPrvGet32(ptr + *map++);
+
+            if (var)
+                ujHeapMark(var, 1);
+        }
+    }
+
+    // native classes mark their own data, any superclass of an instance may be one
     while (cls) {
-        if (cls->native) { // native class
+        if (cls->native) {
             if (inst) {
                 if (cls->info.native->gcInstF)
                     cls->info.native->gcInstF(cls, inst);
@@ -4439,58 +5587,6 @@ ujGcPrvMarkClass(UjClass *cls, UjInstance *inst) // if inst is NULL, mark static
                 if (cls->info.native->gcClsF)
                     cls->info.native->gcClsF(cls);
             }
-        } else { // java class
-            UInt24 addr = cls->info.java.fields;
-            uint16_t numFields, wantedFlag = inst ? 0 : JAVA_ACC_STATIC;
-            uint8_t *ptr;
-            char type = 0;
-
-            ptr = inst ? (inst->data + cls->instDataOfst)
-                       : (cls->data + cls->clsDataOfst);
-
-            numFields = ujThreadReadBE16_ex(cls->info.java.readD, addr - 2);
-
-            while (numFields--) {
-                if ((ujThreadReadBE16_ex(cls->info.java.readD, addr) & JAVA_ACC_STATIC) == wantedFlag) {
-                    if (cls->ujc) {
-#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
-                        type = ujReadClassByte(
-                            cls->info.java.readD,
-                            ujThreadReadBE24_ex(cls->info.java.readD, addr + 7) + 3);
-#endif
-                    } else {
-#ifdef UJ_FTR_SUPPORT_CLASS_FORMAT
-                        type = ujReadClassByte(
-                            cls->info.java.readD,
-                            ujThreadPrvFindConst_ex(
-                                cls,
-                                ujThreadReadBE16_ex(cls->info.java.readD, addr + 4)) + 3);
-#endif
-                    }
-
-                    if (type == JAVA_TYPE_ARRAY || type == JAVA_TYPE_OBJ) {
-                        HANDLE var = (HANDLE)ujThreadPrvGet32(ptr);
-
-                        if (var)
-                            ujHeapMark(var, 1);
-                    }
-
-                    ptr += ujPrvJavaTypeToSize(type);
-                }
-
-                if (cls->ujc) {
-#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
-                    addr += 10;
-#endif
-                } else {
-#ifdef UJ_FTR_SUPPORT_CLASS_FORMAT
-                    uint16_t n = ujThreadReadBE16_ex(cls->info.java.readD, addr + 6);
-                    addr += 8;
-                    while (n--)
-                        addr = ujPrvSkipAttribute(cls->info.java.readD, addr);
-#endif
-                }
-            }
         }
 
         // note: we do not need to go to superlcass in static case since we'll
@@ -4513,25 +5609,31 @@ static void *ujGcPrvLock(HANDLE handle, bool *needsReleaseP)
     return ujHeapHandleLock(handle);
 }
 
-uint8_t ujGC(void)
+static void ujGcPrvMarkRoots(void)
 {
     UjThread *th;
     UjClass *cls;
     HANDLE handle, h2;
     uint16_t t16;
-    uint8_t t8;
     bool needsRelease;
-    UjInstance *inst;
+#ifdef UJ_OPT_STACK_SEGMENTS
+    UjStackSeg *seg;
+    bool segNeedsRelease;
+    uint8_t *bits;
+    HANDLE h3;
+#endif
 
     // step 1 for class vars
 
-    TL("Begin GC\n");
-
     cls = gFirstClass;
 
     while (cls) {
         TL(" gc marking class %08" PRIXPTR "\n", (uintptr_t)cls);
         ujGcPrvMarkClass(cls, NULL);
+#ifdef UJ_OPT_INTERN_STRINGS
+        if (!cls->native && cls->strings)
+            ujHeapMark(cls->strings, 1);
+#endif
         cls = cls->nextClass;
     }
 
@@ -4547,6 +5649,10 @@ uint8_t ujGC(void)
         th = ujGcPrvLock(handle, &needsRelease);
         if (th->flags.access.hasInst)
             ujHeapMark(th->instH, 1);
+#ifdef UJ_FTR_SYNCHRONIZATION
+        if (th->relockObj) // may be referenced from nowhere else while in wait()
+            ujHeapMark(th->relockObj, 1);
+#endif
 
         TL(" gc marking thread stack\n");
 
@@ -4556,53 +5662,128 @@ uint8_t ujGC(void)
                     ujHeapMark((HANDLE)th->stack[t16], 1);
             }
         }
+#ifdef UJ_OPT_STACK_SEGMENTS
+        h2 = th->spill;
+        while (h2) { // same for the frames moved out
+            seg = ujGcPrvLock(h2, &segNeedsRelease);
+            bits = (uint8_t *)(seg->stack + seg->numSlots);
+
+            ujHeapMark(h2, 2);
+            for (t16 = 0; t16 < seg->numSlots; t16++) {
+                if ((bits[t16 >> 3] & gShifts[t16 & 7]) && (HANDLE)seg->stack[t16])
+                    ujHeapMark((HANDLE)seg->stack[t16], 1);
+            }
+            h3 = seg->prev;
+            if (segNeedsRelease)
+                ujHeapHandleRelease(h2);
+            h2 = h3;
+        }
+#endif
         h2 = th->nextThread;
         if (needsRelease)
             ujHeapHandleRelease(handle);
         handle = h2;
     }
+}
 
-    // step 2
+static void ujGcPrvWalk(HANDLE handle) // step 3 for one object marked 1
+{
+    bool needsRelease;
+    UjInstance *inst;
+    uint8_t t8;
 
-    while ((handle = ujHeapFirstMarked(1)) != 0) {
-        ujHeapMark(handle, 2);
-        inst = ujGcPrvLock(handle, &needsRelease);
+    inst = ujGcPrvLock(handle, &needsRelease);
 
-        if (inst->cls) { // object - handle it
+    if (OBJ_CLS(inst)) { // object - handle it
 
-            TL(" gc marking instance %u (0x%08" PRIXPTR ") of class 0x%08" PRIXPTR "\n", handle,
-               (uintptr_t)inst, (uintptr_t)inst->cls);
-            ujGcPrvMarkClass(inst->cls, inst);
-            if (needsRelease)
-                ujHeapHandleRelease(handle);
-        } else { // something that isn't an object - handle that
+        TL(" gc marking instance %u (0x%08" PRIXPTR ") of class 0x%08" PRIXPTR "\n", handle,
+           (uintptr_t)inst, (uintptr_t)OBJ_CLS(inst));
+        ujGcPrvMarkClass(OBJ_CLS(inst), inst);
+#if defined(UJ_OPT_COMPACT_HEADERS) && defined(UJ_FTR_SYNCHRONIZATION)
+        if (inst->clsIdx & INST_INFLATED)
+            ujHeapMark(inst->lock, 2);
+#endif
+        if (needsRelease)
+            ujHeapHandleRelease(handle);
+    } else { // something that isn't an object - handle that
 
-            uint32_t t;
-            HANDLE h;
+        uint32_t t;
+        HANDLE h;
 
-            t8 = ((UjArray *)inst)->objType;
-            if (needsRelease)
-                ujHeapHandleRelease(handle);
+        t8 = ((UjArray *)inst)->objType;
+        if (needsRelease)
+            ujHeapHandleRelease(handle);
 
-            switch (t8) {
-            case OBJ_TYPE_OBJ_ARRAY:
+        switch (t8) {
+        case OBJ_TYPE_OBJ_ARRAY:
 
-                t = ujThreadPrvArrayGetLength(handle);
-                while (t) {
-                    h = ujThreadPrvArrayGetRef(handle, --t);
-                    if (h)
-                        ujHeapMark(h, 1);
-                }
-                break;
+            t = ujThreadPrvArrayGetLength(handle);
+            while (t) {
+                h = ujThreadPrvArrayGetRef(handle, --t);
+                if (h)
+                    ujHeapMark(h, 1);
             }
+            break;
         }
     }
 
+    // only now, so our own locking above does not look like a mutator write to the incremental GC.
+    // 3 tells walked objects apart from raw chunks marked 2
+    ujHeapMark(handle, 3);
+}
+
+uint8_t ujGC(void)
+{
+    HANDLE handle;
+
+    TL("Begin GC\n");
+
+    ujGcPrvMarkRoots();
+
+    // step 2
+
+    while ((handle = ujHeapPopMarked()) != 0)
+        ujGcPrvWalk(handle);
+
     TL(" GC done\n");
 
     return UJ_ERR_NONE;
 }
 
+#ifdef UJ_OPT_INCREMENTAL_GC
+bool ujGcStep(uint16_t budget)
+{
+    HANDLE handle;
+
+    if (!ujHeapIncMarking()) {
+        if (!ujHeapIncDue())
+            return false;
+        TL("Begin incremental GC\n");
+        ujHeapIncBegin();
+        ujGcPrvMarkRoots();
+        return true;
+    }
+
+    while (budget--) {
+        handle = ujHeapPopMarked();
+        if (!handle) {
+            // no gray objects left. stacks, statics and chunks that stayed locked had no write
+            // barrier, so go over them once more and finish in one go
+            ujGcPrvMarkRoots();
+            ujHeapIncRegrayLocked();
+            while ((handle = ujHeapPopMarked()) != 0)
+                ujGcPrvWalk(handle);
+            ujHeapIncEnd();
+            TL(" incremental GC done\n");
+            return false;
+        }
+        ujGcPrvWalk(handle);
+    }
+
+    return true;
+}
+#endif
+
 ////builtin classes
 
 /*
@@ -4627,6 +5808,103 @@ static uint8_t ujNat_Object_Object(UjThread *t, _UNUSED_ UjClass *cls)
     return UJ_ERR_NONE;
 }
 
+#ifdef UJ_FTR_SYNCHRONIZATION
+static uint8_t ujNat_Object_prvWait(UjThread *t, uint32_t ms) // ms = 0 waits for a notify only
+{
+    HANDLE objH = ujThreadPrvPopRef(t);
+    UjMonitor *mon = ujThreadPrvInstMon((UjInstance *)ujHeapHandleLock(objH));
+    uint8_t ret = UJ_ERR_MON_STATE_ERR;
+
+    if (!mon)
+        ret = UJ_ERR_OUT_OF_MEMORY;
+    else if (mon->numHolds && mon->holder == gCurThread) {
+        // give up all holds at once, ujInstr() takes them back once we are notified
+        t->relockObj = objH;
+        t->relockHolds = mon->numHolds;
+        mon->numHolds = 1;
+        ujThreadPrvMonExit(gCurThread, mon);
+
+        if (!mon->notifyId)
+            mon->notifyId = ujThreadPrvNewWaitId();
+        t->waitId = mon->notifyId;
+        t->wakeAt = 0;
+        if (ms && !(t->wakeAt = ujHostTimeMs() + ms))
+            t->wakeAt = 1;
+        ret = UJ_ERR_NONE;
+    }
+    ujHeapHandleRelease(objH);
+
+    return ret;
+}
+
+static uint8_t ujNat_Object_wait(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    return ujNat_Object_prvWait(t, 0);
+}
+
+static uint8_t ujNat_Object_waitTimed(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    uint32_t lo = ujThreadPrvPop(t), hi = ujThreadPrvPop(t);
+
+    if (hi >> 31) // negative, time is already up
+        lo = 1;
+    else if (hi || lo > 0x7FFFFFFFUL) // clock comparisons only see half the range
+        lo = 0x7FFFFFFFUL;
+    return ujNat_Object_prvWait(t, lo);
+}
+
+static uint8_t ujNat_Object_prvNotify(UjThread *t, bool all)
+{
+    HANDLE objH = ujThreadPrvPopRef(t);
+    UjInstance *inst = ujHeapHandleLock(objH);
+    uint8_t ret = UJ_ERR_MON_STATE_ERR;
+    UjMonitor *mon;
+
+#ifdef UJ_OPT_COMPACT_HEADERS
+    if (!(inst->clsIdx & INST_INFLATED)) { // nobody waits on a thin lock, no need for a record
+        if (inst->lock == gCurThread)
+            ret = UJ_ERR_NONE;
+        ujHeapHandleRelease(objH);
+        return ret;
+    }
+#endif
+
+    mon = ujThreadPrvInstMon(inst);
+    if (!mon)
+        ret = UJ_ERR_OUT_OF_MEMORY;
+    else if (mon->numHolds && mon->holder == gCurThread) {
+        if (mon->notifyId && (!ujThreadPrvWake(mon->notifyId, all) || all)) // nobody is left waiting
+            mon->notifyId = 0;
+        ret = UJ_ERR_NONE;
+    }
+    ujHeapHandleRelease(objH);
+
+    return ret;
+}
+
+static uint8_t ujNat_Object_notify(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    return ujNat_Object_prvNotify(t, false);
+}
+
+static uint8_t ujNat_Object_notifyAll(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    return ujNat_Object_prvNotify(t, true);
+}
+#endif
+
+// instance data: {u32 handle of RAM copy} or {UjClass *cls, u32 addr in class}, then cached info
+#ifdef UJ_OPT_RAM_STRINGS
+#define MINISTRING_INFO_OFST 4
+#else
+#define MINISTRING_INFO_OFST (sizeof(uintptr_t) + 4)
+#endif
+#ifdef UJ_FTR_STRING_FEATURES
+#define MINISTRING_INFO_SZ 4
+#else
+#define MINISTRING_INFO_SZ 0
+#endif
+
 typedef uint8_t (*ujNat_MiniString_ConstF)(UjThread *t, UjClass *cls, UInt24 addr, uint32_t extra);
 typedef uint8_t (*ujNat_MiniString_RamF)(UjThread *t, uint8_t *dataP, uint32_t extra);
 
@@ -4817,19 +6095,24 @@ static uint8_t ujNat_MiniString_prv_ram_charAt(UjThread *t, uint8_t *dataP, uint
     return UJ_ERR_NONE;
 }
 
-static uint8_t ujNat_MiniString_charAt(UjThread *t, UjClass *cls)
-{
-    return ujNat_MiniString_genericF(t, cls, ujNat_MiniString_prv_class_charAt,
-                                     ujNat_MiniString_prv_ram_charAt,
-                                     ujThreadPrvPopInt(t));
-}
+/*
+        length() and charAt() are mostly called in loops over short ASCII
+   strings. Walking the modified UTF-8 every time makes such loops O(n^2), so
+   the first call works out the number of chars, and whether every char is a
+   single byte, and keeps that in the instance. For such strings charAt()
+   indexes the bytes directly.
+*/
+
+#define MINISTRING_INFO_KNOWN 0x80000000UL
+#define MINISTRING_INFO_ASCII 0x40000000UL
+#define MINISTRING_INFO_LEN   0x0000FFFFUL
 
 #ifndef UJ_OPT_RAM_STRINGS
-static uint8_t ujNat_MiniString_prv_class_length(UjThread *t, UjClass *strCls, UInt24 addr, _UNUSED_ uint32_t extra)
+static uint32_t ujNat_MiniString_prv_class_info(UjClass *strCls, UInt24 addr)
 {
     uint16_t L = ujThreadReadBE16_ex(strCls->info.java.readD, addr);
+    uint32_t ret = MINISTRING_INFO_KNOWN | MINISTRING_INFO_ASCII;
     uint8_t b, len;
-    uint32_t ret = 0;
 
     addr += 2;
 
@@ -4842,22 +6125,22 @@ static uint8_t ujNat_MiniString_prv_class_length(UjThread *t, UjClass *strCls, U
         else
             len = 1;
 
+        if (len != 1 || (b & 0x80))
+            ret &= ~MINISTRING_INFO_ASCII;
         ret++;
         L -= len;
         addr += len;
     }
 
-    ujThreadPrvPushInt(t, ret);
-
-    return UJ_ERR_NONE;
+    return ret;
 }
 #endif
 
-static uint8_t ujNat_MiniString_prv_ram_length(UjThread *t, uint8_t *dataP, _UNUSED_ uint32_t extra)
+static uint32_t ujNat_MiniString_prv_ram_info(uint8_t *dataP)
 {
     uint16_t L = ujThreadPrvGet16(dataP);
+    uint32_t ret = MINISTRING_INFO_KNOWN | MINISTRING_INFO_ASCII;
     uint8_t b, len;
-    uint32_t ret = 0;
 
     dataP += 2;
 
@@ -4870,20 +6153,68 @@ static uint8_t ujNat_MiniString_prv_ram_length(UjThread *t, uint8_t *dataP, _UNU
         else
             len = 1;
 
+        if (len != 1 || (b & 0x80))
+            ret &= ~MINISTRING_INFO_ASCII;
         ret++;
         L -= len;
         dataP += len;
     }
 
-    ujThreadPrvPushInt(t, ret);
+    return ret;
+}
+
+static uint32_t ujNat_MiniString_prv_info(UjClass *cls, HANDLE handle)
+{
+    UjInstance *inst = ujHeapHandleLock(handle);
+    uint8_t *infoP = inst->data + cls->instDataOfst + MINISTRING_INFO_OFST;
+    uint32_t ret = ujThreadPrvGet32(infoP);
+    HANDLE strData;
 
-    return UJ_ERR_NONE;
+    if (!(ret & MINISTRING_INFO_KNOWN)) {
+#ifndef UJ_OPT_RAM_STRINGS
+        UjClass *strCls = (UjClass *)ujThreadPrvGetPtr(inst->data + cls->instDataOfst + 0);
+
+        if (strCls) {
+            ret = ujNat_MiniString_prv_class_info(
+                strCls, ujThreadPrvGet32(inst->data + cls->instDataOfst + sizeof(uintptr_t)));
+        } else
+#endif
+        {
+            strData = (HANDLE)ujThreadPrvGet32(inst->data + cls->instDataOfst + MINISTRING_INFO_OFST - 4);
+            ret = ujNat_MiniString_prv_ram_info(ujHeapHandleLock(strData));
+            ujHeapHandleRelease(strData);
+        }
+        ujThreadPrvPut32(infoP, ret);
+    }
+
+    ujHeapHandleRelease(handle);
+
+    return ret;
+}
+
+static uint8_t ujNat_MiniString_charAt(UjThread *t, UjClass *cls)
+{
+    uint32_t idx = ujThreadPrvPopInt(t);
+    uint32_t info = ujNat_MiniString_prv_info(cls, (HANDLE)ujThreadPrvPeek(t, 0));
+
+    if (!(info & MINISTRING_INFO_ASCII))
+        return ujNat_MiniString_genericF(t, cls, ujNat_MiniString_prv_class_charAt,
+                                         ujNat_MiniString_prv_ram_charAt, idx);
+
+    if (idx >= (info & MINISTRING_INFO_LEN)) {
+        ujThreadPrvPop(t);
+        return UJ_ERR_ARRAY_INDEX_OOB;
+    }
+
+    return ujNat_MiniString_genericF(t, cls, ujNat_MiniString_prv_class_XbyteAt_,
+                                     ujNat_MiniString_prv_ram_XbyteAt_, idx + 2);
 }
 
 static uint8_t ujNat_MiniString_length(UjThread *t, UjClass *cls)
 {
-    return ujNat_MiniString_genericF(t, cls, ujNat_MiniString_prv_class_length,
-                                     ujNat_MiniString_prv_ram_length, 0);
+    ujThreadPrvPushInt(t, ujNat_MiniString_prv_info(cls, ujThreadPrvPopRef(t)) & MINISTRING_INFO_LEN);
+
+    return UJ_ERR_NONE;
 }
 #endif
 
@@ -4897,7 +6228,7 @@ static uint8_t ujNat_MiniString_init(UjThread *t, UjClass *cls)
     UjInstance *obj;
     HANDLE handle;
 
-    handle = ujHeapHandleNew(len + 2);
+    handle = ujHeapHandleNewEx(len + 2, UJ_HEAP_LEAF);
     if (!handle)
         return UJ_ERR_OUT_OF_MEMORY;
 
@@ -4925,164 +6256,2109 @@ static uint8_t ujNat_MiniString_init(UjThread *t, UjClass *cls)
     return UJ_ERR_NONE;
 }
 
-static uint8_t ujNat_RT_consolePut(UjThread *t, _UNUSED_ UjClass *myCls)
+// instance data: {u32 handle of buffer, u16 capacity, u8 shared}, the buffer is laid out like RAM string data: {u16 len, bytes}
+#define MINISTRINGBUILDER_BUF_OFST 0
+#define MINISTRINGBUILDER_CAP_OFST 4
+#define MINISTRINGBUILDER_SHARED_OFST 6
+#define MINISTRINGBUILDER_INST_SZ 8
+#define MINISTRINGBUILDER_MIN_CAP 16
+#define MINISTRINGBUILDER_MAX_CAP 0xFFFF
+
+static HANDLE ujNat_MiniStringBuilder_prv_buf(UjClass *cls, HANDLE sbHandle)
 {
-    char c = ujThreadPop(t);
-    printf("%c", c);
+    HANDLE buf;
 
-    return UJ_ERR_NONE;
+    buf = ujThreadPrvGet32(((UjInstance *)ujHeapHandleLock(sbHandle))->data + cls->instDataOfst + MINISTRINGBUILDER_BUF_OFST);
+    ujHeapHandleRelease(sbHandle);
+
+    return buf;
 }
 
-static uint8_t ujNat_RT_threadCreate(UjThread *oldT, _UNUSED_ UjClass *myCls)
+// make room for "more" bytes past the end. a buffer handed over by toString() belongs to the string now, so it gets copied first
+static uint8_t ujNat_MiniStringBuilder_prv_reserve(UjClass *cls, HANDLE sbHandle, uint32_t more, HANDLE *bufP)
 {
-    HANDLE handle;
-    UjInstance *inst;
-    UInt24 addr;
-    UjClass *cls;
-    HANDLE threadH;
-    uint8_t ret;
-    UjThread *t;
-    UjPrvStrEqualParam name, type;
+    UjInstance *inst = ujHeapHandleLock(sbHandle);
+    uint8_t *data = inst->data + cls->instDataOfst;
+    HANDLE buf = ujThreadPrvGet32(data + MINISTRINGBUILDER_BUF_OFST);
+    uint32_t cap = ujThreadPrvGet16(data + MINISTRINGBUILDER_CAP_OFST);
+    uint8_t shared = data[MINISTRINGBUILDER_SHARED_OFST];
+    uint32_t len = 0, newCap;
+    uint8_t *dst;
+    HANDLE newBuf;
 
-    handle = ujThreadPrvPopRef(oldT);
-    if (!handle)
-        return UJ_ERR_NULL_POINTER;
-    inst = ujHeapHandleLock(handle);
+    ujHeapHandleRelease(sbHandle);
 
-    threadH = ujThreadCreate(0);
-    if (!threadH) {
-        ujHeapHandleRelease(handle);
-        return UJ_ERR_OUT_OF_MEMORY;
+    if (buf) {
+        len = ujThreadPrvGet16(ujHeapHandleLock(buf));
+        ujHeapHandleRelease(buf);
     }
 
-    name.type = STR_EQ_PAR_TYPE_PTR;
-    name.data.ptr.len = ujCstrlen(name.data.ptr.str = "run");
+    if (len + more > MINISTRINGBUILDER_MAX_CAP)
+        return UJ_ERR_OUT_OF_MEMORY;
 
-    type.type = STR_EQ_PAR_TYPE_PTR;
-    type.data.ptr.len = ujCstrlen(type.data.ptr.str = "()V");
+    if (buf && !shared && len + more <= cap) {
+        *bufP = buf;
+        return UJ_ERR_NONE;
+    }
 
-    cls = inst->cls;
+    // grow geometrically so that n appends copy O(n) bytes in total, the copy of a shared buffer may shrink
+    if (len + more > cap)
+        newCap = cap * 2;
+    else if (cap > (len + more) * 2)
+        newCap = (len + more) * 2;
+    else
+        newCap = cap;
+    if (newCap < len + more)
+        newCap = len + more;
+    if (newCap < MINISTRINGBUILDER_MIN_CAP)
+        newCap = MINISTRINGBUILDER_MIN_CAP;
+    if (newCap > MINISTRINGBUILDER_MAX_CAP)
+        newCap = MINISTRINGBUILDER_MAX_CAP;
+
+    newBuf = ujHeapHandleNewEx(newCap + 2, UJ_HEAP_LEAF);
+    if (!newBuf)
+        return UJ_ERR_OUT_OF_MEMORY;
 
-    addr = ujThreadPrvGetMethodAddr(&cls, &name, &type, 0, 0, NULL);
-    if (addr == UJ_PC_BAD) {
-        ujHeapHandleRelease(handle);
-        return UJ_ERR_METHOD_NONEXISTENT;
+    dst = ujHeapHandleLock(newBuf);
+    ujThreadPrvPut16(dst, len);
+    if (buf) {
+        memcpy(dst + 2, (uint8_t *)ujHeapHandleLock(buf) + 2, len);
+        ujHeapHandleRelease(buf);
+
+        if (!shared)
+            ujHeapHandleFree(buf);
     }
+    ujHeapHandleRelease(newBuf);
 
-    t = ujHeapHandleLock(threadH);
-    ujThreadPrvLocalStoreRef(t, 0, handle);
+    inst = ujHeapHandleLock(sbHandle);
+    data = inst->data + cls->instDataOfst;
+    ujThreadPrvPut32(data + MINISTRINGBUILDER_BUF_OFST, newBuf);
+    ujThreadPrvPut16(data + MINISTRINGBUILDER_CAP_OFST, newCap);
+    data[MINISTRINGBUILDER_SHARED_OFST] = 0;
+    ujHeapHandleRelease(sbHandle);
 
-    ujHeapHandleRelease(handle);
+    *bufP = newBuf;
+    return UJ_ERR_NONE;
+}
 
-    ret = ujThreadPrvGoto(t, cls, handle, addr);
-    ujHeapHandleRelease(threadH);
+// "this" is on top of the stack and stays there as the return value
+static uint8_t ujNat_MiniStringBuilder_prv_append(UjThread *t, UjClass *cls, const uint8_t *src, uint16_t n)
+{
+    HANDLE buf;
+    uint8_t *dst;
+    uint16_t len;
+    uint8_t ret;
 
-    return ret;
+    ret = ujNat_MiniStringBuilder_prv_reserve(cls, (HANDLE)ujThreadPrvPeek(t, 0), n, &buf);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    dst = ujHeapHandleLock(buf);
+    len = ujThreadPrvGet16(dst);
+    ujThreadPrvPut16(dst, len + n);
+    memcpy(dst + 2 + len, src, n);
+    ujHeapHandleRelease(buf);
+
+    return UJ_ERR_NONE;
 }
 
-static void ujNat_MiniString_instGc(UjClass *cls, UjInstance *inst)
+static uint8_t ujNat_MiniStringBuilder_init(UjThread *t, _UNUSED_ UjClass *cls)
 {
-    UjClass *strCls;
-    HANDLE h;
-    uint8_t ofst;
+    ujThreadPrvPop(t); // the buffer is allocated on first use
 
-#ifdef UJ_OPT_RAM_STRINGS
-    strCls = NULL;
-    ofst = 0;
-#else
-    strCls = (UjClass *)ujThreadPrvGetPtr(inst->data + cls->instDataOfst + 0);
-    ofst = sizeof(uintptr_t);
-#endif
+    return UJ_ERR_NONE;
+}
 
-    if (!strCls) {
-        h = (HANDLE)ujThreadPrvGet32(inst->data + cls->instDataOfst + ofst);
+static uint8_t ujNat_MiniStringBuilder_initCap(UjThread *t, UjClass *cls)
+{
+    int32_t cap = ujThreadPrvPopInt(t);
+    HANDLE buf;
+    uint8_t ret;
 
-        // if we get here from an alloc inside a call to <init> on this very
-        // instance, handle will be zero - we should be prepared for that
-        if (h)
-            ujHeapMark(h, 2);
+    if (cap > MINISTRINGBUILDER_MAX_CAP) // only a hint, the content may still grow that far
+        cap = MINISTRINGBUILDER_MAX_CAP;
+
+    if (cap < 0)
+        ret = UJ_ERR_NEG_ARR_SZ;
+    else
+        ret = ujNat_MiniStringBuilder_prv_reserve(cls, (HANDLE)ujThreadPrvPeek(t, 0), cap, &buf);
+
+    ujThreadPrvPop(t);
+
+    return ret;
+}
+
+static uint8_t ujNat_MiniStringBuilder_appendString(UjThread *t, UjClass *cls)
+{
+    HANDLE strHandle = (HANDLE)ujThreadPrvPeek(t, 0);
+    HANDLE buf;
+    uint16_t n, len;
+    uint8_t *dst;
+    uint8_t ret;
+
+    if (!strHandle) {
+        ujThreadPrvPop(t);
+        return ujNat_MiniStringBuilder_prv_append(t, cls, (const uint8_t *)"null", 4);
     }
+
+    n = ujStringGetBytes(strHandle, NULL, 0) - 1;
+
+    // room for the terminator ujStringGetBytes() writes too
+    ret = ujNat_MiniStringBuilder_prv_reserve(cls, (HANDLE)ujThreadPrvPeek(t, 1), n + 1, &buf);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    dst = ujHeapHandleLock(buf);
+    len = ujThreadPrvGet16(dst);
+    ujStringGetBytes(strHandle, dst + 2 + len, n + 1);
+    ujThreadPrvPut16(dst, len + n);
+    ujHeapHandleRelease(buf);
+
+    ujThreadPrvPop(t);
+
+    return UJ_ERR_NONE;
 }
 
-static const UjNativeMethod ujNatCls_Object_methods[] = {
-    { "hashCode", "()I", ujNat_Object_hashCode, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
-    { "<init>", "()V", ujNat_Object_Object, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
-};
+static uint8_t ujNat_MiniStringBuilder_appendBytes(UjThread *t, UjClass *cls)
+{
+    HANDLE arrHandle = (HANDLE)ujThreadPrvPeek(t, 0);
+    HANDLE buf;
+    int32_t i, n;
+    uint16_t len;
+    uint8_t *dst;
+    UjArray *arr;
+    uint8_t ret;
 
-static const UjNativeClass ujNatCls_Object = {
-    "java/lang/Object",
+    if (!arrHandle)
+        return UJ_ERR_NULL_POINTER;
 
-    0,
-    0,
-    NULL,
-    NULL,
+    n = ujThreadPrvArrayGetLength(arrHandle);
 
-    ARRAY_ELEMS(ujNatCls_Object_methods),
-    ujNatCls_Object_methods,
-};
+    ret = ujNat_MiniStringBuilder_prv_reserve(cls, (HANDLE)ujThreadPrvPeek(t, 1), n, &buf);
+    if (ret != UJ_ERR_NONE)
+        return ret;
 
-static const UjNativeMethod ujNatCls_MiniString_methods[] = {
-#ifdef UJ_FTR_STRING_FEATURES
-    { "charAt", "(I)C", ujNat_MiniString_charAt, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
-    { "length", "()I", ujNat_MiniString_length, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
-#endif
-    { "XbyteAt_", "(I)B", ujNat_MiniString_XbyteAt_, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
-    { "Xlen_", "()I", ujNat_MiniString_Xlen_, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
-    { "<init>", "([B)V", ujNat_MiniString_init, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
-};
+    dst = ujHeapHandleLock(buf);
+    len = ujThreadPrvGet16(dst);
+    ujThreadPrvPut16(dst, len + n);
+    dst += 2 + len;
+    arr = ujHeapHandleLock(arrHandle);
+    if (arr->objType != OBJ_TYPE_ROM_ARRAY)
+        memcpy(dst, ujThreadPrvArrayElems(arr), n);
+    else
+        for (i = 0; i < n; i++)
+            dst[i] = ujThreadPrvArrayRead(arr, i, 1);
+    ujHeapHandleRelease(arrHandle);
+    ujHeapHandleRelease(buf);
 
-static const UjNativeClass ujNatCls_MiniString = {
-    "uj/lang/MiniString",
+    ujThreadPrvPop(t);
 
-    0,
-#ifdef UJ_OPT_RAM_STRINGS
-    4,
-#else
-    4 + sizeof(uintptr_t),
-#endif
-    NULL,
-    ujNat_MiniString_instGc,
+    return UJ_ERR_NONE;
+}
 
-    ARRAY_ELEMS(ujNatCls_MiniString_methods),
-    ujNatCls_MiniString_methods,
-};
+static uint8_t ujNat_MiniStringBuilder_appendChar(UjThread *t, UjClass *cls)
+{
+    uint16_t c = ujThreadPrvPopInt(t);
+    uint8_t bytes[3];
 
-static const UjNativeMethod ujNatCls_UJ_methods[] = {
-    { "consolePut", "(C)V", ujNat_RT_consolePut, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
-    { "threadCreate", "(Ljava/lang/Runnable;)V", ujNat_RT_threadCreate, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
-};
+    // modified UTF-8, same as the class file strings
+    if (c && c <= 0x7F) {
+        bytes[0] = c;
+        return ujNat_MiniStringBuilder_prv_append(t, cls, bytes, 1);
+    }
+    if (c <= 0x7FF) {
+        bytes[0] = 0xC0 | (c >> 6);
+        bytes[1] = 0x80 | (c & 0x3F);
+        return ujNat_MiniStringBuilder_prv_append(t, cls, bytes, 2);
+    }
 
-static const UjNativeClass ujNatCls_UJ = {
-    "uj/lang/RT",
+    bytes[0] = 0xE0 | (c >> 12);
+    bytes[1] = 0x80 | ((c >> 6) & 0x3F);
+    bytes[2] = 0x80 | (c & 0x3F);
+    return ujNat_MiniStringBuilder_prv_append(t, cls, bytes, 3);
+}
 
-    0,
-    0,
-    NULL,
-    NULL,
+static uint8_t ujNat_MiniStringBuilder_appendInt(UjThread *t, UjClass *cls)
+{
+    int32_t v = ujThreadPrvPopInt(t);
+    uint32_t u = v < 0 ? -(uint32_t)v : (uint32_t)v;
+    uint8_t bytes[11], *p = bytes + sizeof(bytes);
 
-    ARRAY_ELEMS(ujNatCls_UJ_methods),
-    ujNatCls_UJ_methods,
-};
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
 
-static uint8_t ujInitBuiltinClasses(UjClass **objectClsP)
+    if (v < 0)
+        *--p = '-';
+
+    return ujNat_MiniStringBuilder_prv_append(t, cls, p, bytes + sizeof(bytes) - p);
+}
+
+static uint8_t ujNat_MiniStringBuilder_length(UjThread *t, UjClass *cls)
 {
-    UjClass *cls;
+    HANDLE buf = ujNat_MiniStringBuilder_prv_buf(cls, ujThreadPrvPopRef(t));
+    uint32_t i, len, chars = 0;
+    uint8_t *data;
+
+    if (buf) {
+        data = ujHeapHandleLock(buf);
+        len = ujThreadPrvGet16(data);
+        for (i = 0; i < len; i++) {
+            if ((data[2 + i] & 0xC0) != 0x80)
+                chars++;
+        }
+        ujHeapHandleRelease(buf);
+    }
+
+    ujThreadPrvPushInt(t, chars);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_MiniStringBuilder_setLength(UjThread *t, UjClass *cls)
+{
+    int32_t want = ujThreadPrvPopInt(t);
+    HANDLE sbHandle = (HANDLE)ujThreadPrvPeek(t, 0);
+    HANDLE buf = ujNat_MiniStringBuilder_prv_buf(cls, sbHandle);
+    uint32_t ofst = 0, len = 0, chars = 0, pad;
+    uint8_t *data;
     uint8_t ret;
 
-    ret = ujRegisterNativeClass(&ujNatCls_Object, NULL, &cls);
-    if (ret != UJ_ERR_NONE)
-        return ret;
+    if (want < 0) {
+        ujThreadPrvPop(t);
+        return UJ_ERR_ARRAY_INDEX_OOB;
+    }
 
-    if (objectClsP)
-        *objectClsP = cls;
+    // find where char "want" starts, or count them all if there are fewer
+    if (buf) {
+        data = ujHeapHandleLock(buf);
+        len = ujThreadPrvGet16(data);
+        for (ofst = 0; ofst < len; ofst++) {
+            if ((data[2 + ofst] & 0xC0) == 0x80)
+                continue;
+            if (chars == (uint32_t)want)
+                break;
+            chars++;
+        }
+        ujHeapHandleRelease(buf);
+    }
 
-    ret = ujRegisterNativeClass(&ujNatCls_MiniString, cls, NULL);
-    if (ret != UJ_ERR_NONE)
-        return ret;
+    // growing pads with '\0' which takes two bytes in modified UTF-8
+    pad = (uint32_t)want - chars;
 
-    ret = ujRegisterNativeClass(&ujNatCls_UJ, cls, NULL);
+    if (!pad && ofst == len)
+        ret = UJ_ERR_NONE;
+    else if (pad > MINISTRINGBUILDER_MAX_CAP)
+        ret = UJ_ERR_OUT_OF_MEMORY;
+    else
+        ret = ujNat_MiniStringBuilder_prv_reserve(cls, sbHandle, pad * 2, &buf);
+
+    if (ret == UJ_ERR_NONE && buf) {
+        data = ujHeapHandleLock(buf);
+        while (pad--) {
+            data[2 + ofst++] = 0xC0;
+            data[2 + ofst++] = 0x80;
+        }
+        ujThreadPrvPut16(data, ofst);
+        ujHeapHandleRelease(buf);
+    }
+
+    ujThreadPrvPop(t);
+
+    return ret;
+}
+
+static uint8_t ujNat_MiniStringBuilder_toString(UjThread *t, UjClass *cls)
+{
+    HANDLE sbHandle = (HANDLE)ujThreadPrvPeek(t, 0);
+    HANDLE buf = ujNat_MiniStringBuilder_prv_buf(cls, sbHandle);
+    HANDLE strHandle;
+    UjInstance *inst;
+    uint8_t ofst, ret;
+
+    if (!buf) {
+        ret = ujNat_MiniStringBuilder_prv_reserve(cls, sbHandle, 0, &buf);
+        if (ret != UJ_ERR_NONE)
+            return ret;
+    }
+
+    ret = ujPrvNewStringObj(&strHandle);
     if (ret != UJ_ERR_NONE)
         return ret;
 
+    // the string takes our buffer as is, we copy it before writing to it again
+    inst = ujHeapHandleLock(strHandle);
+#ifdef UJ_OPT_RAM_STRINGS
+    ofst = 0;
+#else
+    ofst = ujThreadPrvPutPtr(inst->data + OBJ_CLS(inst)->supr->instDataOfst, 0);
+#endif
+    ujThreadPrvPut32(inst->data + OBJ_CLS(inst)->supr->instDataOfst + ofst, buf);
+    ujHeapHandleRelease(strHandle);
+
+    inst = ujHeapHandleLock(sbHandle);
+    inst->data[cls->instDataOfst + MINISTRINGBUILDER_SHARED_OFST] = 1;
+    ujHeapHandleRelease(sbHandle);
+
+    ujThreadPrvPop(t);
+    ujThreadPrvPushRef(t, strHandle);
+
     return UJ_ERR_NONE;
 }
+
+// a non-null array with elements [ofst, ofst + len) in bounds
+static uint8_t ujNat_Arrays_prv_check(HANDLE arrHandle, int32_t ofst, int32_t len)
+{
+    UjArray *arr;
+    uint32_t arrLen;
+    uint8_t ret = UJ_ERR_NONE;
+
+    if (!arrHandle)
+        return UJ_ERR_NULL_POINTER;
+
+    arr = ujHeapHandleLock(arrHandle);
+    arrLen = arr->length;
+    if (OBJ_CLS(arr))
+        ret = UJ_ERR_INVALID_CAST;
+    ujHeapHandleRelease(arrHandle);
+
+    if (ret == UJ_ERR_NONE && (ofst < 0 || len < 0 || (uint32_t)ofst + (uint32_t)len > arrLen))
+        ret = UJ_ERR_ARRAY_INDEX_OOB;
+
+    return ret;
+}
+
+static uint8_t ujNat_System_arraycopy(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    int32_t len = ujThreadPrvPopInt(t);
+    int32_t dstPos = ujThreadPrvPopInt(t);
+    HANDLE dstHandle = ujThreadPrvPopRef(t);
+    int32_t srcPos = ujThreadPrvPopInt(t);
+    HANDLE srcHandle = ujThreadPrvPopRef(t);
+    UjArray *src, *dst;
+    uint32_t i;
+    uint8_t ret, sz, step;
+
+    ret = ujNat_Arrays_prv_check(srcHandle, srcPos, len);
+    if (ret == UJ_ERR_NONE)
+        ret = ujNat_Arrays_prv_check(dstHandle, dstPos, len);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    src = ujHeapHandleLock(srcHandle);
+    dst = (dstHandle == srcHandle) ? src : ujHeapHandleLock(dstHandle);
+    sz = ujPrvJavaTypeToSize(src->elemType);
+
+    if (dst->objType == OBJ_TYPE_ROM_ARRAY)
+        ret = UJ_ERR_ARRAY_READ_ONLY;
+    else if ((src->objType == OBJ_TYPE_OBJ_ARRAY) != (dst->objType == OBJ_TYPE_OBJ_ARRAY))
+        ret = UJ_ERR_INVALID_CAST;
+    else if (dst->objType != OBJ_TYPE_OBJ_ARRAY && src->elemType != dst->elemType)
+        ret = UJ_ERR_INVALID_CAST;
+    else if (src->objType != OBJ_TYPE_ROM_ARRAY) // same array is fine, memmove copes with the overlap
+        memmove(ujThreadPrvArrayElems(dst) + dstPos * sz, ujThreadPrvArrayElems(src) + srcPos * sz, len * sz);
+    else {
+        // ROM elements are big-endian in the class file, longs go as two halves like ujThreadPrvArrayReadLong()
+        step = sz > 4 ? 4 : sz;
+        for (i = 0; i < (uint32_t)len * sz; i += step) {
+            uint32_t v = ujThreadPrvArrayRead(src, srcPos * sz + i, step);
+            uint8_t *ptr = ujThreadPrvArrayElems(dst) + dstPos * sz + i;
+
+            if (step == 1)
+                *ptr = v;
+            else if (step == 2)
+                ujThreadPrvPut16(ptr, v);
+            else
+                ujThreadPrvPut32(ptr, v);
+        }
+    }
+
+    if (dstHandle != srcHandle)
+        ujHeapHandleRelease(dstHandle);
+    ujHeapHandleRelease(srcHandle);
+
+    return ret;
+}
+
+// hi is only used for 8-byte elements
+static uint8_t ujNat_Arrays_prv_fill(HANDLE arrHandle, int32_t from, int32_t to, uint32_t hi, uint32_t lo)
+{
+    UjArray *arr;
+    uint8_t *ptr;
+    uint8_t ret, sz;
+
+    ret = ujNat_Arrays_prv_check(arrHandle, from, to - from);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    arr = ujHeapHandleLock(arrHandle);
+    sz = ujPrvJavaTypeToSize(arr->elemType);
+    ptr = ujThreadPrvArrayElems(arr) + from * sz;
+
+    if (arr->objType == OBJ_TYPE_ROM_ARRAY)
+        ret = UJ_ERR_ARRAY_READ_ONLY;
+    else if (sz == 1)
+        memset(ptr, lo, to - from);
+    else {
+        for (; from < to; from++, ptr += sz) {
+            if (sz == 2)
+                ujThreadPrvPut16(ptr, lo);
+            else if (sz == 4)
+                ujThreadPrvPut32(ptr, lo);
+            else {
+                ujThreadPrvPut32(ptr + 0, hi);
+                ujThreadPrvPut32(ptr + 4, lo);
+            }
+        }
+    }
+    ujHeapHandleRelease(arrHandle);
+
+    return ret;
+}
+
+static uint8_t ujNat_Arrays_fill(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    uint32_t v = ujThreadPrvPop(t);
+    HANDLE arrHandle = ujThreadPrvPopRef(t);
+
+    return ujNat_Arrays_prv_fill(arrHandle, 0, arrHandle ? ujThreadPrvArrayGetLength(arrHandle) : 0, 0, v);
+}
+
+static uint8_t ujNat_Arrays_fillRange(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    uint32_t v = ujThreadPrvPop(t);
+    int32_t to = ujThreadPrvPopInt(t);
+    int32_t from = ujThreadPrvPopInt(t);
+
+    return ujNat_Arrays_prv_fill(ujThreadPrvPopRef(t), from, to, 0, v);
+}
+
+#if defined(UJ_FTR_SUPPORT_LONG) || defined(UJ_FTR_SUPPORT_DOUBLE)
+static uint8_t ujNat_Arrays_fillLong(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    uint32_t lo = ujThreadPrvPop(t);
+    uint32_t hi = ujThreadPrvPop(t);
+    HANDLE arrHandle = ujThreadPrvPopRef(t);
+
+    return ujNat_Arrays_prv_fill(arrHandle, 0, arrHandle ? ujThreadPrvArrayGetLength(arrHandle) : 0, hi, lo);
+}
+
+static uint8_t ujNat_Arrays_fillLongRange(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    uint32_t lo = ujThreadPrvPop(t);
+    uint32_t hi = ujThreadPrvPop(t);
+    int32_t to = ujThreadPrvPopInt(t);
+    int32_t from = ujThreadPrvPopInt(t);
+
+    return ujNat_Arrays_prv_fill(ujThreadPrvPopRef(t), from, to, hi, lo);
+}
+#endif
+
+static uint8_t ujNat_Arrays_equals(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    HANDLE bHandle = ujThreadPrvPopRef(t);
+    HANDLE aHandle = ujThreadPrvPopRef(t);
+    UjArray *a, *b;
+    uint32_t i, bytes;
+    uint8_t eq, sz;
+
+    if (aHandle == bHandle)
+        eq = 1;
+    else if (!aHandle || !bHandle)
+        eq = 0;
+    else {
+        a = ujHeapHandleLock(aHandle);
+        b = ujHeapHandleLock(bHandle);
+        sz = ujPrvJavaTypeToSize(a->elemType);
+        bytes = a->length * sz;
+
+        if (a->length != b->length)
+            eq = 0;
+        else if (a->objType != OBJ_TYPE_ROM_ARRAY && b->objType != OBJ_TYPE_ROM_ARRAY)
+            eq = !memcmp(ujThreadPrvArrayElems(a), ujThreadPrvArrayElems(b), bytes);
+        else {
+            if (sz > 4)
+                sz = 4;
+            for (i = 0; i < bytes && ujThreadPrvArrayRead(a, i, sz) == ujThreadPrvArrayRead(b, i, sz); i += sz)
+                ;
+            eq = i == bytes;
+        }
+
+        ujHeapHandleRelease(bHandle);
+        ujHeapHandleRelease(aHandle);
+    }
+
+    ujThreadPrvPushInt(t, eq);
+
+    return UJ_ERR_NONE;
+}
+
+#ifdef UJ_FTR_COLLECTIONS
+
+// a new array of len elements starting with the first "keep" elements of old, which is freed
+static uint8_t ujNat_Coll_prv_realloc(char type, HANDLE old, uint32_t keep, int32_t len, HANDLE *arrP)
+{
+    uint8_t sz = ujPrvJavaTypeToSize(type);
+    HANDLE arr;
+    uint8_t ret;
+
+    ret = ujThreadPrvNewArray(type, len, &arr);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    if (old) {
+        memcpy(ujArrayRawAccessStart(arr), ujArrayRawAccessStart(old), keep * sz);
+        ujArrayRawAccessFinish(old);
+        ujArrayRawAccessFinish(arr);
+        ujHeapHandleFree(old);
+    }
+
+    *arrP = arr;
+    return UJ_ERR_NONE;
+}
+
+static uint32_t ujNat_Coll_prv_get(UjClass *cls, HANDLE handle, uint8_t ofst)
+{
+    uint32_t v = ujThreadPrvGet32(((UjInstance *)ujHeapHandleLock(handle))->data + cls->instDataOfst + ofst);
+
+    ujHeapHandleRelease(handle);
+    return v;
+}
+
+static void ujNat_Coll_prv_set(UjClass *cls, HANDLE handle, uint8_t ofst, uint32_t v)
+{
+    ujThreadPrvPut32(((UjInstance *)ujHeapHandleLock(handle))->data + cls->instDataOfst + ofst, v);
+    ujHeapHandleRelease(handle);
+}
+
+// java.util.ArrayList, instance data: {u32 handle of Object[], u32 size}
+#define ARRAYLIST_ARR_OFST  0
+#define ARRAYLIST_SIZE_OFST 4
+#define ARRAYLIST_INST_SZ   8
+#define ARRAYLIST_MIN_CAP   8
+
+static uint8_t ujNat_ArrayList_prv_ensure(UjClass *cls, HANDLE listH, uint32_t need)
+{
+    HANDLE arr = ujNat_Coll_prv_get(cls, listH, ARRAYLIST_ARR_OFST);
+    uint32_t cap = arr ? (uint32_t)ujThreadPrvArrayGetLength(arr) : 0;
+    uint8_t ret;
+
+    if (need <= cap)
+        return UJ_ERR_NONE;
+
+    cap *= 2;
+    if (cap < need)
+        cap = need;
+    if (cap < ARRAYLIST_MIN_CAP)
+        cap = ARRAYLIST_MIN_CAP;
+
+    ret = ujNat_Coll_prv_realloc(JAVA_TYPE_OBJ, arr, ujNat_Coll_prv_get(cls, listH, ARRAYLIST_SIZE_OFST), cap, &arr);
+    if (ret == UJ_ERR_NONE)
+        ujNat_Coll_prv_set(cls, listH, ARRAYLIST_ARR_OFST, arr);
+
+    return ret;
+}
+
+static uint8_t ujNat_ArrayList_init(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    ujThreadPrvPop(t); // storage is allocated on first add
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ArrayList_initCap(UjThread *t, UjClass *cls)
+{
+    int32_t cap = ujThreadPrvPopInt(t);
+    uint8_t ret;
+
+    ret = cap < 0 ? UJ_ERR_NEG_ARR_SZ : ujNat_ArrayList_prv_ensure(cls, (HANDLE)ujThreadPrvPeek(t, 0), cap);
+    ujThreadPrvPop(t);
+
+    return ret;
+}
+
+static uint8_t ujNat_ArrayList_add(UjThread *t, UjClass *cls)
+{
+    HANDLE val = (HANDLE)ujThreadPrvPeek(t, 0);
+    HANDLE listH = (HANDLE)ujThreadPrvPeek(t, 1);
+    uint32_t size = ujNat_Coll_prv_get(cls, listH, ARRAYLIST_SIZE_OFST);
+    uint8_t ret;
+
+    ret = ujNat_ArrayList_prv_ensure(cls, listH, size + 1);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    ujThreadPrvArraySetRef(ujNat_Coll_prv_get(cls, listH, ARRAYLIST_ARR_OFST), size, val);
+    ujNat_Coll_prv_set(cls, listH, ARRAYLIST_SIZE_OFST, size + 1);
+
+    ujThreadPrvPop(t);
+    ujThreadPrvPop(t);
+    ujThreadPrvPushInt(t, 1);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ArrayList_insert(UjThread *t, UjClass *cls)
+{
+    HANDLE val = (HANDLE)ujThreadPrvPeek(t, 0);
+    int32_t idx = ujThreadPrvPeek(t, 1);
+    HANDLE listH = (HANDLE)ujThreadPrvPeek(t, 2);
+    uint32_t size = ujNat_Coll_prv_get(cls, listH, ARRAYLIST_SIZE_OFST);
+    uint8_t *data;
+    HANDLE arr;
+    uint8_t ret;
+
+    if (idx < 0 || (uint32_t)idx > size)
+        return UJ_ERR_ARRAY_INDEX_OOB;
+
+    ret = ujNat_ArrayList_prv_ensure(cls, listH, size + 1);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    arr = ujNat_Coll_prv_get(cls, listH, ARRAYLIST_ARR_OFST);
+    data = ujArrayRawAccessStart(arr);
+    memmove(data + (idx + 1) * 4, data + idx * 4, (size - idx) * 4);
+    ujThreadPrvPut32(data + idx * 4, val);
+    ujArrayRawAccessFinish(arr);
+    ujNat_Coll_prv_set(cls, listH, ARRAYLIST_SIZE_OFST, size + 1);
+
+    ujThreadPrvPop(t);
+    ujThreadPrvPop(t);
+    ujThreadPrvPop(t);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ArrayList_get(UjThread *t, UjClass *cls)
+{
+    int32_t idx = ujThreadPrvPopInt(t);
+    HANDLE listH = ujThreadPrvPopRef(t);
+
+    if (idx < 0 || (uint32_t)idx >= ujNat_Coll_prv_get(cls, listH, ARRAYLIST_SIZE_OFST))
+        return UJ_ERR_ARRAY_INDEX_OOB;
+
+    ujThreadPrvPushRef(t, ujThreadPrvArrayGetRef(ujNat_Coll_prv_get(cls, listH, ARRAYLIST_ARR_OFST), idx));
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ArrayList_set(UjThread *t, UjClass *cls)
+{
+    HANDLE val = ujThreadPrvPopRef(t);
+    int32_t idx = ujThreadPrvPopInt(t);
+    HANDLE listH = ujThreadPrvPopRef(t);
+    HANDLE arr, old;
+
+    if (idx < 0 || (uint32_t)idx >= ujNat_Coll_prv_get(cls, listH, ARRAYLIST_SIZE_OFST))
+        return UJ_ERR_ARRAY_INDEX_OOB;
+
+    arr = ujNat_Coll_prv_get(cls, listH, ARRAYLIST_ARR_OFST);
+    old = ujThreadPrvArrayGetRef(arr, idx);
+    ujThreadPrvArraySetRef(arr, idx, val);
+    ujThreadPrvPushRef(t, old);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ArrayList_remove(UjThread *t, UjClass *cls)
+{
+    int32_t idx = ujThreadPrvPopInt(t);
+    HANDLE listH = ujThreadPrvPopRef(t);
+    uint32_t size = ujNat_Coll_prv_get(cls, listH, ARRAYLIST_SIZE_OFST);
+    uint8_t *data;
+    HANDLE arr, old;
+
+    if (idx < 0 || (uint32_t)idx >= size)
+        return UJ_ERR_ARRAY_INDEX_OOB;
+
+    arr = ujNat_Coll_prv_get(cls, listH, ARRAYLIST_ARR_OFST);
+    data = ujArrayRawAccessStart(arr);
+    old = ujThreadPrvGet32(data + idx * 4);
+    memmove(data + idx * 4, data + (idx + 1) * 4, (size - idx - 1) * 4);
+    ujThreadPrvPut32(data + (size - 1) * 4, 0); // do not keep it alive
+    ujArrayRawAccessFinish(arr);
+    ujNat_Coll_prv_set(cls, listH, ARRAYLIST_SIZE_OFST, size - 1);
+
+    ujThreadPrvPushRef(t, old);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ArrayList_size(UjThread *t, UjClass *cls)
+{
+    ujThreadPrvPushInt(t, ujNat_Coll_prv_get(cls, ujThreadPrvPopRef(t), ARRAYLIST_SIZE_OFST));
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ArrayList_isEmpty(UjThread *t, UjClass *cls)
+{
+    ujThreadPrvPushInt(t, !ujNat_Coll_prv_get(cls, ujThreadPrvPopRef(t), ARRAYLIST_SIZE_OFST));
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ArrayList_clear(UjThread *t, UjClass *cls)
+{
+    HANDLE listH = ujThreadPrvPopRef(t);
+    HANDLE arr = ujNat_Coll_prv_get(cls, listH, ARRAYLIST_ARR_OFST);
+
+    if (arr) {
+        memset(ujArrayRawAccessStart(arr), 0, ujNat_Coll_prv_get(cls, listH, ARRAYLIST_SIZE_OFST) * 4);
+        ujArrayRawAccessFinish(arr);
+    }
+    ujNat_Coll_prv_set(cls, listH, ARRAYLIST_SIZE_OFST, 0);
+
+    return UJ_ERR_NONE;
+}
+
+// uj.util.IntHashMap, instance data: {u32 handle of int[] keys, u32 handle of Object[] values, u32 count}
+// open addressing with linear probing, a null value marks a free slot so null cannot be stored
+#define INTHASHMAP_KEYS_OFST  0
+#define INTHASHMAP_VALS_OFST  4
+#define INTHASHMAP_COUNT_OFST 8
+#define INTHASHMAP_INST_SZ    12
+#define INTHASHMAP_MIN_CAP    16 // always a power of two
+
+static uint32_t ujNat_IntHashMap_prv_hash(int32_t key)
+{
+    uint32_t h = (uint32_t)key * 0x9E3779B1UL;
+
+    return h ^ (h >> 16);
+}
+
+// slot holding key, or the free slot where it would go. cap is a power of two and never full
+static uint32_t ujNat_IntHashMap_prv_find(const uint8_t *keys, const uint8_t *vals, uint32_t cap, int32_t key)
+{
+    uint32_t i = ujNat_IntHashMap_prv_hash(key) & (cap - 1);
+
+    while (ujThreadPrvGet32(vals + i * 4) && (int32_t)ujThreadPrvGet32(keys + i * 4) != key)
+        i = (i + 1) & (cap - 1);
+
+    return i;
+}
+
+// finds key, returns the value (or 0) and locks keys and values that the caller needs to release
+static HANDLE ujNat_IntHashMap_prv_lookup(UjClass *cls, HANDLE mapH, int32_t key, uint8_t **keysP, uint8_t **valsP, uint32_t *slotP)
+{
+    HANDLE keys = ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_KEYS_OFST);
+    HANDLE vals = ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_VALS_OFST);
+    uint32_t cap = ujThreadPrvArrayGetLength(vals); // before locking, it locks too
+
+    *keysP = ujArrayRawAccessStart(keys);
+    *valsP = ujArrayRawAccessStart(vals);
+    *slotP = ujNat_IntHashMap_prv_find(*keysP, *valsP, cap, key);
+
+    return ujThreadPrvGet32(*valsP + *slotP * 4);
+}
+
+static void ujNat_IntHashMap_prv_unlock(UjClass *cls, HANDLE mapH)
+{
+    ujArrayRawAccessFinish(ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_VALS_OFST));
+    ujArrayRawAccessFinish(ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_KEYS_OFST));
+}
+
+static uint8_t ujNat_IntHashMap_prv_resize(UjClass *cls, HANDLE mapH, uint32_t cap)
+{
+    HANDLE oldKeys = ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_KEYS_OFST);
+    HANDLE oldVals = ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_VALS_OFST);
+    uint32_t i, j, oldCap = oldVals ? (uint32_t)ujThreadPrvArrayGetLength(oldVals) : 0;
+    uint8_t *keys, *vals, *srcKeys, *srcVals;
+    HANDLE newKeys, newVals;
+    uint8_t ret;
+
+    ret = ujThreadPrvNewArray(JAVA_TYPE_INT, cap, &newKeys);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    // nothing points to newKeys yet, the lock keeps the next alloc's GC from freeing it
+    ujArrayRawAccessStart(newKeys);
+    ret = ujThreadPrvNewArray(JAVA_TYPE_OBJ, cap, &newVals);
+    ujArrayRawAccessFinish(newKeys);
+    if (ret != UJ_ERR_NONE) {
+        ujHeapHandleFree(newKeys);
+        return ret;
+    }
+
+    keys = ujArrayRawAccessStart(newKeys);
+    vals = ujArrayRawAccessStart(newVals);
+    if (oldVals) {
+        srcKeys = ujArrayRawAccessStart(oldKeys);
+        srcVals = ujArrayRawAccessStart(oldVals);
+        for (i = 0; i < oldCap; i++) {
+            if (!ujThreadPrvGet32(srcVals + i * 4))
+                continue;
+            j = ujNat_IntHashMap_prv_find(keys, vals, cap, ujThreadPrvGet32(srcKeys + i * 4));
+            ujThreadPrvPut32(keys + j * 4, ujThreadPrvGet32(srcKeys + i * 4));
+            ujThreadPrvPut32(vals + j * 4, ujThreadPrvGet32(srcVals + i * 4));
+        }
+        ujArrayRawAccessFinish(oldVals);
+        ujArrayRawAccessFinish(oldKeys);
+        ujHeapHandleFree(oldVals);
+        ujHeapHandleFree(oldKeys);
+    }
+    ujArrayRawAccessFinish(newVals);
+    ujArrayRawAccessFinish(newKeys);
+
+    ujNat_Coll_prv_set(cls, mapH, INTHASHMAP_KEYS_OFST, newKeys);
+    ujNat_Coll_prv_set(cls, mapH, INTHASHMAP_VALS_OFST, newVals);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_IntHashMap_init(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    ujThreadPrvPop(t); // storage is allocated on first put
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_IntHashMap_initCap(UjThread *t, UjClass *cls)
+{
+    int32_t want = ujThreadPrvPopInt(t);
+    uint32_t cap = INTHASHMAP_MIN_CAP;
+    uint8_t ret = UJ_ERR_NONE;
+
+    if (want < 0)
+        ret = UJ_ERR_NEG_ARR_SZ;
+    else {
+        while (cap < 0x40000000UL && cap * 3 < (uint32_t)want * 4)
+            cap *= 2;
+        ret = ujNat_IntHashMap_prv_resize(cls, (HANDLE)ujThreadPrvPeek(t, 0), cap);
+    }
+    ujThreadPrvPop(t);
+
+    return ret;
+}
+
+static uint8_t ujNat_IntHashMap_remove(UjThread *t, UjClass *cls);
+
+static uint8_t ujNat_IntHashMap_put(UjThread *t, UjClass *cls)
+{
+    HANDLE val = (HANDLE)ujThreadPrvPeek(t, 0);
+    int32_t key = ujThreadPrvPeek(t, 1);
+    HANDLE mapH = (HANDLE)ujThreadPrvPeek(t, 2);
+    HANDLE vals = ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_VALS_OFST);
+    uint32_t count = ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_COUNT_OFST);
+    uint32_t cap = vals ? (uint32_t)ujThreadPrvArrayGetLength(vals) : 0;
+    uint8_t *keysP, *valsP;
+    uint32_t slot;
+    HANDLE old;
+    uint8_t ret;
+
+    if (!val) {
+        ujThreadPrvPop(t);
+        return ujNat_IntHashMap_remove(t, cls);
+    }
+
+    // keep the load under 3/4
+    if ((count + 1) * 4 > cap * 3) {
+        ret = ujNat_IntHashMap_prv_resize(cls, mapH, cap ? cap * 2 : INTHASHMAP_MIN_CAP);
+        if (ret != UJ_ERR_NONE)
+            return ret;
+    }
+
+    old = ujNat_IntHashMap_prv_lookup(cls, mapH, key, &keysP, &valsP, &slot);
+    ujThreadPrvPut32(keysP + slot * 4, key);
+    ujThreadPrvPut32(valsP + slot * 4, val);
+    ujNat_IntHashMap_prv_unlock(cls, mapH);
+
+    if (!old)
+        ujNat_Coll_prv_set(cls, mapH, INTHASHMAP_COUNT_OFST, count + 1);
+
+    ujThreadPrvPop(t);
+    ujThreadPrvPop(t);
+    ujThreadPrvPop(t);
+    ujThreadPrvPushRef(t, old);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_IntHashMap_get(UjThread *t, UjClass *cls)
+{
+    int32_t key = ujThreadPrvPopInt(t);
+    HANDLE mapH = ujThreadPrvPopRef(t);
+    uint8_t *keysP, *valsP;
+    uint32_t slot;
+    HANDLE val = 0;
+
+    if (ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_VALS_OFST)) {
+        val = ujNat_IntHashMap_prv_lookup(cls, mapH, key, &keysP, &valsP, &slot);
+        ujNat_IntHashMap_prv_unlock(cls, mapH);
+    }
+    ujThreadPrvPushRef(t, val);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_IntHashMap_containsKey(UjThread *t, UjClass *cls)
+{
+    uint8_t ret = ujNat_IntHashMap_get(t, cls);
+
+    if (ret == UJ_ERR_NONE)
+        ujThreadPrvPushInt(t, !!ujThreadPrvPopRef(t));
+
+    return ret;
+}
+
+static uint8_t ujNat_IntHashMap_remove(UjThread *t, UjClass *cls)
+{
+    int32_t key = ujThreadPrvPopInt(t);
+    HANDLE mapH = ujThreadPrvPopRef(t);
+    uint8_t *keysP, *valsP;
+    uint32_t i, j, home, mask;
+    HANDLE old = 0;
+
+    if (ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_VALS_OFST)) {
+        mask = ujThreadPrvArrayGetLength(ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_VALS_OFST)) - 1;
+        old = ujNat_IntHashMap_prv_lookup(cls, mapH, key, &keysP, &valsP, &i);
+        if (old) {
+            // shift later entries of the probe run back so no tombstones are needed
+            for (j = (i + 1) & mask; ujThreadPrvGet32(valsP + j * 4); j = (j + 1) & mask) {
+                home = ujNat_IntHashMap_prv_hash(ujThreadPrvGet32(keysP + j * 4)) & mask;
+                if (((j - home) & mask) < ((j - i) & mask))
+                    continue;
+                ujThreadPrvPut32(keysP + i * 4, ujThreadPrvGet32(keysP + j * 4));
+                ujThreadPrvPut32(valsP + i * 4, ujThreadPrvGet32(valsP + j * 4));
+                i = j;
+            }
+            ujThreadPrvPut32(keysP + i * 4, 0);
+            ujThreadPrvPut32(valsP + i * 4, 0);
+            ujNat_Coll_prv_set(cls, mapH, INTHASHMAP_COUNT_OFST, ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_COUNT_OFST) - 1);
+        }
+        ujNat_IntHashMap_prv_unlock(cls, mapH);
+    }
+    ujThreadPrvPushRef(t, old);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_IntHashMap_size(UjThread *t, UjClass *cls)
+{
+    ujThreadPrvPushInt(t, ujNat_Coll_prv_get(cls, ujThreadPrvPopRef(t), INTHASHMAP_COUNT_OFST));
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_IntHashMap_clear(UjThread *t, UjClass *cls)
+{
+    HANDLE mapH = ujThreadPrvPopRef(t);
+    HANDLE vals = ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_VALS_OFST);
+
+    if (vals) {
+        memset(ujArrayRawAccessStart(vals), 0, ujThreadPrvArrayGetLength(vals) * 4);
+        ujArrayRawAccessFinish(vals);
+    }
+    ujNat_Coll_prv_set(cls, mapH, INTHASHMAP_COUNT_OFST, 0);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_IntHashMap_keys(UjThread *t, UjClass *cls)
+{
+    HANDLE mapH = (HANDLE)ujThreadPrvPeek(t, 0);
+    uint32_t i, n = 0, cap;
+    uint8_t *keysP, *valsP, *dst;
+    HANDLE keys, vals, arr;
+    uint8_t ret;
+
+    ret = ujThreadPrvNewArray(JAVA_TYPE_INT, ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_COUNT_OFST), &arr);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    vals = ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_VALS_OFST);
+    if (vals) {
+        keys = ujNat_Coll_prv_get(cls, mapH, INTHASHMAP_KEYS_OFST);
+        cap = ujThreadPrvArrayGetLength(vals);
+        keysP = ujArrayRawAccessStart(keys);
+        valsP = ujArrayRawAccessStart(vals);
+        dst = ujArrayRawAccessStart(arr);
+        for (i = 0; i < cap; i++) {
+            if (ujThreadPrvGet32(valsP + i * 4))
+                ujThreadPrvPut32(dst + 4 * n++, ujThreadPrvGet32(keysP + i * 4));
+        }
+        ujArrayRawAccessFinish(arr);
+        ujArrayRawAccessFinish(vals);
+        ujArrayRawAccessFinish(keys);
+    }
+
+    ujThreadPrvPop(t);
+    ujThreadPrvPushRef(t, arr);
+
+    return UJ_ERR_NONE;
+}
+
+// uj.util.ByteQueue, instance data: {u32 handle of byte[] ring, u32 head, u32 count}
+#define BYTEQUEUE_BUF_OFST   0
+#define BYTEQUEUE_HEAD_OFST  4
+#define BYTEQUEUE_COUNT_OFST 8
+#define BYTEQUEUE_INST_SZ    12
+#define BYTEQUEUE_MIN_CAP    16
+
+static uint8_t ujNat_ByteQueue_prv_ensure(UjClass *cls, HANDLE qH, uint32_t need)
+{
+    HANDLE buf = ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_BUF_OFST);
+    uint32_t head = ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_HEAD_OFST);
+    uint32_t count = ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_COUNT_OFST);
+    uint32_t first, cap = buf ? (uint32_t)ujThreadPrvArrayGetLength(buf) : 0;
+    uint8_t *src, *dst;
+    HANDLE newBuf;
+    uint8_t ret;
+
+    if (need <= cap)
+        return UJ_ERR_NONE;
+
+    cap *= 2;
+    if (cap < need)
+        cap = need;
+    if (cap < BYTEQUEUE_MIN_CAP)
+        cap = BYTEQUEUE_MIN_CAP;
+
+    ret = ujThreadPrvNewArray(JAVA_TYPE_BYTE, cap, &newBuf);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    // unwrap the ring while copying
+    if (buf) {
+        first = ujThreadPrvArrayGetLength(buf) - head;
+        if (first > count)
+            first = count;
+        src = ujArrayRawAccessStart(buf);
+        dst = ujArrayRawAccessStart(newBuf);
+        memcpy(dst, src + head, first);
+        memcpy(dst + first, src, count - first);
+        ujArrayRawAccessFinish(newBuf);
+        ujArrayRawAccessFinish(buf);
+        ujHeapHandleFree(buf);
+    }
+
+    ujNat_Coll_prv_set(cls, qH, BYTEQUEUE_BUF_OFST, newBuf);
+    ujNat_Coll_prv_set(cls, qH, BYTEQUEUE_HEAD_OFST, 0);
+
+    return UJ_ERR_NONE;
+}
+
+// copies n bytes between the ring (at logical position pos) and arr, in the given direction
+static void ujNat_ByteQueue_prv_copy(UjClass *cls, HANDLE qH, uint32_t pos, HANDLE arr, int32_t ofst, uint32_t n, bool toRing)
+{
+    HANDLE buf = ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_BUF_OFST);
+    uint32_t cap = ujThreadPrvArrayGetLength(buf);
+    uint32_t first, i;
+    uint8_t *ring;
+    UjArray *a;
+
+    pos += ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_HEAD_OFST);
+    if (pos >= cap)
+        pos -= cap;
+    first = cap - pos;
+    if (first > n)
+        first = n;
+
+    ring = ujArrayRawAccessStart(buf);
+    a = ujHeapHandleLock(arr);
+    if (!toRing) {
+        memcpy(ujThreadPrvArrayElems(a) + ofst, ring + pos, first);
+        memcpy(ujThreadPrvArrayElems(a) + ofst + first, ring, n - first);
+    } else if (a->objType != OBJ_TYPE_ROM_ARRAY) {
+        memcpy(ring + pos, ujThreadPrvArrayElems(a) + ofst, first);
+        memcpy(ring, ujThreadPrvArrayElems(a) + ofst + first, n - first);
+    } else {
+        for (i = 0; i < n; i++)
+            ring[(pos + i) % cap] = ujThreadPrvArrayRead(a, ofst + i, 1);
+    }
+    ujHeapHandleRelease(arr);
+    ujArrayRawAccessFinish(buf);
+}
+
+static uint8_t ujNat_ByteQueue_init(UjThread *t, _UNUSED_ UjClass *cls)
+{
+    ujThreadPrvPop(t); // storage is allocated on first put
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ByteQueue_initCap(UjThread *t, UjClass *cls)
+{
+    int32_t cap = ujThreadPrvPopInt(t);
+    uint8_t ret;
+
+    ret = cap < 0 ? UJ_ERR_NEG_ARR_SZ : ujNat_ByteQueue_prv_ensure(cls, (HANDLE)ujThreadPrvPeek(t, 0), cap);
+    ujThreadPrvPop(t);
+
+    return ret;
+}
+
+static uint8_t ujNat_ByteQueue_put(UjThread *t, UjClass *cls)
+{
+    uint8_t b = ujThreadPrvPopInt(t);
+    HANDLE qH = (HANDLE)ujThreadPrvPeek(t, 0);
+    uint32_t count = ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_COUNT_OFST);
+    uint32_t pos, cap;
+    HANDLE buf;
+    uint8_t ret;
+
+    ret = ujNat_ByteQueue_prv_ensure(cls, qH, count + 1);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    buf = ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_BUF_OFST);
+    cap = ujThreadPrvArrayGetLength(buf);
+    pos = ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_HEAD_OFST) + count;
+    ujThreadPrvArrayWrite(ujHeapHandleLock(buf), pos >= cap ? pos - cap : pos, 1, b);
+    ujHeapHandleRelease(buf);
+    ujNat_Coll_prv_set(cls, qH, BYTEQUEUE_COUNT_OFST, count + 1);
+
+    ujThreadPrvPop(t);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ByteQueue_write(UjThread *t, UjClass *cls)
+{
+    int32_t len = ujThreadPrvPopInt(t);
+    int32_t ofst = ujThreadPrvPopInt(t);
+    HANDLE arr = (HANDLE)ujThreadPrvPeek(t, 0);
+    HANDLE qH = (HANDLE)ujThreadPrvPeek(t, 1);
+    uint32_t count = ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_COUNT_OFST);
+    uint8_t ret;
+
+    ret = ujNat_Arrays_prv_check(arr, ofst, len);
+    if (ret == UJ_ERR_NONE)
+        ret = ujNat_ByteQueue_prv_ensure(cls, qH, count + len);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    if (len) {
+        ujNat_ByteQueue_prv_copy(cls, qH, count, arr, ofst, len, true);
+        ujNat_Coll_prv_set(cls, qH, BYTEQUEUE_COUNT_OFST, count + len);
+    }
+
+    ujThreadPrvPop(t);
+    ujThreadPrvPop(t);
+
+    return UJ_ERR_NONE;
+}
+
+// removes up to n bytes from the front
+static void ujNat_ByteQueue_prv_consume(UjClass *cls, HANDLE qH, uint32_t n)
+{
+    HANDLE buf = ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_BUF_OFST);
+    uint32_t head = ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_HEAD_OFST) + n;
+    uint32_t cap = ujThreadPrvArrayGetLength(buf);
+
+    ujNat_Coll_prv_set(cls, qH, BYTEQUEUE_HEAD_OFST, head >= cap ? head - cap : head);
+    ujNat_Coll_prv_set(cls, qH, BYTEQUEUE_COUNT_OFST, ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_COUNT_OFST) - n);
+}
+
+static uint8_t ujNat_ByteQueue_prv_front(UjThread *t, UjClass *cls, bool consume)
+{
+    HANDLE qH = ujThreadPrvPopRef(t);
+    int32_t v = -1;
+
+    if (ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_COUNT_OFST)) {
+        v = (uint8_t)ujThreadPrvArrayGetByte(ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_BUF_OFST),
+                                             ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_HEAD_OFST));
+        if (consume)
+            ujNat_ByteQueue_prv_consume(cls, qH, 1);
+    }
+    ujThreadPrvPushInt(t, v);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ByteQueue_get(UjThread *t, UjClass *cls)
+{
+    return ujNat_ByteQueue_prv_front(t, cls, true);
+}
+
+static uint8_t ujNat_ByteQueue_peek(UjThread *t, UjClass *cls)
+{
+    return ujNat_ByteQueue_prv_front(t, cls, false);
+}
+
+static uint8_t ujNat_ByteQueue_read(UjThread *t, UjClass *cls)
+{
+    int32_t len = ujThreadPrvPopInt(t);
+    int32_t ofst = ujThreadPrvPopInt(t);
+    HANDLE arr = ujThreadPrvPopRef(t);
+    HANDLE qH = ujThreadPrvPopRef(t);
+    uint32_t count = ujNat_Coll_prv_get(cls, qH, BYTEQUEUE_COUNT_OFST);
+    uint8_t ret;
+
+    ret = ujNat_Arrays_prv_check(arr, ofst, len);
+    if (ret == UJ_ERR_NONE) {
+        if (((UjArray *)ujHeapHandleLock(arr))->objType == OBJ_TYPE_ROM_ARRAY)
+            ret = UJ_ERR_ARRAY_READ_ONLY;
+        ujHeapHandleRelease(arr);
+    }
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    if ((uint32_t)len > count)
+        len = count;
+    if (len) {
+        ujNat_ByteQueue_prv_copy(cls, qH, 0, arr, ofst, len, false);
+        ujNat_ByteQueue_prv_consume(cls, qH, len);
+    }
+    ujThreadPrvPushInt(t, len);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ByteQueue_size(UjThread *t, UjClass *cls)
+{
+    ujThreadPrvPushInt(t, ujNat_Coll_prv_get(cls, ujThreadPrvPopRef(t), BYTEQUEUE_COUNT_OFST));
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_ByteQueue_clear(UjThread *t, UjClass *cls)
+{
+    HANDLE qH = ujThreadPrvPopRef(t);
+
+    ujNat_Coll_prv_set(cls, qH, BYTEQUEUE_HEAD_OFST, 0);
+    ujNat_Coll_prv_set(cls, qH, BYTEQUEUE_COUNT_OFST, 0);
+
+    return UJ_ERR_NONE;
+}
+
+#endif
+
+static uint8_t ujNat_RT_consolePut(UjThread *t, _UNUSED_ UjClass *myCls)
+{
+    char c = ujThreadPop(t);
+    printf("%c", c);
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujNat_RT_prv_threadCreate(UjThread *oldT, int32_t prio)
+{
+    HANDLE handle;
+    UjInstance *inst;
+    UInt24 addr;
+    UjClass *cls;
+    HANDLE threadH;
+    uint8_t ret;
+    UjThread *t;
+    UjPrvStrEqualParam name, type;
+    uint16_t flags;
+
+    handle = ujThreadPrvPopRef(oldT);
+    if (!handle)
+        return UJ_ERR_NULL_POINTER;
+    inst = ujHeapHandleLock(handle);
+
+    name.type = STR_EQ_PAR_TYPE_PTR;
+    name.data.ptr.len = ujCstrlen(name.data.ptr.str = "run");
+
+    type.type = STR_EQ_PAR_TYPE_PTR;
+    type.data.ptr.len = ujCstrlen(type.data.ptr.str = "()V");
+
+    cls = OBJ_CLS(inst);
+
+    addr = ujThreadPrvGetMethodAddr(&cls, &name, &type, 0, 0, &flags);
+    if (addr == UJ_PC_BAD) {
+        ujHeapHandleRelease(handle);
+        return UJ_ERR_METHOD_NONEXISTENT;
+    }
+
+    threadH = ujThreadCreate(ujThreadPrvStackSize(cls, addr, flags));
+    if (!threadH) {
+        ujHeapHandleRelease(handle);
+        return UJ_ERR_OUT_OF_MEMORY;
+    }
+
+    t = ujHeapHandleLock(threadH);
+    ujThreadPrvLocalStoreRef(t, 0, handle);
+    ujThreadPrvSetPriority(t, prio);
+
+    ujHeapHandleRelease(handle);
+
+    ret = ujThreadPrvGoto(t, cls, handle, addr);
+    ujHeapHandleRelease(threadH);
+
+    return ret;
+}
+
+static uint8_t ujNat_RT_threadCreate(UjThread *t, _UNUSED_ UjClass *myCls)
+{
+    return ujNat_RT_prv_threadCreate(t, UJ_THREAD_PRIO_NORM);
+}
+
+static uint8_t ujNat_RT_threadCreatePrio(UjThread *t, _UNUSED_ UjClass *myCls)
+{
+    int32_t prio = ujThreadPrvPopInt(t);
+
+    return ujNat_RT_prv_threadCreate(t, prio);
+}
+
+static uint8_t ujNat_RT_threadSetPriority(UjThread *t, _UNUSED_ UjClass *myCls) // of the calling thread
+{
+    ujThreadPrvSetPriority(t, ujThreadPrvPopInt(t));
+
+    return UJ_ERR_NONE;
+}
+
+static void ujNat_MiniString_instGc(UjClass *cls, UjInstance *inst)
+{
+    UjClass *strCls;
+    HANDLE h;
+    uint8_t ofst;
+
+#ifdef UJ_OPT_RAM_STRINGS
+    strCls = NULL;
+    ofst = 0;
+#else
+    strCls = (UjClass *)ujThreadPrvGetPtr(inst->data + cls->instDataOfst + 0);
+    ofst = sizeof(uintptr_t);
+#endif
+
+    if (!strCls) {
+        h = (HANDLE)ujThreadPrvGet32(inst->data + cls->instDataOfst + ofst);
+
+        // if we get here from an alloc inside a call to <init> on this very
+        // instance, handle will be zero - we should be prepared for that
+        if (h)
+            ujHeapMark(h, 2);
+    }
+}
+
+static void ujNat_MiniStringBuilder_instGc(UjClass *cls, UjInstance *inst)
+{
+    HANDLE h = ujThreadPrvGet32(inst->data + cls->instDataOfst + MINISTRINGBUILDER_BUF_OFST);
+
+    if (h)
+        ujHeapMark(h, 2);
+}
+
+#ifdef UJ_FTR_COLLECTIONS
+static void ujNat_ArrayList_instGc(UjClass *cls, UjInstance *inst)
+{
+    HANDLE h = ujThreadPrvGet32(inst->data + cls->instDataOfst + ARRAYLIST_ARR_OFST);
+
+    if (h)
+        ujHeapMark(h, 1);
+}
+
+static void ujNat_IntHashMap_instGc(UjClass *cls, UjInstance *inst)
+{
+    HANDLE h = ujThreadPrvGet32(inst->data + cls->instDataOfst + INTHASHMAP_VALS_OFST);
+
+    if (h)
+        ujHeapMark(h, 1);
+
+    h = ujThreadPrvGet32(inst->data + cls->instDataOfst + INTHASHMAP_KEYS_OFST);
+    if (h)
+        ujHeapMark(h, 2);
+}
+
+static void ujNat_ByteQueue_instGc(UjClass *cls, UjInstance *inst)
+{
+    HANDLE h = ujThreadPrvGet32(inst->data + cls->instDataOfst + BYTEQUEUE_BUF_OFST);
+
+    if (h)
+        ujHeapMark(h, 2);
+}
+#endif
+
+static const UjNativeMethod ujNatCls_Object_methods[] = {
+    { "hashCode", "()I", ujNat_Object_hashCode, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "<init>", "()V", ujNat_Object_Object, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+#ifdef UJ_FTR_SYNCHRONIZATION
+    { "wait", "()V", ujNat_Object_wait, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "wait", "(J)V", ujNat_Object_waitTimed, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "notify", "()V", ujNat_Object_notify, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "notifyAll", "()V", ujNat_Object_notifyAll, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+#endif
+};
+
+static const UjNativeClass ujNatCls_Object = {
+    "java/lang/Object",
+
+    0,
+    0,
+    NULL,
+    NULL,
+
+    ARRAY_ELEMS(ujNatCls_Object_methods),
+    ujNatCls_Object_methods,
+};
+
+static const UjNativeMethod ujNatCls_MiniString_methods[] = {
+#ifdef UJ_FTR_STRING_FEATURES
+    { "charAt", "(I)C", ujNat_MiniString_charAt, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "length", "()I", ujNat_MiniString_length, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+#endif
+    { "XbyteAt_", "(I)B", ujNat_MiniString_XbyteAt_, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "Xlen_", "()I", ujNat_MiniString_Xlen_, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "<init>", "([B)V", ujNat_MiniString_init, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+};
+
+static const UjNativeClass ujNatCls_MiniString = {
+    "uj/lang/MiniString",
+
+    0,
+    MINISTRING_INFO_OFST + MINISTRING_INFO_SZ,
+    NULL,
+    ujNat_MiniString_instGc,
+
+    ARRAY_ELEMS(ujNatCls_MiniString_methods),
+    ujNatCls_MiniString_methods,
+};
+
+static const UjNativeMethod ujNatCls_MiniStringBuilder_methods[] = {
+    { "append", "(Ljava/lang/String;)Ljava/lang/StringBuilder;", ujNat_MiniStringBuilder_appendString, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "append", "(C)Ljava/lang/StringBuilder;", ujNat_MiniStringBuilder_appendChar, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "append", "(I)Ljava/lang/StringBuilder;", ujNat_MiniStringBuilder_appendInt, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "append", "([B)Ljava/lang/StringBuilder;", ujNat_MiniStringBuilder_appendBytes, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "length", "()I", ujNat_MiniStringBuilder_length, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "setLength", "(I)V", ujNat_MiniStringBuilder_setLength, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "toString", "()Ljava/lang/String;", ujNat_MiniStringBuilder_toString, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "<init>", "()V", ujNat_MiniStringBuilder_init, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "<init>", "(I)V", ujNat_MiniStringBuilder_initCap, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+};
+
+static const UjNativeClass ujNatCls_MiniStringBuilder = {
+    "uj/lang/MiniStringBuilder",
+
+    0,
+    MINISTRINGBUILDER_INST_SZ,
+    NULL,
+    ujNat_MiniStringBuilder_instGc,
+
+    ARRAY_ELEMS(ujNatCls_MiniStringBuilder_methods),
+    ujNatCls_MiniStringBuilder_methods,
+};
+
+static const UjNativeMethod ujNatCls_System_methods[] = {
+    { "arraycopy", "(Ljava/lang/Object;ILjava/lang/Object;II)V", ujNat_System_arraycopy, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+};
+
+static const UjNativeClass ujNatCls_System = {
+    "java/lang/System",
+
+    0,
+    0,
+    NULL,
+    NULL,
+
+    ARRAY_ELEMS(ujNatCls_System_methods),
+    ujNatCls_System_methods,
+};
+
+static const UjNativeMethod ujNatCls_Arrays_methods[] = {
+    { "fill", "([BB)V", ujNat_Arrays_fill, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([ZZ)V", ujNat_Arrays_fill, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([CC)V", ujNat_Arrays_fill, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([SS)V", ujNat_Arrays_fill, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([II)V", ujNat_Arrays_fill, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([Ljava/lang/Object;Ljava/lang/Object;)V", ujNat_Arrays_fill, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([BIIB)V", ujNat_Arrays_fillRange, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([ZIIZ)V", ujNat_Arrays_fillRange, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([CIIC)V", ujNat_Arrays_fillRange, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([SIIS)V", ujNat_Arrays_fillRange, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([IIII)V", ujNat_Arrays_fillRange, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([Ljava/lang/Object;IILjava/lang/Object;)V", ujNat_Arrays_fillRange, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+#ifdef UJ_FTR_SUPPORT_FLOAT
+    { "fill", "([FF)V", ujNat_Arrays_fill, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([FIIF)V", ujNat_Arrays_fillRange, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+#endif
+#ifdef UJ_FTR_SUPPORT_LONG
+    { "fill", "([JJ)V", ujNat_Arrays_fillLong, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([JIIJ)V", ujNat_Arrays_fillLongRange, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "equals", "([J[J)Z", ujNat_Arrays_equals, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+#endif
+#ifdef UJ_FTR_SUPPORT_DOUBLE
+    { "fill", "([DD)V", ujNat_Arrays_fillLong, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "fill", "([DIID)V", ujNat_Arrays_fillLongRange, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+#endif
+    { "equals", "([B[B)Z", ujNat_Arrays_equals, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "equals", "([Z[Z)Z", ujNat_Arrays_equals, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "equals", "([C[C)Z", ujNat_Arrays_equals, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "equals", "([S[S)Z", ujNat_Arrays_equals, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "equals", "([I[I)Z", ujNat_Arrays_equals, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+};
+
+static const UjNativeClass ujNatCls_Arrays = {
+    "java/util/Arrays",
+
+    0,
+    0,
+    NULL,
+    NULL,
+
+    ARRAY_ELEMS(ujNatCls_Arrays_methods),
+    ujNatCls_Arrays_methods,
+};
+
+#ifdef UJ_FTR_COLLECTIONS
+static const UjNativeMethod ujNatCls_ArrayList_methods[] = {
+    { "add", "(Ljava/lang/Object;)Z", ujNat_ArrayList_add, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "add", "(ILjava/lang/Object;)V", ujNat_ArrayList_insert, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "get", "(I)Ljava/lang/Object;", ujNat_ArrayList_get, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "set", "(ILjava/lang/Object;)Ljava/lang/Object;", ujNat_ArrayList_set, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "remove", "(I)Ljava/lang/Object;", ujNat_ArrayList_remove, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "size", "()I", ujNat_ArrayList_size, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "isEmpty", "()Z", ujNat_ArrayList_isEmpty, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "clear", "()V", ujNat_ArrayList_clear, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "<init>", "()V", ujNat_ArrayList_init, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "<init>", "(I)V", ujNat_ArrayList_initCap, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+};
+
+static const UjNativeClass ujNatCls_ArrayList = {
+    "java/util/ArrayList",
+
+    0,
+    ARRAYLIST_INST_SZ,
+    NULL,
+    ujNat_ArrayList_instGc,
+
+    ARRAY_ELEMS(ujNatCls_ArrayList_methods),
+    ujNatCls_ArrayList_methods,
+};
+
+static const UjNativeMethod ujNatCls_IntHashMap_methods[] = {
+    { "put", "(ILjava/lang/Object;)Ljava/lang/Object;", ujNat_IntHashMap_put, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "get", "(I)Ljava/lang/Object;", ujNat_IntHashMap_get, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "containsKey", "(I)Z", ujNat_IntHashMap_containsKey, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "remove", "(I)Ljava/lang/Object;", ujNat_IntHashMap_remove, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "size", "()I", ujNat_IntHashMap_size, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "clear", "()V", ujNat_IntHashMap_clear, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "keys", "()[I", ujNat_IntHashMap_keys, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "<init>", "()V", ujNat_IntHashMap_init, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "<init>", "(I)V", ujNat_IntHashMap_initCap, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+};
+
+static const UjNativeClass ujNatCls_IntHashMap = {
+    "uj/util/IntHashMap",
+
+    0,
+    INTHASHMAP_INST_SZ,
+    NULL,
+    ujNat_IntHashMap_instGc,
+
+    ARRAY_ELEMS(ujNatCls_IntHashMap_methods),
+    ujNatCls_IntHashMap_methods,
+};
+
+static const UjNativeMethod ujNatCls_ByteQueue_methods[] = {
+    { "put", "(B)V", ujNat_ByteQueue_put, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "write", "([BII)V", ujNat_ByteQueue_write, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "get", "()I", ujNat_ByteQueue_get, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "peek", "()I", ujNat_ByteQueue_peek, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "read", "([BII)I", ujNat_ByteQueue_read, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "size", "()I", ujNat_ByteQueue_size, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "clear", "()V", ujNat_ByteQueue_clear, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "<init>", "()V", ujNat_ByteQueue_init, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+    { "<init>", "(I)V", ujNat_ByteQueue_initCap, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE },
+};
+
+static const UjNativeClass ujNatCls_ByteQueue = {
+    "uj/util/ByteQueue",
+
+    0,
+    BYTEQUEUE_INST_SZ,
+    NULL,
+    ujNat_ByteQueue_instGc,
+
+    ARRAY_ELEMS(ujNatCls_ByteQueue_methods),
+    ujNatCls_ByteQueue_methods,
+};
+#endif
+
+static const UjNativeMethod ujNatCls_UJ_methods[] = {
+    { "consolePut", "(C)V", ujNat_RT_consolePut, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "threadCreate", "(Ljava/lang/Runnable;)V", ujNat_RT_threadCreate, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "threadCreate", "(Ljava/lang/Runnable;I)V", ujNat_RT_threadCreatePrio, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+    { "threadSetPriority", "(I)V", ujNat_RT_threadSetPriority, JAVA_ACC_PUBLIC | JAVA_ACC_NATIVE | JAVA_ACC_STATIC },
+};
+
+static const UjNativeClass ujNatCls_UJ = {
+    "uj/lang/RT",
+
+    0,
+    0,
+    NULL,
+    NULL,
+
+    ARRAY_ELEMS(ujNatCls_UJ_methods),
+    ujNatCls_UJ_methods,
+};
+
+static uint8_t ujInitBuiltinClasses(UjClass **objectClsP)
+{
+    UjClass *cls;
+    uint8_t ret;
+
+    ret = ujRegisterNativeClass(&ujNatCls_Object, NULL, &cls);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    if (objectClsP)
+        *objectClsP = cls;
+
+    ret = ujRegisterNativeClass(&ujNatCls_MiniString, cls, NULL);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    ret = ujRegisterNativeClass(&ujNatCls_MiniStringBuilder, cls, NULL);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    ret = ujRegisterNativeClass(&ujNatCls_System, cls, NULL);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    ret = ujRegisterNativeClass(&ujNatCls_Arrays, cls, NULL);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+#ifdef UJ_FTR_COLLECTIONS
+    ret = ujRegisterNativeClass(&ujNatCls_ArrayList, cls, NULL);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    ret = ujRegisterNativeClass(&ujNatCls_IntHashMap, cls, NULL);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    ret = ujRegisterNativeClass(&ujNatCls_ByteQueue, cls, NULL);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+#endif
+
+    ret = ujRegisterNativeClass(&ujNatCls_UJ, cls, NULL);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    return UJ_ERR_NONE;
+}
+
+#ifdef UJ_FTR_SNAPSHOT
+
+/*
+        A snapshot is the raw heap as it is right after ujInitAllClasses(). It
+   is only valid for the very same set of classes loaded in the very same order
+   (so that every class lands at the same heap offset) and the same VM build.
+   Class headers are not restored since they carry this boot's pointers (readD,
+   native tables). Instances carry raw class pointers, so if the heap moved
+   (ASLR) those get rebased. GC leaves walked objects at mark 3, which is how we
+   tell them apart from raw chunks (string data, etc) without knowing types.
+*/
+
+#define UJ_SNAPSHOT_MAGIC 0x4E534A55UL // "UJSN"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t pakHash;
+    uint32_t heapSz;
+    uint16_t ptrSz;
+    uint16_t clsSz;
+    uint16_t instSz; // object headers differ between builds (UJ_OPT_COMPACT_HEADERS)
+    uint16_t arrSz;
+    uint32_t numClasses;
+    uint64_t heapBase;
+} UjSnapshotHdr; // followed by u32 class offsets (in class list order) and the heap itself
+
+static void ujSnapshotPrvFillHdr(UjSnapshotHdr *hdr, uint32_t pakHash)
+{
+    UjClass *cls;
+
+    hdr->magic = UJ_SNAPSHOT_MAGIC;
+    hdr->pakHash = pakHash;
+    hdr->heapSz = ujHeapGetRawSize();
+    hdr->ptrSz = sizeof(uintptr_t);
+    hdr->clsSz = sizeof(UjClass);
+    hdr->instSz = sizeof(UjInstance);
+    hdr->arrSz = sizeof(UjArray);
+    hdr->numClasses = 0;
+    for (cls = gFirstClass; cls; cls = cls->nextClass)
+        hdr->numClasses++;
+    hdr->heapBase = (uintptr_t)ujHeapGetRaw();
+}
+
+static void ujSnapshotPrvRebase(HANDLE handle, intptr_t delta)
+{
+    UjInstance *inst = ujHeapHandleLock(handle);
+
+    if (OBJ_CLS(inst)) {
+#ifndef UJ_OPT_COMPACT_HEADERS // indices need no rebasing
+        inst->cls = (UjClass *)((uintptr_t)inst->cls + delta);
+#endif
+
+#ifndef UJ_OPT_RAM_STRINGS
+        UjClass *cls;
+
+        for (cls = OBJ_CLS(inst); cls; cls = cls->supr) {
+            if (cls->native && cls->info.native == &ujNatCls_MiniString) {
+                uint8_t *ptr = inst->data + cls->instDataOfst;
+                uintptr_t strCls = ujThreadPrvGetPtr(ptr);
+
+                if (strCls)
+                    ujThreadPrvPutPtr(ptr, strCls + delta);
+                break;
+            }
+        }
+#endif
+    }
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+    else if (((UjArray *)inst)->objType == OBJ_TYPE_ROM_ARRAY) {
+        uint8_t *ptr = ((UjArray *)inst)->data;
+
+        ujThreadPrvPutPtr(ptr, ujThreadPrvGetPtr(ptr) + delta);
+    }
+#endif
+
+    ujHeapHandleRelease(handle);
+}
+
+uint8_t ujSnapshotSave(uint32_t pakHash, ujSnapshotWriteF writeF, void *userData)
+{
+    uint8_t *heap = ujHeapGetRaw();
+    UjSnapshotHdr hdr;
+    UjClass *cls;
+    uint32_t ofst;
+
+    if (gFirstThread) // stacks hold class pointers we cannot find again
+        return UJ_ERR_INTERNAL;
+
+    // drop garbage and leave fresh marks behind for the restore side
+    ujHeapUnmarkAll();
+    ujGC();
+    ujHeapFreeUnmarked();
+
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+    // native memory will not be there (or not the same) when the snapshot comes back
+    for (HANDLE h = ujHeapNextHandle(0); h; h = ujHeapNextHandle(h)) {
+        UjArray *arr;
+        bool ext;
+
+        if (ujHeapGetMark(h) != 3) // not an object
+            continue;
+        arr = ujHeapHandleLock(h);
+        ext = !OBJ_CLS(arr) && arr->objType == OBJ_TYPE_EXT_ARRAY;
+        ujHeapHandleRelease(h);
+        if (ext)
+            return UJ_ERR_INTERNAL;
+    }
+#endif
+
+    ujSnapshotPrvFillHdr(&hdr, pakHash);
+    if (!writeF(userData, &hdr, sizeof(hdr)))
+        return UJ_ERR_INTERNAL;
+
+    for (cls = gFirstClass; cls; cls = cls->nextClass) {
+        ofst = (uint8_t *)cls - heap;
+        if (!writeF(userData, &ofst, sizeof(ofst)))
+            return UJ_ERR_INTERNAL;
+    }
+
+    if (!writeF(userData, heap, hdr.heapSz))
+        return UJ_ERR_INTERNAL;
+
+    return UJ_ERR_NONE;
+}
+
+uint8_t ujSnapshotRestore(uint32_t pakHash, ujSnapshotReadF readF, void *userData)
+{
+    uint8_t *heap = ujHeapGetRaw();
+    UjSnapshotHdr hdr, cur;
+    uint32_t ofst, next, t;
+    _UNUSED_ UjClass *found;
+    UjClass saved;
+    intptr_t delta;
+    UjClass *cls;
+    HANDLE h;
+
+    if (gFirstThread)
+        return UJ_ERR_INTERNAL;
+
+    // step 1: verify it is ours. nothing is touched until we're sure
+
+    if (!readF(userData, &hdr, sizeof(hdr)))
+        return UJ_ERR_FALSE;
+
+    ujSnapshotPrvFillHdr(&cur, pakHash);
+    if (hdr.magic != cur.magic || hdr.pakHash != cur.pakHash || hdr.ptrSz != cur.ptrSz ||
+        hdr.clsSz != cur.clsSz || hdr.instSz != cur.instSz || hdr.arrSz != cur.arrSz ||
+        hdr.numClasses != cur.numClasses)
+        return UJ_ERR_FALSE;
+
+    for (cls = gFirstClass; cls; cls = cls->nextClass) {
+        if (!readF(userData, &ofst, sizeof(ofst)) || ofst != (uint32_t)((uint8_t *)cls - heap))
+            return UJ_ERR_FALSE;
+    }
+
+    // a heap that grows may have grown differently here
+    if (!ujHeapSetRawSize(hdr.heapSz))
+        return UJ_ERR_FALSE;
+
+    // step 2: read the heap, skipping over class headers (ours stay, save for what points into the heap)
+
+    ofst = 0;
+    while (ofst < hdr.heapSz) {
+        next = hdr.heapSz;
+        found = NULL;
+        for (cls = gFirstClass; cls; cls = cls->nextClass) {
+            t = (uint8_t *)cls - heap;
+            if (t >= ofst && t < next) {
+                next = t;
+                found = cls;
+            }
+        }
+
+        if (next != ofst && !readF(userData, heap + ofst, next - ofst))
+            return UJ_ERR_INTERNAL;
+        if (next == hdr.heapSz)
+            break;
+
+        if (!readF(userData, &saved, offsetof(UjClass, data))) // class data right behind is ours to restore
+            return UJ_ERR_INTERNAL;
+#ifdef UJ_OPT_INTERN_STRINGS
+        found->strings = saved.strings;
+#endif
+        ofst = next + offsetof(UjClass, data);
+    }
+
+    // step 3: rebase class pointers in objects if the heap moved
+
+    delta = (intptr_t)((uintptr_t)heap - (uintptr_t)hdr.heapBase);
+    if (delta) {
+        for (h = ujHeapNextHandle(0); h; h = ujHeapNextHandle(h)) {
+            if (ujHeapGetMark(h) == 3)
+                ujSnapshotPrvRebase(h, delta);
+        }
+    }
+
+    return UJ_ERR_NONE;
+}
+
+#endif
+
+#ifdef UJ_FTR_STATIC_IMAGE_EXPORT
+
+/*
+        Static images are produced on the build host: run all <clinit>s, then
+   dump whatever each class's statics ended up holding, as long as it is pure
+   data (primitives, strings, arrays of primitives). classCvt embeds the image
+   in the UJC and drops the <clinit> code. Format is described in UJC.h.
+*/
+
+static bool ujPrvImagePut(ujStaticImageWriteF writeF, void *userData, uint32_t v, uint8_t sz)
+{
+    uint8_t buf[4];
+    uint8_t i;
+
+    if (!writeF) // only validating
+        return true;
+
+    for (i = 0; i < sz; i++)
+        buf[i] = v >> ((sz - 1 - i) * 8);
+
+    return writeF(userData, buf, sz);
+}
+
+static bool ujPrvImagePutValue(ujStaticImageWriteF writeF, void *userData, const uint8_t *ptr, uint8_t sz)
+{
+    switch (sz) {
+    case 1:
+
+        return ujPrvImagePut(writeF, userData, *ptr, 1);
+
+    case 2:
+
+        return ujPrvImagePut(writeF, userData, ujThreadPrvGet16(ptr), 2);
+
+    case 8:
+
+        return ujPrvImagePut(writeF, userData, ujThreadPrvGet32(ptr), 4) &&
+               ujPrvImagePut(writeF, userData, ujThreadPrvGet32(ptr + 4), 4);
+
+    default:
+
+        return ujPrvImagePut(writeF, userData, ujThreadPrvGet32(ptr), 4);
+    }
+}
+
+static bool ujPrvImageIsZero(const uint8_t *ptr, uint8_t sz)
+{
+    while (sz--)
+        if (*ptr++)
+            return false;
+
+    return true;
+}
+
+static bool ujPrvImageDescIs(UjClass *cls, UInt24 desc, const char *str) // desc points to string const
+{
+    uint16_t len = ujThreadReadBE16_ex(cls->info.java.readD, desc + 1);
+
+    if (len != ujCstrlen(str))
+        return false;
+    for (desc += 3; len--; desc++)
+        if (ujReadClassByte(cls->info.java.readD, desc) != (uint8_t)*str++)
+            return false;
+
+    return true;
+}
+
+// calls cbk for each static with its type descriptor (string const addr) and data
+typedef uint8_t (*UjPrvStaticF)(UjClass *cls, UInt24 desc, uint16_t ofst, uint8_t *ptr, void *param);
+
+static uint8_t ujPrvForEachStatic(UjClass *cls, UjPrvStaticF cbk, void *param)
+{
+    void *readD = cls->info.java.readD;
+    UInt24 addr = cls->info.java.fields, desc = 0;
+    uint16_t numFields, ofst = 0;
+    uint8_t ret;
+
+    numFields = ujThreadReadBE16_ex(readD, addr - 2);
+
+    while (numFields--) {
+        if (ujThreadReadBE16_ex(readD, addr) & JAVA_ACC_STATIC) {
+            if (cls->ujc) {
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+                desc = ujThreadReadBE24_ex(readD, addr + 7);
+#endif
+            } else {
+#ifdef UJ_FTR_SUPPORT_CLASS_FORMAT
+                desc = ujThreadPrvFindConst_ex(cls, ujThreadReadBE16_ex(readD, addr + 4));
+#endif
+            }
+
+            ret = cbk(cls, desc, ofst, cls->data + cls->clsDataOfst + ofst, param);
+            if (ret != UJ_ERR_NONE)
+                return ret;
+
+            ofst += ujPrvJavaTypeToSize(ujReadClassByte(readD, desc + 3));
+        }
+
+        if (cls->ujc) {
+#ifdef UJ_FTR_SUPPORT_UJC_FORMAT
+            addr += 10;
+#endif
+        } else {
+#ifdef UJ_FTR_SUPPORT_CLASS_FORMAT
+            uint16_t n = ujThreadReadBE16_ex(readD, addr + 6);
+            addr += 8;
+            while (n--)
+                addr = ujPrvSkipAttribute(readD, addr);
+#endif
+        }
+    }
+
+    return UJ_ERR_NONE;
+}
+
+typedef struct
+{
+    ujStaticImageWriteF writeF;
+    void *userData;
+    HANDLE handle;
+    uint16_t numSeen;
+} UjPrvImageParam;
+
+static uint8_t ujPrvImageCountRefsF(UjClass *cls, UInt24 desc, _UNUSED_ uint16_t ofst, uint8_t *ptr, void *param)
+{
+    UjPrvImageParam *p = (UjPrvImageParam *)param;
+    char type = ujReadClassByte(cls->info.java.readD, desc + 3);
+
+    if ((type == JAVA_TYPE_ARRAY || type == JAVA_TYPE_OBJ) && (HANDLE)ujThreadPrvGet32(ptr) == p->handle)
+        p->numSeen++;
+
+    return UJ_ERR_NONE;
+}
+
+static uint8_t ujPrvImageStaticF(UjClass *cls, UInt24 desc, uint16_t ofst, uint8_t *ptr, void *param)
+{
+    UjPrvImageParam *p = (UjPrvImageParam *)param;
+    ujStaticImageWriteF writeF = p->writeF;
+    void *userData = p->userData;
+    char type = ujReadClassByte(cls->info.java.readD, desc + 3);
+    uint8_t sz = ujPrvJavaTypeToSize(type);
+    UjPrvImageParam cnt;
+    uint32_t i, len;
+    UjArray *arr;
+    HANDLE h;
+    bool ok;
+
+    if (ujPrvImageIsZero(ptr, (type == JAVA_TYPE_ARRAY || type == JAVA_TYPE_OBJ) ? 4 : sz))
+        return UJ_ERR_NONE;
+
+    if (type == JAVA_TYPE_ARRAY || type == JAVA_TYPE_OBJ) {
+        // the image would give every static its own copy, and "==" between them would break
+        cnt.handle = (HANDLE)ujThreadPrvGet32(ptr);
+        cnt.numSeen = 0;
+        ujPrvForEachStatic(cls, ujPrvImageCountRefsF, &cnt);
+        if (cnt.numSeen != 1)
+            return UJ_ERR_FALSE;
+    }
+
+    if (type == JAVA_TYPE_OBJ) {
+        if (!ujPrvImageDescIs(cls, desc, "Ljava/lang/String;"))
+            return UJ_ERR_FALSE;
+
+        h = (HANDLE)ujThreadPrvGet32(ptr);
+        len = ujStringGetBytes(h, NULL, 0) - 1;
+        {
+            uint8_t str[len + 1];
+
+            ujStringGetBytes(h, str, len + 1);
+            ok = ujPrvImagePut(writeF, userData, ofst, 2) &&
+                 ujPrvImagePut(writeF, userData, type, 1) &&
+                 ujPrvImagePut(writeF, userData, len, 2) &&
+                 (!writeF || !len || writeF(userData, str, len));
+        }
+    } else if (type == JAVA_TYPE_ARRAY) {
+        type = ujReadClassByte(cls->info.java.readD, desc + 4);
+        if (type == JAVA_TYPE_ARRAY || type == JAVA_TYPE_OBJ)
+            return UJ_ERR_FALSE;
+
+        h = (HANDLE)ujThreadPrvGet32(ptr);
+        sz = ujPrvJavaTypeToSize(type);
+        arr = ujHeapHandleLock(h);
+        if (arr->objType != OBJ_TYPE_ARRAY) { // already read-only, nothing to copy out of RAM
+            ujHeapHandleRelease(h);
+            return UJ_ERR_FALSE;
+        }
+        len = arr->length;
+        ok = ujPrvImagePut(writeF, userData, ofst, 2) &&
+             ujPrvImagePut(writeF, userData, JAVA_TYPE_ARRAY, 1) &&
+             ujPrvImagePut(writeF, userData, type, 1) &&
+             ujPrvImagePut(writeF, userData, len, 3);
+        for (i = 0; ok && i < len; i++)
+            ok = ujPrvImagePutValue(writeF, userData, arr->data + i * sz, sz);
+        ujHeapHandleRelease(h);
+    } else {
+        ok = ujPrvImagePut(writeF, userData, ofst, 2) &&
+             ujPrvImagePut(writeF, userData, type, 1) &&
+             ujPrvImagePutValue(writeF, userData, ptr, sz);
+    }
+
+    return ok ? UJ_ERR_NONE : UJ_ERR_INTERNAL;
+}
+
+uint8_t ujStaticImageExport(UjClass *cls, ujStaticImageWriteF writeF, void *userData)
+{
+    UjPrvImageParam p;
+    uint8_t ret;
+
+    if (cls->native)
+        return UJ_ERR_FALSE;
+
+    // validate everything before producing a single byte
+    p.writeF = NULL;
+    p.userData = NULL;
+    ret = ujPrvForEachStatic(cls, ujPrvImageStaticF, &p);
+    if (ret != UJ_ERR_NONE)
+        return ret;
+
+    p.writeF = writeF;
+    p.userData = userData;
+    return ujPrvForEachStatic(cls, ujPrvImageStaticF, &p);
+}
+
+#endif
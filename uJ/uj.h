@@ -6,6 +6,10 @@
 
 // callback types
 uint8_t ujReadClassByte(void *userData, uint32_t offset);
+#ifdef UJ_FTR_SYNCHRONIZATION
+uint32_t ujHostTimeMs(void); // any monotonic clock, for timed Object.wait()
+void ujHostSleepMs(uint32_t ms); // every thread waits, none can run for that long. may return early
+#endif
 
 // api
 
@@ -19,6 +23,7 @@ uint8_t ujReadClassByte(void *userData, uint32_t offset);
 #define UJ_ERR_METHOD_NONEXISTENT 3 // UnknownError [?]		ujThreadGoto to an invalid place
 #define UJ_ERR_DEPENDENCY_MISSING 4 // NoClassDefFoundError ujClassLoad fails because needed
                                     //                      superlcass is missing or otherwise class not found
+#define UJ_ERR_DEADLOCK 5           // InternalError [?]		every thread waits and none of them can be woken
 
 #define UJ_ERR_STACK_SPACE 16           // StackOverflowError
 #define UJ_ERR_METHOD_FLAGS_MISMATCH 17 // UnknownError [?]
@@ -30,6 +35,7 @@ uint8_t ujReadClassByte(void *userData, uint32_t offset);
 #define UJ_ERR_NULL_POINTER 23          // NullPointerException
 #define UJ_ERR_MON_STATE_ERR 24         // IllegalMonitorStateException	monitor state exception
 #define UJ_ERR_NEG_ARR_SZ 25            // NegativeArraySizeException
+#define UJ_ERR_ARRAY_READ_ONLY 26       // ArrayStoreException [?]	store into a read-only (ROM) array
 
 #define UJ_ERR_RETRY_LATER 50 // not an error, just retry later
 
@@ -38,10 +44,40 @@ uint8_t ujReadClassByte(void *userData, uint32_t offset);
 
 #define UJ_THREAD_QUANTUM 10 // instrs
 
+#define UJ_THREAD_PRIO_MIN  1
+#define UJ_THREAD_PRIO_NORM 5 // new threads start here
+#define UJ_THREAD_PRIO_MAX  10 // runnable threads always go before lower priority ones
+
+#ifdef UJ_OPT_INCREMENTAL_GC
+#ifndef UJ_GC_STEP
+#define UJ_GC_STEP 8 // objects the incremental GC walks after each quantum
+#endif
+#endif
+
+#ifdef UJ_OPT_COMPACT_HEADERS
+#ifndef UJ_MAX_CLASSES
+#define UJ_MAX_CLASSES 64 // objects hold an index into a table of this many classes
+#endif
+#endif
+
+#ifdef UJ_OPT_INVOKE_CACHE
+#ifndef UJ_INVOKE_CACHE_SZ
+#define UJ_INVOKE_CACHE_SZ 16 // call sites whose resolved target we remember, power of two
+#endif
+#endif
+
 typedef struct UjClass UjClass;
 typedef struct UjThread UjThread;
 typedef struct UjInstance UjInstance;
 
+#ifdef UJ_OPT_VM_CONTEXT // many VMs in one process, each OS thread runs the one it selected
+typedef struct UjVm UjVm;
+
+UjVm *ujVmNew(void); // select it, then ujInit() and go on as usual
+void ujVmFree(UjVm *vm);
+UjVm *ujVmSelect(UjVm *vm); // NULL for the default VM. returns the one selected before
+#endif
+
 uint8_t ujInit(UjClass **objectClsP);
 
 uint8_t ujLoadClass(void *readD, UjClass **clsP);
@@ -49,14 +85,36 @@ uint8_t ujLoadClass(void *readD, UjClass **clsP);
 uint8_t ujInitAllClasses(void);
 
 HANDLE ujThreadCreate(uint16_t stackSz /*zero for default*/);
+void ujThreadSetPriority(HANDLE threadH, uint8_t prio); // UJ_THREAD_PRIO_*, takes effect at the next quantum
 uint32_t ujThreadDbgGetPc(HANDLE threadH);
 uint8_t ujThreadGoto(HANDLE threadH, UjClass *cls, const char *methodNamePtr, const char *methodTypePtr); // static call only (used to call main or some such thing)
+uint16_t ujThreadStackSize(UjClass *cls, const char *methodNamePtr, const char *methodTypePtr); // stack bytes classCvt found a thread started there needs, zero if it could not tell
 bool ujCanRun(void);
 uint8_t ujInstr(void); // return UJ_ERR_*
 uint8_t ujThreadDestroy(HANDLE threadH);
 uint8_t ujGC(void); // called by heap manager
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+void ujHeapFinalize(void *data); // called by heap manager for UJ_HEAP_FINALIZE chunks it frees
+#endif
+#ifdef UJ_OPT_INCREMENTAL_GC
+bool ujGcStep(uint16_t budget); // walk up to budget objects, true while a cycle is still running. call when idle
+#endif
 uint32_t ujGetNumInstrs(void);
 
+#ifdef UJ_FTR_SNAPSHOT
+typedef bool (*ujSnapshotWriteF)(void *userData, const void *buf, uint32_t len); // all or nothing
+typedef bool (*ujSnapshotReadF)(void *userData, void *buf, uint32_t len);        // all or nothing
+
+uint8_t ujSnapshotSave(uint32_t pakHash, ujSnapshotWriteF writeF, void *userData); // right after ujInitAllClasses()
+uint8_t ujSnapshotRestore(uint32_t pakHash, ujSnapshotReadF readF, void *userData); // instead of ujInitAllClasses(). UJ_ERR_FALSE if snapshot does not match, UJ_ERR_INTERNAL if heap is now garbage
+#endif
+
+#ifdef UJ_FTR_STATIC_IMAGE_EXPORT
+typedef bool (*ujStaticImageWriteF)(void *userData, const void *buf, uint32_t len); // all or nothing
+
+uint8_t ujStaticImageExport(UjClass *cls, ujStaticImageWriteF writeF, void *userData); // after ujInitAllClasses(). UJ_ERR_FALSE if statics are not pure data
+#endif
+
 // some flags
 #define JAVA_ACC_PUBLIC       0x0001 // Declared public; may be accessed from outside its package.
 #define JAVA_ACC_PRIVATE      0x0002 // Declared private; accessible only within the defining class.
@@ -79,6 +137,11 @@ uint32_t ujArrayGetInt(uint32_t arr, uint32_t idx);
 void *ujArrayRawAccessStart(uint32_t arr);
 void ujArrayRawAccessFinish(uint32_t arr);
 uint8_t ujArrayNew(char type, int32_t len, HANDLE *arrP);
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+typedef void (*ujExtArrayReleaseF)(void *ptr, void *userData); // GC found the array unreachable, ptr is ours again
+
+uint8_t ujArrayNewExternal(char type, void *ptr, int32_t len, ujExtArrayReleaseF releaseF, void *userData, HANDLE *arrP); // primitive array whose elements stay at ptr (in VM byte order), releaseF may be NULL
+#endif
 uint16_t ujStringGetBytes(HANDLE handle, uint8_t *buf, uint32_t bufsize);
 uint8_t ujStringFromBytes(HANDLE *handleP, const uint8_t *str, uint16_t len); // if len is 0 str is assumed to be 0 terminated
 
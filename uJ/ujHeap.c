@@ -1,5 +1,15 @@
+#ifdef UJ_OPT_HEAP_MMAP
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #include "ujHeap.h"
 #include "uj.h"
+#include <string.h>
+#ifdef UJ_OPT_VM_CONTEXT
+#include <stdlib.h>
+#endif
 
 #ifdef DEBUG_HEAP
 #include <stdio.h>
@@ -26,12 +36,101 @@
 #error "heap too big!"
 #endif
 
-#define INITIAL_NUM_HANDLES UJ_HEAP_SZ / 8 / sizeof(SIZE)
+#define INITIAL_NUM_HANDLES UJ_HEAP_INITIAL_SZ / 32 / sizeof(SIZE) // table grows as needed, up to UJ_HEAP_MAX_HANDLES
+
+// free chunks are kept in lists by size class: bin N holds sizes of [2^N, 2^(N+1)) * HEAP_ALIGN
+#define NUM_BINS 16
+
+#ifdef UJ_OPT_VM_CONTEXT
+
+// each VM has its own heap state, ujHeapSelect() picks the one the calling thread works on
+struct UjHeap {
+    uint8_t *heap;
+#ifdef UJ_OPT_HEAP_MMAP
+    uint32_t heapSz;
+#endif
+    HANDLE markStack[UJ_HEAP_MARK_STACK_SZ];
+    uint16_t markStackDepth;
+    bool markStackOverflow;
+#ifdef UJ_OPT_HEAP_NURSERY
+    bool collecting;
+    bool minorGc;
+#endif
+#ifdef UJ_OPT_INCREMENTAL_GC
+    bool incMarking;
+    uint32_t incAllocated;
+#endif
+};
+
+#ifdef UJ_OPT_HEAP_MMAP
+static UjHeap gDefaultHeap;
+#else
+static uint8_t _HEAP_ATTRS_ __attribute__((aligned(HEAP_ALIGN))) gDefaultHeapMem[UJ_HEAP_SZ];
+static UjHeap gDefaultHeap = { .heap = gDefaultHeapMem };
+#endif
+static _Thread_local UjHeap *gCurHeap = &gDefaultHeap;
+
+#define gHeap              (gCurHeap->heap)
+#define gMarkStack         (gCurHeap->markStack)
+#define gMarkStackDepth    (gCurHeap->markStackDepth)
+#define gMarkStackOverflow (gCurHeap->markStackOverflow)
+#define gCollecting        (gCurHeap->collecting)
+#define gMinorGc           (gCurHeap->minorGc)
+#define gIncMarking        (gCurHeap->incMarking)
+#define gIncAllocated      (gCurHeap->incAllocated)
+#ifdef UJ_OPT_HEAP_MMAP
+#define gHeapSz            (gCurHeap->heapSz)
+#else
+#define gHeapSz            UJ_HEAP_SZ
+#endif
+
+#else
 
+#ifdef UJ_OPT_HEAP_MMAP
+static uint8_t *gHeap;   // UJ_HEAP_SZ of address space, reserved once
+static uint32_t gHeapSz; // how much of it is usable so far
+#else
 static uint8_t _HEAP_ATTRS_ __attribute__((aligned(HEAP_ALIGN))) gHeap[UJ_HEAP_SZ];
+#define gHeapSz UJ_HEAP_SZ
+#endif
+
+// handles newly marked 1, so GC need not scan for them. if it overflows we fall back to scanning
+static HANDLE gMarkStack[UJ_HEAP_MARK_STACK_SZ];
+static uint16_t gMarkStackDepth;
+static bool gMarkStackOverflow;
+
+#ifdef UJ_OPT_HEAP_NURSERY
+static bool gCollecting; // no write barrier while GC walks objects
+static bool gMinorGc;    // marking only reaches young chunks
+#endif
+
+#ifdef UJ_OPT_INCREMENTAL_GC
+static bool gIncMarking;       // an incremental cycle is running: 0 is white, 1 gray, 2 and 3 black
+static uint32_t gIncAllocated; // bytes handed out since the last cycle started
+#endif
+
+#endif
+
+static void ujHeapPrvMarkPush(HANDLE handle) {
+    if (gMarkStackDepth < UJ_HEAP_MARK_STACK_SZ)
+        gMarkStack[gMarkStackDepth++] = handle;
+    else
+        gMarkStackOverflow = true;
+}
 
 typedef struct {
     HANDLE numHandles; // handles are at start of heap
+    HANDLE freeHandle; // first unused handle, 0 for none
+    SIZE bins[NUM_BINS]; // first free chunk of each size class (offset in heap, 0 for none)
+#ifdef UJ_OPT_HEAP_NURSERY
+    uint32_t nursery;      // young chunks are bump-allocated in [nursery, nurseryTop) ...
+    uint32_t nurseryTop;
+    uint32_t nurseryEnd;   // ... up to here; wider than SIZE as it may equal the heap size
+    bool needsMajor;   // some young chunks could not be promoted, a minor GC would miss refs to them
+    bool rememberOverflow;
+    uint16_t numRemembered;
+    HANDLE remembered[UJ_HEAP_REMEMBER_SZ]; // old chunks locked (so maybe written) since last GC
+#endif
     uint8_t data[] __attribute__((aligned(HANDLE_SZ)));
 
 } UjHeapHdr;
@@ -42,8 +141,17 @@ typedef struct {
     uint8_t free : 1;
     uint8_t lock : 1;
     uint8_t mark : 2;
-    uint8_t wsze : 4; // wasted size (already included in "size") XXX:
-                    // ASSERT(CHUNK_HDR_SZ < (1 << wsze))
+    uint8_t pfree : 1; // chunk right before this one is free, its size is in the SIZE right before us
+    uint8_t dirty : 1; // old chunk in the remembered set
+    uint8_t leaf : 1;  // GC never looks inside (see UJ_HEAP_LEAF)
+    uint8_t pinned : 1; // large object, compaction leaves it where it is
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+    uint8_t wsze : 7;     // wasted size (already included in "size"), always small
+    uint8_t finalize : 1; // ujHeapFinalize() gets a look before GC frees it (see UJ_HEAP_FINALIZE)
+#else
+    uint8_t wsze;      // wasted size (already included in "size")
+#endif
+    HANDLE owner;      // handle pointing to us, for compaction (0 for nonmovable chunks)
 
     uint8_t data[] __attribute__((aligned(HEAP_ALIGN)));
 
@@ -52,6 +160,20 @@ typedef struct {
 #define CHUNK_HDR_SZ                                                           \
     (((offsetof(UjHeapChunk, data)) + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1))
 
+// a free chunk holds its list links at the start and a copy of its size (the boundary tag) at the end
+#define CHUNK_NEXT(c)   (((SIZE *)(c)->data)[0])
+#define CHUNK_PREV(c)   (((SIZE *)(c)->data)[1])
+#define CHUNK_FOOTER(c) (*(SIZE *)((c)->data + (c)->size - sizeof(SIZE)))
+#define MIN_CHUNK_SZ    ((3 * sizeof(SIZE) + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1))
+
+// unused handle slots hold the next unused handle (or 0), which is always below any chunk offset
+#define HANDLE_USED(hdr, v) ((v) > (hdr)->numHandles)
+
+#ifdef UJ_OPT_HEAP_NURSERY
+#define CHUNK_YOUNG(hdr, c)                                                    \
+    ((uint8_t *)(c) >= gHeap + (hdr)->nursery && (uint8_t *)(c) < gHeap + (hdr)->nurseryEnd)
+#endif
+
 #ifdef DEBUG_HEAP
 static void perr(const char *err) { fprintf(stderr, "%s", err); }
 #endif
@@ -68,44 +190,121 @@ static UjHeapChunk *ujHeapPrvGetFirstChunk(void) {
 static UjHeapChunk *ujHeapPrvGetNextChunk(UjHeapChunk *c) {
     c = (UjHeapChunk *)(c->data + c->size);
 
-    if ((uint8_t *)c >= gHeap + UJ_HEAP_SZ)
+    if ((uint8_t *)c >= gHeap + gHeapSz)
         c = NULL;
 
     return c;
 }
 
-static UjHeapChunk *ujHeapPrvGetPrevChunk(UjHeapChunk *c) { // VERY SLOW!!!!!!!
+static uint8_t ujHeapPrvBin(SIZE sz) {
+    uint8_t bin = 0;
 
-    UjHeapChunk *a, *t = ujHeapPrvGetFirstChunk();
+    sz /= HEAP_ALIGN;
+    while (sz >>= 1)
+        bin++;
 
-    while (t) {
-        a = ujHeapPrvGetNextChunk(t);
-        if (a == c)
-            return t;
-        t = a;
-    }
+    return bin < NUM_BINS ? bin : NUM_BINS - 1;
+}
+
+static void ujHeapPrvBinInsert(UjHeapChunk *chk) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    uint8_t bin = ujHeapPrvBin(chk->size);
+    UjHeapChunk *n;
 
-    return NULL;
+    chk->free = 1;
+    chk->lock = 0;
+    chk->wsze = 0;
+
+    CHUNK_NEXT(chk) = hdr->bins[bin];
+    CHUNK_PREV(chk) = 0;
+    if (hdr->bins[bin])
+        CHUNK_PREV((UjHeapChunk *)(gHeap + hdr->bins[bin])) = (uint8_t *)chk - gHeap;
+    hdr->bins[bin] = (uint8_t *)chk - gHeap;
+
+    CHUNK_FOOTER(chk) = chk->size;
+    n = ujHeapPrvGetNextChunk(chk);
+    if (n)
+        n->pfree = 1;
 }
 
-void ujHeapInit(void) {
+static void ujHeapPrvBinRemove(UjHeapChunk *chk) { // must be called before chk->size changes
     UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    UjHeapChunk *n;
+
+    if (CHUNK_PREV(chk))
+        CHUNK_NEXT((UjHeapChunk *)(gHeap + CHUNK_PREV(chk))) = CHUNK_NEXT(chk);
+    else
+        hdr->bins[ujHeapPrvBin(chk->size)] = CHUNK_NEXT(chk);
+    if (CHUNK_NEXT(chk))
+        CHUNK_PREV((UjHeapChunk *)(gHeap + CHUNK_NEXT(chk))) = CHUNK_PREV(chk);
+
+    n = ujHeapPrvGetNextChunk(chk);
+    if (n)
+        n->pfree = 0;
+}
+
+static UjHeapChunk *ujHeapPrvAllocChunk(uint32_t sz);
+
+bool ujHeapInit(void) {
+    UjHeapHdr *hdr;
     UjHeapChunk *chk;
-    SIZE *handleTable = (SIZE *)hdr->data;
+    SIZE *handleTable;
     SIZE i;
 
+#ifdef UJ_OPT_HEAP_MMAP
+    uint32_t page = sysconf(_SC_PAGESIZE);
+
+    if (!gHeap) {
+        gHeap = mmap(NULL, UJ_HEAP_SZ, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (gHeap == MAP_FAILED) {
+            gHeap = NULL;
+            return false;
+        }
+    }
+    gHeapSz = (UJ_HEAP_INITIAL_SZ + page - 1) & ~(page - 1);
+    if (gHeapSz > UJ_HEAP_SZ)
+        gHeapSz = UJ_HEAP_SZ & ~(HEAP_ALIGN - 1);
+    if (mprotect(gHeap, gHeapSz, PROT_READ | PROT_WRITE))
+        return false;
+#endif
+
+    hdr = (UjHeapHdr *)gHeap;
+    handleTable = (SIZE *)hdr->data;
     hdr->numHandles = INITIAL_NUM_HANDLES;
+    hdr->freeHandle = 1;
 
     for (i = 0; i < INITIAL_NUM_HANDLES; i++) {
-        handleTable[i] = 0;
+        handleTable[i] = i + 2;
+    }
+    handleTable[INITIAL_NUM_HANDLES - 1] = 0;
+
+    for (i = 0; i < NUM_BINS; i++) {
+        hdr->bins[i] = 0;
     }
 
     chk = ujHeapPrvGetFirstChunk();
 
-    chk->size = UJ_HEAP_SZ - (chk->data - gHeap);
-    chk->free = 1;
-    chk->lock = 0;
-    chk->wsze = 0;
+    chk->size = gHeapSz - (chk->data - gHeap);
+    chk->mark = 0;
+    chk->pfree = 0;
+    ujHeapPrvBinInsert(chk);
+
+#ifdef UJ_OPT_HEAP_NURSERY
+    hdr->numRemembered = 0;
+    hdr->rememberOverflow = false;
+    hdr->needsMajor = false;
+    hdr->nursery = hdr->nurseryTop = hdr->nurseryEnd = 0;
+
+    chk = ujHeapPrvAllocChunk(UJ_HEAP_NURSERY_SZ);
+    if (chk) { // no nursery if it does not fit
+        chk->lock = 1;
+        chk->owner = 0;
+        hdr->nursery = hdr->nurseryTop = chk->data - gHeap;
+        hdr->nurseryEnd = hdr->nursery + chk->size;
+    }
+#endif
+
+    return true;
 }
 
 #ifdef DEBUG_HEAP
@@ -119,9 +318,14 @@ void ujHeapDebug(void) {
     pr(stderr, " %u handles, data begins at 0x%08tX (0x%08tX)\n", hdr->numHandles,
        (uint8_t *)(handleTable + hdr->numHandles) - hdr->data,
        (uint8_t *)ujHeapPrvGetFirstChunk() - hdr->data);
+#ifdef UJ_OPT_HEAP_NURSERY
+    pr(stderr, " nursery 0x%08lX..0x%08lX, top 0x%08lX, %u remembered%s\n",
+       (unsigned long)hdr->nursery, (unsigned long)hdr->nurseryEnd, (unsigned long)hdr->nurseryTop,
+       hdr->numRemembered, hdr->rememberOverflow ? " (overflowed)" : "");
+#endif
 
     for (i = 0; i < hdr->numHandles; i++) {
-        if (handleTable[i]) {
+        if (HANDLE_USED(hdr, handleTable[i])) {
             pr(stderr, "HANDLE[%u] => 0x%08lX\n", i + 1,
                (unsigned long)handleTable[i]);
         }
@@ -158,9 +362,8 @@ void ujHeapDebug(void) {
 
 #endif
 
-static void ujHeapPrvFreeChunk(UjHeapChunk *chk, UjHeapChunk *prev) {
+static void ujHeapPrvFreeChunk(UjHeapChunk *chk) {
     UjHeapChunk *n;
-    UjHeapChunk *t = NULL;
 
     // step 1: debug checks
 
@@ -171,70 +374,87 @@ static void ujHeapPrvFreeChunk(UjHeapChunk *chk, UjHeapChunk *prev) {
         pe(" FREEING a free chunk\n");
     }
 
-    // step 2: find previous chuunk (if not given to us)
-    n = prev ? prev : ujHeapPrvGetPrevChunk(chk);
-
-    // step 3: merge with previous chunk, if it is also free. use up previous
-    // chunk's wasted space if it's not free
-    if (n) {
-        if (n->free) {
-            n->size += CHUNK_HDR_SZ + chk->size;
-            chk = n;
-        } else if (n->wsze) {
-            t = (UjHeapChunk *)(n->data + n->size - n->wsze);
-            t->size = chk->size + n->wsze;
-            n->size -= n->wsze;
-            n->wsze = 0;
-            chk = t;
-        }
+#ifdef UJ_OPT_HEAP_NURSERY
+    if (CHUNK_YOUNG((UjHeapHdr *)gHeap, chk)) { // young chunks stay in place till GC, unless it was the last one
+        UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+
+        chk->free = 1;
+        if (chk->data + chk->size == gHeap + hdr->nurseryTop)
+            hdr->nurseryTop = (uint8_t *)chk - gHeap;
+        return;
     }
+#endif
 
-    chk->free = 1;
-    chk->lock = 0;
-    chk->wsze = 0;
+    // step 2: merge with previous chunk if it is free, the boundary tag tells us where it starts
+    if (chk->pfree) {
+        n = (UjHeapChunk *)((uint8_t *)chk - *(SIZE *)((uint8_t *)chk - sizeof(SIZE)) - CHUNK_HDR_SZ);
+        ujHeapPrvBinRemove(n);
+        n->size += CHUNK_HDR_SZ + chk->size;
+        chk = n;
+    }
 
-    // merge with next chunk if it is free
+    // step 3: merge with next chunk if it is free
     n = ujHeapPrvGetNextChunk(chk);
     if (n && n->free) {
+        ujHeapPrvBinRemove(n);
         chk->size += CHUNK_HDR_SZ + n->size;
     }
+
+    ujHeapPrvBinInsert(chk);
 }
 
-static UjHeapChunk *ujHeapPrvAllocChunk(uint16_t sz) {
-    uint8_t *ret;
-    UjHeapChunk *chk = ujHeapPrvGetFirstChunk();
+static UjHeapChunk *ujHeapPrvAllocChunk(uint32_t sz) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    UjHeapChunk *chk = NULL;
     UjHeapChunk *fit = NULL;
+    uint8_t bin;
+    SIZE ofst;
 
+    if (sz >= gHeapSz)
+        return NULL;
     sz = (sz + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
-    while (chk) {
-        if (chk->free && chk->size >= sz && (!fit || fit->size >= chk->size))
+    if (sz < MIN_CHUNK_SZ)
+        sz = MIN_CHUNK_SZ;
+
+    // best fit among chunks of our own size class, any chunk of a bigger class will do
+    bin = ujHeapPrvBin(sz);
+    for (ofst = hdr->bins[bin]; ofst; ofst = CHUNK_NEXT(chk)) {
+        chk = (UjHeapChunk *)(gHeap + ofst);
+        if (chk->size >= sz && (!fit || fit->size > chk->size))
             fit = chk;
-        chk = ujHeapPrvGetNextChunk(chk);
+    }
+    while (!fit && ++bin < NUM_BINS) {
+        if (hdr->bins[bin])
+            fit = (UjHeapChunk *)(gHeap + hdr->bins[bin]);
     }
 
     // fit is now the chunk we'll use to back this allocation
     if (!fit)
         return NULL;
 
-    if (fit->size - sz > (int)(CHUNK_HDR_SZ)) { // splitting makes sense
+    ujHeapPrvBinRemove(fit);
+
+    if ((SIZE)(fit->size - sz) >= CHUNK_HDR_SZ + MIN_CHUNK_SZ) { // splitting makes sense, we take the end
         chk = fit;
         chk->size = fit->size - sz - CHUNK_HDR_SZ;
-        chk->free = 1;
-        chk->lock = 0;
-        chk->wsze = 0;
         fit = ujHeapPrvGetNextChunk(chk);
         fit->size = sz;
         fit->wsze = 0;
-    } else { // we cnanot split, let's at least record wasted size for later use
+        ujHeapPrvBinInsert(chk);
+    } else { // we cannot split, let's at least record wasted size for later use
         fit->wsze = fit->size - sz;
     }
 
     fit->free = 0;
     fit->lock = 0;
+    fit->mark = 0;
+    fit->dirty = 0;
+    fit->pinned = 0;
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+    fit->finalize = 0;
+#endif
 
-    ret = fit->data;
-    while (sz--)
-        *ret++ = 0;
+    memset(fit->data, 0, sz);
 
     return fit;
 }
@@ -242,150 +462,418 @@ static UjHeapChunk *ujHeapPrvAllocChunk(uint16_t sz) {
 // UjHeapChunk* ujHeapPrevGetPrevChunk(UjHeapChunk*)
 // UjHeapChunk* ujHeapNextGetPrevChunk(UjHeapChunk*)
 
+// slide all movable chunks towards the end of the heap. locked chunks stay put and
+// split the heap into segments, each of which ends up with one free chunk at its start
 static void ujHeapPrvCompact(void) {
     UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
     SIZE *handleTable = (SIZE *)hdr->data;
-    UjHeapChunk *c, *p, *pp, *f, tmp;
-    SIZE pos;
-    HANDLE i;
-
-    while (1) {
-        pp = p = f = NULL;
-
-        // the last free chunk preceded but an unlocked non-free chunk (chunk
-        // before the chunk before free one is stored in f
-        c = ujHeapPrvGetFirstChunk();
-        while (c) {
-            if (p && c->free && !p->lock && !p->free && (!pp || !pp->lock)) {
-                // we do not bother moving in cases where a movable chunk
-                // immediately follows a non-movable chunk since that does us no
-                // good
-                f = pp;
+    UjHeapChunk *seg, *c, *last, *end;
+    uint8_t *dst;
+    bool haveFree;
+    SIZE link, sz;
+
+    seg = ujHeapPrvGetFirstChunk();
+    while (seg) {
+
+        // pass 1: find the end of the segment, take its free chunks off the free lists and link
+        // its chunks backwards through their handle table slots, since chunks only link forwards
+        last = NULL;
+        haveFree = false;
+        for (c = seg; c && (c->free || (!c->lock && !c->pinned)); c = ujHeapPrvGetNextChunk(c)) {
+            if (c->free) {
+                ujHeapPrvBinRemove(c);
+                haveFree = true;
+            } else {
+                handleTable[c->owner - 1] = last ? (uint8_t *)last - gHeap : 0;
+                last = c;
             }
-            pp = p;
-            p = c;
-            c = ujHeapPrvGetNextChunk(c);
-        }
-        if (!f)
-            break;
-
-        pp = f;
-        p = pp ? ujHeapPrvGetNextChunk(pp) : ujHeapPrvGetFirstChunk();
-        c = ujHeapPrvGetNextChunk(p);
-        f = (UjHeapChunk *)(((uint8_t *)p) + CHUNK_HDR_SZ + c->size + p->wsze);
-
-        // now: c is free chunk, p is unlocked nonfree hcunk before p, pp is
-        // chunk before p or NULL if p is first, f is where new p will be
-
-        // now we copy data backwards to avoid overwrites
-        pos = p->size - p->wsze;
-        while (pos) {
-            pos--;
-            f->data[pos] = p->data[pos];
         }
-
-        // now copy chunk header (buffered locally to avoid compiler bugs on
-        // struct copy)
-        tmp = *p;
-        *f = tmp;
-
-        // now fix up the header since we no longer have wasted space
-        f->size -= f->wsze;
-
-        // now update handle table
-        pos = (uint8_t *)p - gHeap;
-        for (i = 0; i < hdr->numHandles; i++) {
-            if (handleTable[i] == pos) {
-                TL(" compact updating chunk %u from 0x%08X to 0x%08tX\n", i + 1,
-                   handleTable[i], (uint8_t *)f - gHeap);
-                handleTable[i] = (uint8_t *)f - gHeap;
-                break;
+        end = c;
+        dst = end ? (uint8_t *)end : gHeap + gHeapSz;
+
+        // pass 2: walk back, moving each chunk as far up as it goes (dropping wasted space) and
+        // pointing its handle at it. without any free space we just restore the handles
+        for (c = last; c; c = link ? (UjHeapChunk *)(gHeap + link) : NULL) {
+            link = handleTable[c->owner - 1];
+            if (haveFree) {
+                sz = CHUNK_HDR_SZ + c->size - c->wsze;
+                dst -= sz;
+                memmove(dst, c, sz);
+                c = (UjHeapChunk *)dst;
+                c->size -= c->wsze;
+                c->wsze = 0;
+                c->pfree = 0;
+                TL(" compact moved chunk %u to 0x%08tX\n", c->owner, dst - gHeap);
             }
+            handleTable[c->owner - 1] = (uint8_t *)c - gHeap;
         }
 
-        if (i == hdr->numHandles) {
-            pe("Handle repoint fail");
-            // fprintf(stderr," for 0x%08X -> 0x%08X\n", (uint8_t*)p - gHeap,
-            // (uint8_t*)f
-            // - gHeap);
+        // what is left at the start of the segment is one free chunk
+        if (haveFree) {
+            seg->size = dst - seg->data;
+            seg->mark = 0;
+            seg->pfree = 0;
+            ujHeapPrvBinInsert(seg);
         }
 
-        // now create chunk before the new data chunk. note we do not mark it
-        // free!
-        p->free = 0;
-        p->lock = 0;
-        p->wsze = 0;
-        p->size = (f->data - p->data) - CHUNK_HDR_SZ;
+        // skip the locked or pinned chunk ending this segment
+        seg = end ? ujHeapPrvGetNextChunk(end) : NULL;
+    }
+}
 
-        // now "free" this new chunk (effectively merge it with free space
-        // around, as needed)
-        ujHeapPrvFreeChunk(p, pp);
+static bool ujHeapPrvGrowHandles(void) { // grow handle table into the first chunk if it is free
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    SIZE *handleTable = (SIZE *)hdr->data;
+    UjHeapChunk *chk = ujHeapPrvGetFirstChunk();
+    UjHeapChunk tmp;
+    HANDLE i, num = hdr->numHandles / 2 + 1;
+    SIZE shift;
+
+    if (num > UJ_HEAP_MAX_HANDLES - hdr->numHandles)
+        num = UJ_HEAP_MAX_HANDLES - hdr->numHandles;
+    if (!num || !chk->free)
+        return false;
+
+    hdr->numHandles += num;
+    shift = (uint8_t *)ujHeapPrvGetFirstChunk() - (uint8_t *)chk;
+    hdr->numHandles -= num;
+    if (chk->size < shift + MIN_CHUNK_SZ)
+        return false;
+
+    TL("Growing handle table by %u handles\n", num);
+
+    ujHeapPrvBinRemove(chk);
+    tmp = *chk;
+    tmp.size -= shift;
+    chk = (UjHeapChunk *)((uint8_t *)chk + shift);
+    *chk = tmp;
+    ujHeapPrvBinInsert(chk);
+
+    for (i = hdr->numHandles + num; i > hdr->numHandles; i--) {
+        handleTable[i - 1] = hdr->freeHandle;
+        hdr->freeHandle = i;
     }
+    hdr->numHandles += num;
+
+    return true;
 }
 
-HANDLE ujHeapHandleNew(uint16_t sz) {
+#ifdef UJ_OPT_HEAP_NURSERY
+
+static UjHeapChunk *ujHeapPrvYoungAlloc(uint32_t sz) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    UjHeapChunk *chk = (UjHeapChunk *)(gHeap + hdr->nurseryTop);
+
+    if (sz > UJ_HEAP_NURSERY_SZ / 4)
+        return NULL;
+    sz = (sz + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    if (hdr->nurseryEnd - hdr->nurseryTop < CHUNK_HDR_SZ + sz)
+        return NULL;
+
+    hdr->nurseryTop += CHUNK_HDR_SZ + sz;
+
+    chk->size = sz;
+    chk->free = 0;
+    chk->lock = 0;
+    chk->mark = 0;
+    chk->pfree = 0;
+    chk->dirty = 0;
+    chk->pinned = 0;
+    chk->wsze = 0;
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+    chk->finalize = 0;
+#endif
+
+    memset(chk->data, 0, sz);
+
+    return chk;
+}
+
+static void ujHeapPrvRemember(HANDLE handle, UjHeapChunk *chk) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+
+    chk->dirty = 1;
+    if (hdr->numRemembered < UJ_HEAP_REMEMBER_SZ)
+        hdr->remembered[hdr->numRemembered++] = handle;
+    else
+        hdr->rememberOverflow = true;
+}
+
+// the remembered old chunks are where minor GC starts walking, besides the usual roots
+static void ujHeapPrvMarkRemembered(void) {
     UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
     SIZE *handleTable = (SIZE *)hdr->data;
-    UjHeapChunk *chk = NULL;
-    HANDLE i;
+    UjHeapChunk *chk;
+    HANDLE i, n = hdr->rememberOverflow ? hdr->numHandles : hdr->numRemembered;
 
-    TL("Start allocating new handle with size %u\n", sz);
+    for (i = 0; i < n; i++) {
+        HANDLE h = hdr->rememberOverflow ? i + 1 : hdr->remembered[i];
 
-    for (i = 0; i < hdr->numHandles; i++) {
-        if (!handleTable[i])
-            break;
+        if (!HANDLE_USED(hdr, handleTable[h - 1]))
+            continue;
+        chk = (UjHeapChunk *)(gHeap + handleTable[h - 1]);
+        if (chk->dirty && !chk->leaf && !CHUNK_YOUNG(hdr, chk)) {
+            chk->mark = 1;
+            ujHeapPrvMarkPush(h);
+        }
     }
+}
 
-    if (i != hdr->numHandles)
-        chk = ujHeapPrvAllocChunk(sz);
+// after GC nothing old points to young chunks anymore, except via chunks still locked
+static void ujHeapPrvForget(void) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    SIZE *handleTable = (SIZE *)hdr->data;
+    UjHeapChunk *chk;
+    bool all = hdr->rememberOverflow;
+    HANDLE i, n = all ? hdr->numHandles : hdr->numRemembered;
+
+    hdr->numRemembered = 0;
+    hdr->rememberOverflow = false;
+
+    for (i = 0; i < n; i++) {
+        HANDLE h = all ? i + 1 : hdr->remembered[i];
+
+        if (!HANDLE_USED(hdr, handleTable[h - 1]))
+            continue;
+        chk = (UjHeapChunk *)(gHeap + handleTable[h - 1]);
+        if (!chk->dirty || CHUNK_YOUNG(hdr, chk))
+            continue;
+        chk->dirty = 0;
+        if (chk->lock)
+            ujHeapPrvRemember(h, chk);
+    }
+}
+
+// free dead young chunks and move live ones out of the nursery. locked ones have to stay
+static void ujHeapPrvEvacuate(void) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    SIZE *handleTable = (SIZE *)hdr->data;
+    UjHeapChunk *chk, *old;
+    uint8_t *top = gHeap + hdr->nursery;
+    uint8_t *p;
+
+    hdr->needsMajor = false;
+
+    for (p = top; p < gHeap + hdr->nurseryTop; p = chk->data + chk->size) {
+        chk = (UjHeapChunk *)p;
 
-    if (i == hdr->numHandles || !chk) { // no handles or no space
+        if (chk->free)
+            continue;
 
+        if (!chk->lock && !chk->mark) {
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+            if (chk->finalize)
+                ujHeapFinalize(chk->data);
+#endif
+            handleTable[chk->owner - 1] = hdr->freeHandle;
+            hdr->freeHandle = chk->owner;
+            chk->free = 1;
+            continue;
+        }
+
+        if (!chk->lock && (old = ujHeapPrvAllocChunk(chk->size)) != NULL) {
+            memcpy(old->data, chk->data, chk->size);
+            old->mark = chk->mark;
+            old->leaf = chk->leaf;
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+            old->finalize = chk->finalize;
+#endif
+            old->owner = chk->owner;
+            handleTable[chk->owner - 1] = (uint8_t *)old - gHeap;
+            chk->free = 1;
+            continue;
+        }
+
+        top = chk->data + chk->size;
+        hdr->needsMajor = true;
+    }
+
+    hdr->nurseryTop = top - gHeap;
+}
+
+#endif
+
+static void ujHeapPrvCollect(bool minor) {
+#ifdef UJ_OPT_HEAP_NURSERY
+    gCollecting = true;
+    gMinorGc = minor;
+    if (minor) {
+        TL("Minor GC\n");
+#ifdef UJ_OPT_INCREMENTAL_GC
+        if (gIncMarking) // its marks would confuse us, the cycle starts over later
+            ujHeapUnmarkAll();
+#endif
+        gMarkStackDepth = 0;
+        gMarkStackOverflow = false;
+        ujHeapPrvMarkRemembered();
+        ujGC();
+    } else
+#else
+    (void)minor;
+#endif
+    {
         ujHeapUnmarkAll();
-        i = hdr->numHandles;
         ujGC();
         ujHeapFreeUnmarked();
         ujHeapPrvCompact();
-        chk = ujHeapPrvAllocChunk(sz);
     }
+#ifdef UJ_OPT_HEAP_NURSERY
+    ujHeapPrvEvacuate();
+    ujHeapPrvForget();
+    gMinorGc = false;
+    gCollecting = false;
+#endif
+}
 
-    if (!chk) {
-        pe(" OUT OF MEMORY\n");
-        return 0;
+#ifdef UJ_OPT_HEAP_MMAP
+
+// make more of the reserved space usable (half again what we have, or what sz needs) and free
+// it as a chunk at the end. returns the free chunk now ending the heap
+static UjHeapChunk *ujHeapPrvGrow(uint32_t sz) {
+    uint32_t page = sysconf(_SC_PAGESIZE), add = gHeapSz / 2;
+    UjHeapChunk *chk, *last, *n;
+
+    if (add < sz + 2 * CHUNK_HDR_SZ + MIN_CHUNK_SZ)
+        add = sz + 2 * CHUNK_HDR_SZ + MIN_CHUNK_SZ;
+    add = (add + page - 1) & ~(page - 1);
+    if (add > UJ_HEAP_SZ - gHeapSz)
+        add = (UJ_HEAP_SZ - gHeapSz) & ~(HEAP_ALIGN - 1);
+    if (add < CHUNK_HDR_SZ + MIN_CHUNK_SZ || mprotect(gHeap + gHeapSz, add, PROT_READ | PROT_WRITE))
+        return NULL;
+
+    TL("Growing heap by %u bytes\n", (unsigned)add);
+
+    for (last = ujHeapPrvGetFirstChunk(); (n = ujHeapPrvGetNextChunk(last)) != NULL; last = n)
+        ;
+
+    chk = (UjHeapChunk *)(gHeap + gHeapSz);
+    gHeapSz += add;
+    chk->size = add - CHUNK_HDR_SZ;
+    chk->free = 0;
+    chk->lock = 0;
+    chk->pfree = last->free;
+    ujHeapPrvFreeChunk(chk);
+
+    return last->free ? last : chk;
+}
+
+// the handle table can only grow into a free chunk right behind it. move whatever is there
+// into the spare chunk at the end of the heap until it can
+static bool ujHeapPrvClearFront(UjHeapChunk *spare) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    SIZE *handleTable = (SIZE *)hdr->data;
+    UjHeapChunk *c, *dst;
+    SIZE sz;
+
+    while (!ujHeapPrvGrowHandles()) {
+        c = ujHeapPrvGetFirstChunk();
+        if (c->free)
+            c = ujHeapPrvGetNextChunk(c);
+        if (!c || c == spare || c->lock || c->pinned)
+            return false;
+
+        sz = c->size - c->wsze;
+        if (spare->size < CHUNK_HDR_SZ + sz + MIN_CHUNK_SZ)
+            return false;
+
+        ujHeapPrvBinRemove(spare);
+        spare->size -= CHUNK_HDR_SZ + sz;
+        dst = ujHeapPrvGetNextChunk(spare);
+        memcpy(dst, c, CHUNK_HDR_SZ + sz);
+        dst->size = sz;
+        dst->wsze = 0;
+        ujHeapPrvBinInsert(spare);
+        handleTable[dst->owner - 1] = (uint8_t *)dst - gHeap;
+
+        ujHeapPrvFreeChunk(c);
     }
 
-    if (i == hdr->numHandles) {
-        for (i = 0; i < hdr->numHandles; i++) {
-            if (!handleTable[i])
-                break;
+    return true;
+}
+
+#endif
+
+HANDLE ujHeapHandleNewEx(uint32_t sz, uint8_t flags) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    SIZE *handleTable = (SIZE *)hdr->data;
+    UjHeapChunk *chk = NULL;
+    HANDLE i;
+
+    TL("Start allocating new handle with size %u\n", (unsigned)sz);
+
+#ifdef UJ_OPT_HEAP_NURSERY
+    // young objects go to the nursery. when it is full a minor GC empties it
+    if (!(flags & UJ_HEAP_TENURED) && (hdr->freeHandle || ujHeapPrvGrowHandles())) {
+        chk = ujHeapPrvYoungAlloc(sz);
+        if (!chk && hdr->nursery && sz <= UJ_HEAP_NURSERY_SZ / 4 && !hdr->needsMajor) {
+            ujHeapPrvCollect(true);
+            if (hdr->freeHandle)
+                chk = ujHeapPrvYoungAlloc(sz);
         }
     }
+#endif
 
-    if (i == hdr->numHandles) { // out of handles
+    if (!chk && (hdr->freeHandle || ujHeapPrvGrowHandles()))
+        chk = ujHeapPrvAllocChunk(sz);
 
-        pe(" OUT OF HANDLES\n");
-        ujHeapPrvFreeChunk(chk, NULL);
+    if (!chk) { // no handles or no space
+
+        ujHeapPrvCollect(false);
+        if (hdr->freeHandle || ujHeapPrvGrowHandles()) {
+            chk = ujHeapPrvAllocChunk(sz);
+        } else {
+            pe(" OUT OF HANDLES\n");
+        }
+    }
+
+#ifdef UJ_OPT_HEAP_MMAP
+    if (!chk) { // still no luck, time to take more memory
+        UjHeapChunk *spare = ujHeapPrvGrow(sz);
+
+        if (spare && (hdr->freeHandle || ujHeapPrvClearFront(spare)))
+            chk = ujHeapPrvAllocChunk(sz);
+    }
+#endif
+
+    if (!chk) {
+        pe(" OUT OF MEMORY\n");
         return 0;
     }
 
     // pr(stderr, "HEAP: handle.new (%d) sz=%d\n", i + 1, sz);
 
-    handleTable[i] = (uint8_t *)chk - gHeap;
+    i = hdr->freeHandle;
+    hdr->freeHandle = handleTable[i - 1];
+    handleTable[i - 1] = (uint8_t *)chk - gHeap;
+    chk->owner = i;
+    chk->leaf = !!(flags & UJ_HEAP_LEAF);
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+    chk->finalize = !!(flags & UJ_HEAP_FINALIZE);
+#endif
+    chk->pinned = sz >= UJ_HEAP_LARGE_SZ;
 
-    TL("Done allocating new handle with size %u -> (%d, 0x%08X)\n", sz, i + 1,
-       handleTable[i]);
+#ifdef UJ_OPT_INCREMENTAL_GC
+    if (gIncMarking) // allocate black, nothing points to it yet that marking could have missed
+        chk->mark = 3;
+    gIncAllocated += sz;
+#endif
 
-    return i + 1;
+    TL("Done allocating new handle with size %u -> (%d, 0x%08X)\n", (unsigned)sz, i,
+       handleTable[i - 1]);
+
+    return i;
 }
 
+HANDLE ujHeapHandleNew(uint32_t sz) { return ujHeapHandleNewEx(sz, 0); }
+
 /*
         it is a very bad idea to call this anytime once vm is running, since it
    will fragment heap. calling it before vm runs is ok, since it will allocate
    all at end safely.
 */
-void *ujHeapAllocNonmovable(uint16_t sz) {
-    HANDLE h = ujHeapHandleNew(
-        sz); // use this to allocae since it will triger GC as needed
+void *ujHeapAllocNonmovable(uint32_t sz) {
+    HANDLE h = ujHeapHandleNewEx(
+        sz, UJ_HEAP_TENURED | UJ_HEAP_LEAF); // use this to allocae since it will triger GC as needed
     UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
     SIZE *handleTable = (SIZE *)hdr->data;
     UjHeapChunk *chk;
@@ -397,8 +885,10 @@ void *ujHeapAllocNonmovable(uint16_t sz) {
                           handleTable[h - 1]); // free handle table slot since
                                                // this isnt a real handle
 
-    handleTable[h - 1] = 0;
+    handleTable[h - 1] = hdr->freeHandle;
+    hdr->freeHandle = h;
 
+    chk->owner = 0;
     chk->lock = 1;
     return chk->data;
 }
@@ -414,15 +904,16 @@ void ujHeapHandleFree(HANDLE handle) {
         pe("Freeing a NULL handle\n");
     }
 
-    if (!handleTable[handle - 1]) {
+    if (!HANDLE_USED(hdr, handleTable[handle - 1])) {
         pe("Freeing nonexistent chunk\n");
     }
 
     // pr(stderr, "HEAP: handle.free (%d)\n", handle);
 
-    handleTable[handle - 1] = 0;
+    handleTable[handle - 1] = hdr->freeHandle;
+    hdr->freeHandle = handle;
 
-    ujHeapPrvFreeChunk(chk, NULL);
+    ujHeapPrvFreeChunk(chk);
 }
 
 void *ujHeapHandleLock(HANDLE handle) {
@@ -436,7 +927,7 @@ void *ujHeapHandleLock(HANDLE handle) {
         pe("Locking a NULL handle\n");
     }
 
-    if (!handleTable[handle - 1]) {
+    if (!HANDLE_USED(hdr, handleTable[handle - 1])) {
         pe("Locking nonexistent chunk\n");
     }
     if (chk->lock) {
@@ -448,12 +939,37 @@ void *ujHeapHandleLock(HANDLE handle) {
 
     chk->lock = 1;
 
+#ifdef UJ_OPT_HEAP_NURSERY
+    // write barrier: whoever locks an old chunk may store young refs into it
+    if (!gCollecting && !chk->dirty && !chk->leaf && !CHUNK_YOUNG(hdr, chk))
+        ujHeapPrvRemember(handle, chk);
+#endif
+
+#ifdef UJ_OPT_INCREMENTAL_GC
+    // write barrier: whoever locks a black chunk may store white refs into it, so make it gray again
+    if (gIncMarking && chk->mark == 3 && !chk->leaf) {
+        chk->mark = 1;
+        ujHeapPrvMarkPush(handle);
+    }
+#endif
+
     TL("Do lock handle %d -> 0x%08tX (0x%08" PRIXPTR ")\n", handle, chk->data - gHeap,
        (uintptr_t)chk->data);
 
     return chk->data;
 }
 
+void *ujHeapHandlePeek(HANDLE handle) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    SIZE *handleTable = (SIZE *)hdr->data;
+
+    if (!handle || !HANDLE_USED(hdr, handleTable[handle - 1])) {
+        pe("Peeking at nonexistent chunk\n");
+    }
+
+    return ((UjHeapChunk *)(gHeap + handleTable[handle - 1]))->data;
+}
+
 void *ujHeapHandleIsLocked(HANDLE handle) {
     UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
     SIZE *handleTable = (SIZE *)hdr->data;
@@ -482,7 +998,7 @@ void ujHeapHandleRelease(HANDLE handle) {
         pe("Releasing a NULL handle\n");
     }
 
-    if (!handleTable[handle - 1]) {
+    if (!HANDLE_USED(hdr, handleTable[handle - 1])) {
         pe("Releasing nonexistent chunk\n");
     }
 
@@ -498,11 +1014,29 @@ void ujHeapHandleRelease(HANDLE handle) {
 
 void ujHeapUnmarkAll(void) {
     UjHeapChunk *chk = ujHeapPrvGetFirstChunk();
+#ifdef UJ_OPT_HEAP_NURSERY
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    uint8_t *p;
+#endif
+
+    gMarkStackDepth = 0;
+    gMarkStackOverflow = false;
+#ifdef UJ_OPT_INCREMENTAL_GC
+    gIncMarking = false; // any incremental cycle is over, this one marks from scratch
+    gIncAllocated = 0;
+#endif
 
     while (chk) {
         chk->mark = 0;
         chk = ujHeapPrvGetNextChunk(chk);
     }
+
+#ifdef UJ_OPT_HEAP_NURSERY
+    for (p = gHeap + hdr->nursery; p < gHeap + hdr->nurseryTop; p = chk->data + chk->size) {
+        chk = (UjHeapChunk *)p;
+        chk->mark = 0;
+    }
+#endif
 }
 
 void ujHeapFreeUnmarked(void) {
@@ -517,15 +1051,23 @@ void ujHeapFreeUnmarked(void) {
     // pr(stderr, "HEAP: GC.start\n");
 
     for (i = 0; i < hdr->numHandles; i++) {
-        if (handleTable[i]) {
+        if (HANDLE_USED(hdr, handleTable[i])) {
             TL("GC frees handle %d\n", i + 1);
 
             UjHeapChunk *chk = (UjHeapChunk *)(gHeap + handleTable[i]);
 
+#ifdef UJ_OPT_HEAP_NURSERY
+            if (CHUNK_YOUNG(hdr, chk)) // the nursery is swept on its own
+                continue;
+#endif
             if (!chk->mark && !chk->lock) {
 #ifdef DEBUG_HEAP
                 sNumFreed++;
                 sBytesFreed += chk->size;
+#endif
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+                if (chk->finalize)
+                    ujHeapFinalize(chk->data);
 #endif
                 ujHeapHandleFree(i + 1);
             }
@@ -540,13 +1082,32 @@ void ujHeapFreeUnmarked(void) {
 #endif
 }
 
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+void ujHeapFinalizeAll(void) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    SIZE *handleTable = (SIZE *)hdr->data;
+    UjHeapChunk *chk;
+    HANDLE i;
+
+    for (i = 0; i < hdr->numHandles; i++) {
+        if (!HANDLE_USED(hdr, handleTable[i]))
+            continue;
+        chk = (UjHeapChunk *)(gHeap + handleTable[i]);
+        if (chk->finalize) {
+            chk->finalize = 0;
+            ujHeapFinalize(chk->data);
+        }
+    }
+}
+#endif
+
 HANDLE ujHeapFirstMarked(uint8_t markVal) {
     UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
     SIZE *handleTable = (SIZE *)hdr->data;
     HANDLE t;
 
     for (t = 0; t < hdr->numHandles; t++) {
-        if (handleTable[t] &&
+        if (HANDLE_USED(hdr, handleTable[t]) &&
             ((UjHeapChunk *)(gHeap + handleTable[t]))->mark == markVal)
             return t + 1;
     }
@@ -564,13 +1125,179 @@ void ujHeapMark(HANDLE handle, uint8_t mark) {
 
     TL(" marking handle %u to level %u\n", handle, mark);
 
-    if (chk->mark < mark)
+#ifdef UJ_OPT_HEAP_NURSERY
+    if (gMinorGc && mark == 1 && !CHUNK_YOUNG(hdr, chk)) // old chunks count as live, the remembered set covers their refs
+        return;
+#endif
+
+    if (chk->mark < mark) {
+        if (!chk->mark && mark == 1)
+            ujHeapPrvMarkPush(handle);
         chk->mark = mark;
+    }
+}
+
+HANDLE ujHeapPopMarked(void) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    SIZE *handleTable = (SIZE *)hdr->data;
+    HANDLE handle;
+
+    while (1) {
+        while (gMarkStackDepth) {
+            handle = gMarkStack[--gMarkStackDepth];
+            if (HANDLE_USED(hdr, handleTable[handle - 1]) && // may have been freed since it got pushed
+                ((UjHeapChunk *)(gHeap + handleTable[handle - 1]))->mark == 1)
+                return handle;
+        }
+
+        if (!gMarkStackOverflow)
+            return 0;
+
+        // some marks did not fit, refill the stack from the handle table
+        TL(" mark stack overflowed, rescanning\n");
+        gMarkStackOverflow = false;
+        for (handle = 0; handle < hdr->numHandles; handle++) {
+            if (HANDLE_USED(hdr, handleTable[handle]) &&
+                ((UjHeapChunk *)(gHeap + handleTable[handle]))->mark == 1) {
+                if (gMarkStackDepth == UJ_HEAP_MARK_STACK_SZ) {
+                    gMarkStackOverflow = true;
+                    break;
+                }
+                gMarkStack[gMarkStackDepth++] = handle + 1;
+            }
+        }
+    }
+}
+
+#ifdef UJ_OPT_INCREMENTAL_GC
+
+bool ujHeapIncDue(void) { return gIncAllocated >= UJ_HEAP_INC_TRIGGER; }
+
+bool ujHeapIncMarking(void) { return gIncMarking; }
+
+void ujHeapIncBegin(void) {
+    ujHeapUnmarkAll();
+    gIncMarking = true;
 }
 
+void ujHeapIncRegrayLocked(void) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    SIZE *handleTable = (SIZE *)hdr->data;
+    UjHeapChunk *chk;
+    HANDLE i;
+
+    for (i = 0; i < hdr->numHandles; i++) {
+        if (!HANDLE_USED(hdr, handleTable[i]))
+            continue;
+        chk = (UjHeapChunk *)(gHeap + handleTable[i]);
+        if (chk->lock && chk->mark == 3 && !chk->leaf) {
+            chk->mark = 1;
+            ujHeapPrvMarkPush(i + 1);
+        }
+    }
+}
+
+void ujHeapIncEnd(void) {
+#ifdef UJ_OPT_HEAP_NURSERY
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    UjHeapChunk *chk;
+    uint8_t *p;
+#endif
+
+    gIncMarking = false;
+    ujHeapFreeUnmarked();
+
+#ifdef UJ_OPT_HEAP_NURSERY
+    // minor GC expects young chunks unmarked, dead ones among them are left to it
+    for (p = gHeap + hdr->nursery; p < gHeap + hdr->nurseryTop; p = chk->data + chk->size) {
+        chk = (UjHeapChunk *)p;
+        chk->mark = 0;
+    }
+#endif
+}
+
+#endif
+
+#ifdef UJ_OPT_VM_CONTEXT
+
+UjHeap *ujHeapNew(void) {
+    UjHeap *h = calloc(1, sizeof(UjHeap));
+
+#ifndef UJ_OPT_HEAP_MMAP // mmap heaps get their memory in ujHeapInit()
+    if (h && !(h->heap = calloc(1, UJ_HEAP_SZ))) { // zeroed: no handles until ujHeapInit()
+        free(h);
+        h = NULL;
+    }
+#endif
+
+    return h;
+}
+
+void ujHeapFree(UjHeap *h) {
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+    UjHeap *prev = gCurHeap;
+
+    if (h->heap) { // native memory still lent to the VM goes back now
+        gCurHeap = h;
+        ujHeapFinalizeAll();
+        gCurHeap = prev;
+    }
+#endif
+    if (gCurHeap == h)
+        gCurHeap = &gDefaultHeap;
+#ifdef UJ_OPT_HEAP_MMAP
+    if (h->heap)
+        munmap(h->heap, UJ_HEAP_SZ);
+#else
+    free(h->heap);
+#endif
+    free(h);
+}
+
+UjHeap *ujHeapSelect(UjHeap *h) {
+    UjHeap *prev = gCurHeap;
+
+    gCurHeap = h ? h : &gDefaultHeap;
+    return prev == &gDefaultHeap ? NULL : prev;
+}
+
+#endif
+
 uint8_t ujHeapGetMark(HANDLE handle) {
     UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
     SIZE *handleTable = (SIZE *)hdr->data;
 
     return ((UjHeapChunk *)(gHeap + handleTable[handle - 1]))->mark;
 }
+
+#ifdef UJ_FTR_SNAPSHOT
+
+uint8_t *ujHeapGetRaw(void) { return gHeap; }
+
+uint32_t ujHeapGetRawSize(void) { return gHeapSz; }
+
+bool ujHeapSetRawSize(uint32_t sz) {
+#ifdef UJ_OPT_HEAP_MMAP
+    if (sz > UJ_HEAP_SZ || (sz & (HEAP_ALIGN - 1)))
+        return false;
+    if (sz > gHeapSz && mprotect(gHeap, sz, PROT_READ | PROT_WRITE))
+        return false;
+    gHeapSz = sz;
+    return true;
+#else
+    return sz == UJ_HEAP_SZ;
+#endif
+}
+
+HANDLE ujHeapNextHandle(HANDLE handle) {
+    UjHeapHdr *hdr = (UjHeapHdr *)gHeap;
+    SIZE *handleTable = (SIZE *)hdr->data;
+
+    while (handle < hdr->numHandles) {
+        if (HANDLE_USED(hdr, handleTable[handle++]))
+            return handle;
+    }
+    return 0;
+}
+
+#endif
@@ -10,6 +10,37 @@
 
 #define UJ_HEAP_MAX_HANDLES (UJ_HEAP_SZ / 8)
 
+#ifdef UJ_OPT_HEAP_MMAP // linux: UJ_HEAP_SZ is only reserved, the heap starts this big and grows as needed
+#ifndef UJ_HEAP_INITIAL_SZ
+#define UJ_HEAP_INITIAL_SZ (UJ_HEAP_SZ < 0x10000 ? UJ_HEAP_SZ : 0x10000)
+#endif
+#else
+#define UJ_HEAP_INITIAL_SZ UJ_HEAP_SZ
+#endif
+
+#ifndef UJ_HEAP_LARGE_SZ
+#define UJ_HEAP_LARGE_SZ 0x4000 // objects this big are never moved by compaction
+#endif
+
+#ifndef UJ_HEAP_MARK_STACK_SZ
+#define UJ_HEAP_MARK_STACK_SZ 32
+#endif
+
+#ifdef UJ_OPT_HEAP_NURSERY
+#ifndef UJ_HEAP_NURSERY_SZ
+#define UJ_HEAP_NURSERY_SZ (UJ_HEAP_SZ / 8 < 0x4000 ? UJ_HEAP_SZ / 8 : 0x4000)
+#endif
+#ifndef UJ_HEAP_REMEMBER_SZ
+#define UJ_HEAP_REMEMBER_SZ 16
+#endif
+#endif
+
+#ifdef UJ_OPT_INCREMENTAL_GC
+#ifndef UJ_HEAP_INC_TRIGGER
+#define UJ_HEAP_INC_TRIGGER (UJ_HEAP_SZ / 4) // bytes allocated before the next incremental GC cycle starts
+#endif
+#endif
+
 #if UJ_HEAP_MAX_HANDLES < (1UL << 8)
 #define HANDLE uint8_t
 #define HANDLE_SZ HEAP_ALIGN
@@ -23,21 +54,57 @@
 #error "too many heap handles possible!"
 #endif
 
-void ujHeapInit(void);
+bool ujHeapInit(void); // false if the heap memory could not be had
+
+#ifdef UJ_OPT_VM_CONTEXT // several heaps, each thread works on the one it selected (the default one if none)
+typedef struct UjHeap UjHeap;
+
+UjHeap *ujHeapNew(void); // still needs ujHeapInit() once selected
+void ujHeapFree(UjHeap *h);
+UjHeap *ujHeapSelect(UjHeap *h); // NULL for the default heap. returns the one selected before
+#endif
 void ujHeapDebug(void);
 
-HANDLE ujHeapHandleNew(uint16_t sz);
+// flags for ujHeapHandleNewEx()
+#define UJ_HEAP_TENURED 1 // never in the nursery, for chunks that stay locked for long
+#define UJ_HEAP_LEAF    2 // holds no handles GC follows from it (raw data, primitive arrays, threads)
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+#define UJ_HEAP_FINALIZE 4 // GC calls ujHeapFinalize() on it before freeing it. use with UJ_HEAP_TENURED
+#endif
+
+HANDLE ujHeapHandleNew(uint32_t sz);
+HANDLE ujHeapHandleNewEx(uint32_t sz, uint8_t flags);
 void ujHeapHandleFree(HANDLE handle);
-void *ujHeapAllocNonmovable(uint16_t sz);
+void *ujHeapAllocNonmovable(uint32_t sz);
 
 void *ujHeapHandleLock(HANDLE handle);
 void ujHeapHandleRelease(HANDLE handle);
 void *ujHeapHandleIsLocked(HANDLE handle); // return pointer if already locked, else NULL
+void *ujHeapHandlePeek(HANDLE handle); // where it is now, no lock and no write barrier. good until the next allocation
 
 void ujHeapUnmarkAll(void);
 void ujHeapFreeUnmarked(void);
+#ifdef UJ_FTR_EXTERNAL_ARRAYS
+void ujHeapFinalizeAll(void); // ujHeapFinalize() every live chunk that asked for it, the heap is going away
+#endif
 HANDLE ujHeapFirstMarked(uint8_t markVal); // get first handle with a given mark value
+HANDLE ujHeapPopMarked(void); // get a handle marked 1 since the last unmark, 0 if none are left
 void ujHeapMark(HANDLE handle, uint8_t mark); // will only increase the mark value
 uint8_t ujHeapGetMark(HANDLE handle);
 
+#ifdef UJ_OPT_INCREMENTAL_GC
+bool ujHeapIncDue(void);            // enough was allocated since the last cycle to start another
+bool ujHeapIncMarking(void);        // a cycle is running, locking a marked chunk makes it gray again
+void ujHeapIncBegin(void);          // unmark everything and start a cycle
+void ujHeapIncRegrayLocked(void);   // chunks still locked may be written without another lock
+void ujHeapIncEnd(void);            // free what is still unmarked and end the cycle
+#endif
+
+#ifdef UJ_FTR_SNAPSHOT
+uint8_t *ujHeapGetRaw(void); // whole heap area (ujHeapGetRawSize() bytes), handle table included
+uint32_t ujHeapGetRawSize(void);
+bool ujHeapSetRawSize(uint32_t sz); // before loading a raw heap of that size, false if we cannot have it
+HANDLE ujHeapNextHandle(HANDLE handle); // next handle in use after the given one, 0 to start/when done
+#endif
+
 #endif